@@ -26,9 +26,11 @@ struct dht_prototype azureus_dht_prototype = {
     constructor:        azureus_dht_new,
     destructor:         azureus_dht_delete,
     put:                azureus_dht_put,
+    put_batch:          azureus_dht_put_batch,
     get:                azureus_dht_get,
     rpc_rx:             azureus_dht_rpc_rx,
     task_schedule:      azureus_dht_task_schedule,
+    snapshot_load:      azureus_dht_snapshot_load,
     exit:               azureus_dht_exit
 };
 
@@ -17,23 +17,34 @@
  ***************************************************************************/
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "azureus_db.h"
 #include "debug.h"
 #include "crypto.h"
 
+static void azureus_db_table_rehash_step(struct azureus_db_table *dt);
+static struct azureus_db_cache_entry * azureus_db_cache_slot(
+                            struct azureus_db_cache *dc, 
+                            struct azureus_db_key *key);
+static void azureus_db_cache_clear(struct azureus_db_cache_entry *e);
+
 struct azureus_db_key *
-azureus_db_key_new(void)
+azureus_db_key_new(u8 len)
 {
     struct azureus_db_key *k = NULL;
+    size_t size;
+
+    size = offsetof(struct azureus_db_key, data) + len;
 
-    k = (struct azureus_db_key *) malloc(sizeof(struct azureus_db_key));
+    k = (struct azureus_db_key *) malloc(size);
     if (!k) {
         return NULL;
     }
 
-    bzero(k, sizeof(struct azureus_db_key));
+    bzero(k, size);
+    k->len = len;
 
     return k;
 }
@@ -44,6 +55,16 @@ azureus_db_key_delete(struct azureus_db_key *key)
     free(key);
 }
 
+void
+azureus_db_key_copy(struct azureus_db_key *dst, struct azureus_db_key *src)
+{
+    ASSERT(dst && src);
+
+    /* src may be short, so never copy the whole struct */
+    dst->len = src->len;
+    memcpy(dst->data, src->data, src->len);
+}
+
 bool
 azureus_db_key_equal(struct azureus_db_key *k1, struct azureus_db_key *k2)
 {
@@ -60,17 +81,82 @@ azureus_db_key_equal(struct azureus_db_key *k1, struct azureus_db_key *k2)
     return TRUE;
 }
 
+int
+azureus_db_orig_set(struct azureus_db_orig *orig, struct sockaddr_storage *ss, 
+                    u8 proto_ver)
+{
+    struct sockaddr_in *sin4 = NULL;
+    struct sockaddr_in6 *sin6 = NULL;
+
+    ASSERT(orig && ss);
+
+    bzero(orig, sizeof(struct azureus_db_orig));
+
+    switch (ss->ss_family) {
+        case AF_INET:
+            sin4 = (struct sockaddr_in *)ss;
+            memcpy(orig->addr, &sin4->sin_addr, sizeof(struct in_addr));
+            orig->port = sin4->sin_port;
+            break;
+
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *)ss;
+            memcpy(orig->addr, &sin6->sin6_addr, sizeof(struct in6_addr));
+            orig->port = sin6->sin6_port;
+            break;
+
+        default:
+            return FAILURE;
+    }
+
+    orig->family = ss->ss_family;
+    orig->proto_ver = proto_ver;
+
+    return SUCCESS;
+}
+
+void
+azureus_db_orig_get_addr(struct azureus_db_orig *orig, 
+                            struct sockaddr_storage *ss)
+{
+    struct sockaddr_in *sin4 = NULL;
+    struct sockaddr_in6 *sin6 = NULL;
+
+    ASSERT(orig && ss);
+
+    bzero(ss, sizeof(struct sockaddr_storage));
+    ss->ss_family = orig->family;
+
+    switch (orig->family) {
+        case AF_INET:
+            sin4 = (struct sockaddr_in *)ss;
+            memcpy(&sin4->sin_addr, orig->addr, sizeof(struct in_addr));
+            sin4->sin_port = orig->port;
+            break;
+
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *)ss;
+            memcpy(&sin6->sin6_addr, orig->addr, sizeof(struct in6_addr));
+            sin6->sin6_port = orig->port;
+            break;
+
+        default:
+            break;
+    }
+}
+
 struct azureus_db_val *
-azureus_db_val_new(void)
+azureus_db_val_new(u16 len)
 {
     struct azureus_db_val *v = NULL;
 
-    v = (struct azureus_db_val *) malloc(sizeof(struct azureus_db_val));
+    v = (struct azureus_db_val *) malloc(sizeof(struct azureus_db_val) + len);
     if (!v) {
         return NULL;
     }
 
     bzero(v, sizeof(struct azureus_db_val));
+    v->len = len;
 
     return v;
 }
@@ -113,6 +199,23 @@ azureus_db_valset_delete(struct azureus_db_valset *vs)
     free(vs);
 }
 
+bool
+azureus_db_valset_has_val(struct azureus_db_valset *vs, 
+                                struct azureus_db_val *v)
+{
+    struct azureus_db_val *w = NULL;
+
+    ASSERT(vs && v);
+
+    TAILQ_FOREACH(w, &vs->val_list, next) {
+        if ((w->len == v->len) && (memcmp(w->data, v->data, v->len) == 0)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 int
 azureus_db_valset_add_val(struct azureus_db_valset *vs, u8 *val, int val_len)
 {
@@ -120,11 +223,13 @@ azureus_db_valset_add_val(struct azureus_db_valset *vs, u8 *val, int val_len)
 
     ASSERT(vs && (val_len > 0) && val);
 
-    v = azureus_db_val_new();
+    v = azureus_db_val_new(val_len);
     if (!v) {
         return FAILURE;
     }
 
+    memcpy(v->data, val, val_len);
+
     vs->n_vals++;
 
     TAILQ_INSERT_TAIL(&vs->val_list, v, next);
@@ -151,7 +256,8 @@ azureus_db_item_new(struct azureus_dht *ad, struct azureus_db_key *db_key,
     db_item->valset = db_valset;
     db_item->cr_time = dht_get_current_time();
 
-    TAILQ_INIT(&db_item->node_list);
+    timer_init(&db_item->expire_timer);
+    timer_init(&db_item->republish_timer);
 
     return db_item;
 }
@@ -172,6 +278,25 @@ azureus_db_item_delete(struct azureus_db_item *item)
 
     return;
 }
+size_t
+azureus_db_item_mem(struct azureus_db_item *item)
+{
+    struct azureus_db_val *v = NULL;
+    size_t mem;
+
+    ASSERT(item && item->key && item->valset);
+
+    mem = sizeof(struct azureus_db_item) 
+            + offsetof(struct azureus_db_key, data) + item->key->len
+            + sizeof(struct azureus_db_valset);
+
+    TAILQ_FOREACH(v, &item->valset->val_list, next) {
+        mem += sizeof(struct azureus_db_val) + v->len;
+    }
+
+    return mem;
+}
+
 #if 0
 int
 azureus_db_item_set_key(struct azureus_db_item *item, u8 *key, int key_len)
@@ -231,3 +356,352 @@ azureus_db_item_match_key(struct azureus_db_item *item, u8 *key, int key_len)
     return FALSE;
 }
 #endif
+
+int
+azureus_db_table_new(struct azureus_db_table *dt)
+{
+    ASSERT(dt);
+
+    bzero(dt, sizeof(struct azureus_db_table));
+
+    dt->chain[0] = (struct azureus_db_item **) 
+            malloc(AZUREUS_DB_TABLE_INIT_SIZE*sizeof(struct azureus_db_item *));
+    if (!dt->chain[0]) {
+        return FAILURE;
+    }
+
+    bzero(dt->chain[0], 
+            AZUREUS_DB_TABLE_INIT_SIZE*sizeof(struct azureus_db_item *));
+    dt->size[0] = AZUREUS_DB_TABLE_INIT_SIZE;
+
+    return SUCCESS;
+}
+
+void
+azureus_db_table_delete(struct azureus_db_table *dt)
+{
+    ASSERT(dt);
+
+    if (dt->chain[0]) {
+        free(dt->chain[0]);
+    }
+
+    if (dt->chain[1]) {
+        free(dt->chain[1]);
+    }
+
+    bzero(dt, sizeof(struct azureus_db_table));
+}
+
+int
+azureus_db_table_add(struct azureus_db_table *dt, struct azureus_db_item *item)
+{
+    struct azureus_db_item **head = NULL;
+    int t;
+
+    ASSERT(dt && item && item->key);
+
+    azureus_db_table_rehash_step(dt);
+
+    /* start growing at a load factor of 1, if that fails keep chaining
+     * in the current table */
+    if (!dt->chain[1] && (dt->n_items >= dt->size[0])) {
+        dt->chain[1] = (struct azureus_db_item **) 
+                    malloc(2*dt->size[0]*sizeof(struct azureus_db_item *));
+        if (dt->chain[1]) {
+            bzero(dt->chain[1], 
+                    2*dt->size[0]*sizeof(struct azureus_db_item *));
+            dt->size[1] = 2*dt->size[0];
+            dt->rehash_pos = 0;
+        }
+    }
+
+    /* new items always go to the table being grown into */
+    t = dt->chain[1] ? 1 : 0;
+    head = &dt->chain[t][azureus_db_table_hash(item->key) & (dt->size[t] - 1)];
+
+    item->hash_next = *head;
+    *head = item;
+    dt->n_items++;
+
+    return SUCCESS;
+}
+
+int
+azureus_db_table_remove(struct azureus_db_table *dt, 
+                        struct azureus_db_item *item)
+{
+    struct azureus_db_item **pp = NULL;
+    int t;
+
+    ASSERT(dt && item && item->key);
+
+    azureus_db_table_rehash_step(dt);
+
+    for (t = 0; t < 2; t++) {
+        if (!dt->chain[t]) {
+            continue;
+        }
+
+        for (pp = &dt->chain[t][azureus_db_table_hash(item->key) 
+                                    & (dt->size[t] - 1)]; 
+                *pp; pp = &(*pp)->hash_next) {
+            if (*pp == item) {
+                *pp = item->hash_next;
+                item->hash_next = NULL;
+                dt->n_items--;
+                return SUCCESS;
+            }
+        }
+    }
+
+    return FAILURE;
+}
+
+struct azureus_db_item *
+azureus_db_table_find(struct azureus_db_table *dt, struct azureus_db_key *key)
+{
+    struct azureus_db_item *item = NULL;
+    u64 h;
+    int t;
+
+    ASSERT(dt && key);
+
+    azureus_db_table_rehash_step(dt);
+
+    h = azureus_db_table_hash(key);
+
+    for (t = 0; t < 2; t++) {
+        if (!dt->chain[t]) {
+            continue;
+        }
+
+        for (item = dt->chain[t][h & (dt->size[t] - 1)]; item; 
+                item = item->hash_next) {
+            if (azureus_db_key_equal(item->key, key)) {
+                return item;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+u64
+azureus_db_table_hash(struct azureus_db_key *key)
+{
+    u64 h = 0;
+
+    /* db keys are SHA-1 digests, so their first bytes are already well
+     * mixed; the multiply only matters for odd short keys */
+    memcpy(&h, key->data, key->len < sizeof(h) ? key->len : sizeof(h));
+    h ^= key->len;
+
+    return (h * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static void
+azureus_db_table_rehash_step(struct azureus_db_table *dt)
+{
+    struct azureus_db_item *item = NULL, *itemn = NULL;
+    struct azureus_db_item **head = NULL;
+    int n;
+
+    if (!dt->chain[1]) {
+        return;
+    }
+
+    for (n = 0; (n < AZUREUS_DB_TABLE_REHASH_STEP) 
+                    && (dt->rehash_pos < dt->size[0]); n++) {
+
+        for (item = dt->chain[0][dt->rehash_pos]; item; item = itemn) {
+            itemn = item->hash_next;
+            head = &dt->chain[1][azureus_db_table_hash(item->key) 
+                                    & (dt->size[1] - 1)];
+            item->hash_next = *head;
+            *head = item;
+        }
+
+        dt->chain[0][dt->rehash_pos++] = NULL;
+    }
+
+    if (dt->rehash_pos < dt->size[0]) {
+        return;
+    }
+
+    /* every chain has moved, the new table takes over */
+    free(dt->chain[0]);
+    dt->chain[0] = dt->chain[1];
+    dt->size[0] = dt->size[1];
+    dt->chain[1] = NULL;
+    dt->size[1] = 0;
+    dt->rehash_pos = 0;
+}
+
+int
+azureus_db_cache_new(struct azureus_db_cache *dc)
+{
+    u32 i;
+
+    ASSERT(dc);
+
+    bzero(dc, sizeof(struct azureus_db_cache));
+
+    dc->slot = (struct azureus_db_cache_entry *) 
+        calloc(AZUREUS_DB_CACHE_SIZE, sizeof(struct azureus_db_cache_entry));
+    if (!dc->slot) {
+        return FAILURE;
+    }
+
+    dc->size = AZUREUS_DB_CACHE_SIZE;
+
+    for (i = 0; i < dc->size; i++) {
+        TAILQ_INIT(&dc->slot[i].node_list);
+    }
+
+    return SUCCESS;
+}
+
+void
+azureus_db_cache_delete(struct azureus_db_cache *dc)
+{
+    u32 i;
+
+    ASSERT(dc);
+
+    if (dc->slot) {
+        for (i = 0; i < dc->size; i++) {
+            azureus_db_cache_clear(&dc->slot[i]);
+        }
+        free(dc->slot);
+    }
+
+    bzero(dc, sizeof(struct azureus_db_cache));
+}
+
+/* the entry of key, with whatever has expired dropped, or NULL if there
+ * is nothing left of it */
+struct azureus_db_cache_entry *
+azureus_db_cache_find(struct azureus_db_cache *dc, struct azureus_db_key *key,
+                        u64 curr_time)
+{
+    struct azureus_db_cache_entry *e = NULL;
+
+    ASSERT(dc && key);
+
+    e = azureus_db_cache_slot(dc, key);
+    if (!e->key || !azureus_db_key_equal(e->key, key)) {
+        return NULL;
+    }
+
+    if (e->valset && (curr_time >= e->val_expire)) {
+        azureus_db_valset_delete(e->valset);
+        e->valset = NULL;
+    }
+
+    if (e->n_nodes && (curr_time >= e->node_expire)) {
+        azureus_db_cache_flush_nodes(e);
+    }
+
+    if (!e->valset && !e->n_nodes) {
+        azureus_db_cache_clear(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+/* the entry of key, which replaces whatever other key was in its slot */
+struct azureus_db_cache_entry *
+azureus_db_cache_add(struct azureus_db_cache *dc, struct azureus_db_key *key)
+{
+    struct azureus_db_cache_entry *e = NULL;
+
+    ASSERT(dc && key);
+
+    e = azureus_db_cache_slot(dc, key);
+    if (e->key && azureus_db_key_equal(e->key, key)) {
+        return e;
+    }
+
+    azureus_db_cache_clear(e);
+
+    e->key = azureus_db_key_new(key->len);
+    if (!e->key) {
+        return NULL;
+    }
+
+    azureus_db_key_copy(e->key, key);
+
+    return e;
+}
+
+/* the entry takes over valset */
+void
+azureus_db_cache_set_valset(struct azureus_db_cache_entry *e, 
+                            struct azureus_db_valset *valset, u64 expire)
+{
+    ASSERT(e && valset);
+
+    if (e->valset) {
+        azureus_db_valset_delete(e->valset);
+    }
+
+    e->valset = valset;
+    e->val_expire = expire;
+}
+
+/* forget the values cached for key, its nodes are still good */
+void
+azureus_db_cache_drop_valset(struct azureus_db_cache *dc, 
+                            struct azureus_db_key *key)
+{
+    struct azureus_db_cache_entry *e = NULL;
+
+    ASSERT(dc && key);
+
+    e = azureus_db_cache_slot(dc, key);
+    if (!e->key || !azureus_db_key_equal(e->key, key) || !e->valset) {
+        return;
+    }
+
+    azureus_db_valset_delete(e->valset);
+    e->valset = NULL;
+}
+
+void
+azureus_db_cache_flush_nodes(struct azureus_db_cache_entry *e)
+{
+    struct node *tn = NULL, *tnn = NULL;
+
+    ASSERT(e);
+
+    TAILQ_FOREACH_SAFE(tn, &e->node_list, next, tnn) {
+        TAILQ_REMOVE(&e->node_list, tn, next);
+        azureus_node_delete(azureus_node_get_ref(tn));
+    }
+
+    e->n_nodes = 0;
+}
+
+static struct azureus_db_cache_entry *
+azureus_db_cache_slot(struct azureus_db_cache *dc, struct azureus_db_key *key)
+{
+    return &dc->slot[azureus_db_table_hash(key) & (dc->size - 1)];
+}
+
+static void
+azureus_db_cache_clear(struct azureus_db_cache_entry *e)
+{
+    if (e->key) {
+        azureus_db_key_delete(e->key);
+        e->key = NULL;
+    }
+
+    if (e->valset) {
+        azureus_db_valset_delete(e->valset);
+        e->valset = NULL;
+    }
+
+    azureus_db_cache_flush_nodes(e);
+}
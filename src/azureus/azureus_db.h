@@ -20,10 +20,53 @@
 #define __AZUREUS_DB_H__
 
 struct azureus_db_key;
+struct azureus_db_item;
+struct azureus_db_cache_entry;
 struct azureus_rpc_msg;
 
 #include "types.h"
+
+/* chained hash table of the db items, keyed on the db key. It grows by
+ * moving a few chains per operation into a table twice the size, so no
+ * single store or lookup pays for a full rehash. azureus_dht.h embeds 
+ * it, so it is defined ahead of the includes. */
+#define AZUREUS_DB_TABLE_INIT_SIZE      256     /* must be a power of 2 */
+#define AZUREUS_DB_TABLE_REHASH_STEP    4       /* chains per operation */
+
+struct azureus_db_table {
+    struct azureus_db_item      **chain[2];     /* [1] only while growing */
+    u32                         size[2];
+    u32                         rehash_pos;     /* next chain of [0] to move */
+    u32                         n_items;
+};
+
+/* direct-mapped cache of recent lookups, keyed on the db key. azureus_dht.h
+ * embeds it, so it is defined ahead of the includes. */
+#define AZUREUS_DB_CACHE_SIZE           256     /* must be a power of 2 */
+
+struct azureus_db_cache {
+    struct azureus_db_cache_entry   *slot;
+    u32                             size;
+    struct {
+        u64                         n_hit;      /* GETs answered from it */
+        u64                         n_node_hit; /* lookups seeded from it */
+        u64                         n_miss;
+    } stats;
+};
+
+/* originator of a value, just what goes on the wire for it; the 
+ * azureus_dht.h snapshot records embed it too */
+struct azureus_db_orig {
+    u8                          addr[16];
+    u16                         port;           /* network byte order */
+    u8                          family;
+    u8                          proto_ver;
+};
+
+#include <netinet/in.h>
+
 #include "queue.h"
+#include "timer.h"
 #include "azureus_dht.h"
 
 #define AZUREUS_MAX_KEYS_PER_PKT    255
@@ -31,20 +74,24 @@ struct azureus_rpc_msg;
 #define AZUREUS_MAX_KEY_LEN         255
 #define AZUREUS_MAX_VAL_LEN         256
 
+/* db keys are allocated with only len bytes of data, see 
+ * azureus_db_key_new(); the full size is only there for the one embedded
+ * in a FIND_VALUE request */
 struct azureus_db_key {
-    u8                      data[AZUREUS_MAX_KEY_LEN];
-    u8                      len;
     TAILQ_ENTRY(azureus_db_key) next;
+    u8                      len;
+    u8                      data[AZUREUS_MAX_KEY_LEN];
 };
 
+/* a value and its len bytes of data come in a single allocation */
 struct azureus_db_val {
-    u32                         ver;
+    TAILQ_ENTRY(azureus_db_val) next;
     u64                         timestamp;
+    u32                         ver;
+    struct azureus_db_orig      orig;
     u16                         len;
-    u8                          data[AZUREUS_MAX_VAL_LEN];
-    struct azureus_node         orig_node;
     u8                          flags;
-    TAILQ_ENTRY(azureus_db_val) next;
+    u8                          data[];
 };
 
 struct azureus_db_valset {
@@ -61,28 +108,74 @@ struct azureus_db_item {
     struct azureus_db_valset            *valset;
     bool                                is_local;
     TAILQ_ENTRY(azureus_db_item)        db_next;
+    struct azureus_db_item              *hash_next;
+    struct timer                        expire_timer;   /* remote only */
+    struct timer                        republish_timer; /* local only */
+    size_t                              mem;            /* bytes held */
+};
+
+/* the values a lookup found and the closest nodes that answered it, each
+ * good until its own expiry time */
+struct azureus_db_cache_entry {
+    struct azureus_db_key               *key;           /* NULL if unused */
+    struct azureus_db_valset            *valset;        /* NULL if none */
+    u64                                 val_expire;
     struct kbucket_node_search_list_head 
                                         node_list;
     int                                 n_nodes;
+    u64                                 node_expire;
 };
 
-struct azureus_db_key * azureus_db_key_new(void);
+struct azureus_db_key * azureus_db_key_new(u8 len);
 void azureus_db_key_delete(struct azureus_db_key *key);
+void azureus_db_key_copy(struct azureus_db_key *dst, struct azureus_db_key *src);
 bool azureus_db_key_equal(struct azureus_db_key *k1, struct azureus_db_key *k2);
 
-struct azureus_db_val * azureus_db_val_new(void);
+int azureus_db_orig_set(struct azureus_db_orig *orig, 
+                        struct sockaddr_storage *ss, u8 proto_ver);
+void azureus_db_orig_get_addr(struct azureus_db_orig *orig, 
+                        struct sockaddr_storage *ss);
+
+struct azureus_db_val * azureus_db_val_new(u16 len);
 void azureus_db_val_delete(struct azureus_db_val *v);
 struct azureus_db_valset * azureus_db_valset_new(void);
 void azureus_db_valset_delete(struct azureus_db_valset *vs);
+bool azureus_db_valset_has_val(struct azureus_db_valset *vs, 
+                                struct azureus_db_val *v);
 int azureus_db_valset_add_val(struct azureus_db_valset *vs, 
                                 u8 *val, int val_len);
 
 struct azureus_db_item * azureus_db_item_new(struct azureus_dht *dht, struct azureus_db_key *key, 
                                                 struct azureus_db_valset *valset);
 void azureus_db_item_delete(struct azureus_db_item *item);
+size_t azureus_db_item_mem(struct azureus_db_item *item);
 int azureus_db_item_set_key(struct azureus_db_item *item, u8 *key, int key_len);
 int azureus_db_item_add_val(struct azureus_db_item *item, u8 *val, int val_len);
 bool azureus_db_item_match_key(struct azureus_db_item *item, 
                                 u8 *key, int key_len);
 
+int azureus_db_table_new(struct azureus_db_table *dt);
+void azureus_db_table_delete(struct azureus_db_table *dt);
+int azureus_db_table_add(struct azureus_db_table *dt, 
+                            struct azureus_db_item *item);
+int azureus_db_table_remove(struct azureus_db_table *dt, 
+                            struct azureus_db_item *item);
+struct azureus_db_item * azureus_db_table_find(struct azureus_db_table *dt, 
+                            struct azureus_db_key *key);
+u64 azureus_db_table_hash(struct azureus_db_key *key);
+
+int azureus_db_cache_new(struct azureus_db_cache *dc);
+void azureus_db_cache_delete(struct azureus_db_cache *dc);
+struct azureus_db_cache_entry * azureus_db_cache_find(
+                            struct azureus_db_cache *dc, 
+                            struct azureus_db_key *key, u64 curr_time);
+struct azureus_db_cache_entry * azureus_db_cache_add(
+                            struct azureus_db_cache *dc, 
+                            struct azureus_db_key *key);
+void azureus_db_cache_set_valset(struct azureus_db_cache_entry *e, 
+                            struct azureus_db_valset *valset, u64 expire);
+void azureus_db_cache_drop_valset(struct azureus_db_cache *dc, 
+                            struct azureus_db_key *key);
+void azureus_db_cache_flush_nodes(struct azureus_db_cache_entry *e);
+
 #endif /* __AZUREUS_DB_H__ */
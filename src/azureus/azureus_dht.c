@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 extern int h_errno;
 
 #include <errno.h>
@@ -32,6 +35,7 @@ extern int errno;
 #include "types.h"
 #include "crypto.h"
 #include "azureus_rpc.h"
+#include "azureus_rpc_utils.h"
 #include "azureus_db.h"
 #include "task.h"
 #include "tinydht.h"
@@ -66,8 +70,21 @@ static struct azureus_task * azureus_dht_add_find_value_task(
 static struct azureus_task * azureus_dht_add_store_value_task(
                                         struct azureus_dht *ad, 
                                         struct azureus_node *an,
-                                        struct azureus_db_key *db_key,
-                                        struct azureus_db_valset *db_valset);
+                                        struct azureus_db_item **db_item,
+                                        int n_items);
+static int azureus_dht_store_values(struct azureus_dht *ad, 
+                                        struct azureus_task *aparent,
+                                        struct azureus_node *an);
+static int azureus_dht_store_items(struct azureus_dht *ad, 
+                                        struct azureus_task *aparent,
+                                        struct azureus_node *an,
+                                        struct azureus_db_item **db_item,
+                                        int n_items);
+static int azureus_dht_send_store_value(struct azureus_dht *ad, 
+                                        struct azureus_task *aparent,
+                                        struct azureus_node *an,
+                                        struct azureus_db_item **db_item,
+                                        int n_items);
 static int azureus_dht_add_node(struct azureus_dht *ad, 
                             struct azureus_node *an);
 static int azureus_dht_update_node(struct azureus_dht *ad, 
@@ -99,14 +116,41 @@ static int azureus_dht_get_node_count(struct azureus_dht *ad);
 
 static int azureus_dht_kbucket_refresh(struct azureus_dht *ad);
 static int azureus_dht_db_refresh(struct azureus_dht *ad);
+static int azureus_dht_publish(struct azureus_dht *ad, 
+                                    struct azureus_db_item **db_item,
+                                    int n_items,
+                                    bool republish);
+static void azureus_dht_republish_flush(struct azureus_dht *ad, 
+                                    u64 curr_time);
+static void azureus_dht_schedule_republish(struct azureus_dht *ad, 
+                                    struct azureus_db_item *db_item);
+static int azureus_dht_get_closest_set(struct azureus_dht *ad, 
+                                    struct azureus_db_key *db_key,
+                                    struct node **set);
+static bool azureus_dht_same_closest_set(struct node **set1, int n_set1,
+                                    struct node **set2, int n_set2);
 
 static bool azureus_dht_is_stable(struct azureus_dht *ad);
+static bool azureus_dht_is_warm(struct azureus_dht *ad, 
+                                    struct kbucket_node_search_list_head *list);
 static int azureus_dht_add_db_item(struct azureus_dht *ad, 
                                     struct azureus_db_key *db_key, 
                                     struct azureus_db_valset *db_valset,
                                     bool is_local);
+static struct azureus_db_item * azureus_dht_put_item(struct azureus_dht *ad, 
+                                    struct tinydht_msg *tmsg);
 static int azureus_dht_delete_db_item(struct azureus_dht *ad, 
                                         struct azureus_db_key *db_key);
+static void azureus_dht_unlink_db_item(struct azureus_dht *ad, 
+                                        struct azureus_db_item *item);
+static int azureus_dht_db_make_room(struct azureus_dht *ad, size_t mem);
+static void azureus_dht_db_expire(struct azureus_dht *ad, u64 curr_time);
+static int azureus_dht_snapshot_save(struct azureus_dht *ad);
+static int azureus_dht_snapshot_write(FILE *fp, void *data, size_t len);
+static int azureus_dht_snapshot_load_nodes(struct azureus_dht *ad, u8 *base, 
+                                    struct azureus_snapshot_hdr *hdr);
+static int azureus_dht_snapshot_load_items(struct azureus_dht *ad, u8 *base, 
+                                    struct azureus_snapshot_hdr *hdr);
 static struct azureus_db_item * azureus_dht_find_db_item(
                                             struct azureus_dht *ad, 
                                             struct azureus_db_key *db_key);
@@ -114,11 +158,26 @@ static int azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
                                             struct azureus_task *achild, 
                                             bool status,
                                             struct azureus_rpc_msg *reply);
+static void azureus_dht_parent_db_task_done(struct azureus_dht *ad, 
+                                            struct azureus_task *aparent,
+                                            u64 curr_time);
 static struct azureus_task * azureus_dht_add_parent_db_task(
                                     struct azureus_dht *ad, 
                                     struct tinydht_msg *tmsg,
                                     enum azureus_task_type type, 
-                                    struct azureus_db_key *db_key, 
+                                    struct azureus_db_key *db_key);
+static void azureus_dht_lookup_start(struct azureus_dht *ad, 
+                                    struct azureus_task *aparent,
+                                    struct kbucket_node_search_list_head *list);
+static bool azureus_dht_lookup_next(struct azureus_dht *ad, 
+                                    struct azureus_task *aparent,
+                                    struct key *lookup_id);
+static void azureus_dht_cache_nodes(struct azureus_dht *ad, 
+                                    struct azureus_task *aparent,
+                                    u64 curr_time);
+static void azureus_dht_respond_partial(struct tinydht_msg *tmsg, 
+                                    struct azureus_db_val *v);
+static void azureus_dht_respond(struct tinydht_msg *tmsg, 
                                     struct azureus_db_valset *db_valset);
 
 static void azureus_dht_update_rpc_stats(struct azureus_dht *ad, u32 action, 
@@ -160,17 +219,86 @@ azureus_dht_new(struct dht_net_if *nif, int port)
         return NULL;
     }
 
+    /* initialize the object pools */
+    pool_new(&ad->pool.rpc_msg, "rpc_msg", sizeof(struct azureus_rpc_msg),
+                AZUREUS_RPC_MSG_SLAB, AZUREUS_RPC_MSG_MAX);
+    pool_new(&ad->pool.task, "task", sizeof(struct azureus_task),
+                AZUREUS_TASK_SLAB, AZUREUS_TASK_MAX);
+    pool_new(&ad->pool.node, "node", sizeof(struct azureus_node),
+                AZUREUS_NODE_SLAB, AZUREUS_NODE_MAX);
+
     /* initialize the kbuckets */
+    ret = node_table_new(&ad->node_table);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ret = azureus_node_addr_table_new(&ad->addr_table);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
     for (i = 0; i < 160; i++) {
         LIST_INIT(&ad->kbucket[i].node_list);
+        LIST_INIT(&ad->kbucket[i].ext_node_list);
+        ad->kbucket[i].table = &ad->node_table;
     }
 
     /* initialize the task list */
     TAILQ_INIT(&ad->task_list);
+    TAILQ_INIT(&ad->pending_list);
+    TAILQ_INIT(&ad->republish_list);
+
+    ret = timer_heap_new(&ad->task_timers);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ret = azureus_task_table_new(&ad->task_table);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ret = azureus_task_lookup_table_new(&ad->lookup_table);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
 
     /* initialize the database */
     TAILQ_INIT(&ad->db_list);
 
+    ret = azureus_db_table_new(&ad->db_table);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ret = timer_heap_new(&ad->db_timers);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ret = timer_heap_new(&ad->republish_timers);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
+    ad->db_ttl = AZUREUS_DB_TTL;
+    ad->db_max_mem = AZUREUS_DB_MAX_MEM;
+
+    ret = azureus_db_cache_new(&ad->db_cache);
+    if (ret != SUCCESS) {
+        azureus_dht_delete(&ad->dht);
+        return NULL;
+    }
+
     /* initialize Azureus specific stuff */
     ad->proto_ver = PROTOCOL_VERSION_MAIN;
     ret = crypto_get_rnd_int(&ad->trans_id);
@@ -253,6 +381,19 @@ azureus_dht_delete(struct dht *dht)
     struct azureus_dht *ad = NULL;
 
     ad = azureus_dht_get_ref(dht);
+    timer_heap_delete(&ad->task_timers);
+    azureus_task_table_delete(&ad->task_table);
+    azureus_task_lookup_table_delete(&ad->lookup_table);
+    node_table_delete(&ad->node_table);
+    azureus_node_addr_table_delete(&ad->addr_table);
+    azureus_db_table_delete(&ad->db_table);
+    timer_heap_delete(&ad->db_timers);
+    timer_heap_delete(&ad->republish_timers);
+    azureus_db_cache_delete(&ad->db_cache);
+    /* this releases every pooled object still around */
+    pool_delete(&ad->pool.rpc_msg);
+    pool_delete(&ad->pool.task);
+    pool_delete(&ad->pool.node);
     free(ad);
 
     return;
@@ -267,7 +408,9 @@ azureus_dht_task_schedule(struct dht *dht)
     struct azureus_task *at = NULL, *atn = NULL;
     struct azureus_task *aparent = NULL;
     struct azureus_node *an = NULL;
+    struct timer *t = NULL;
     u64 curr_time = 0;
+    u64 deadline = 0;
     bool rate_limit_allow = TRUE;
 
     ASSERT(dht);
@@ -276,68 +419,80 @@ azureus_dht_task_schedule(struct dht *dht)
 
     ad = azureus_dht_get_ref(dht);
 
-    /* kbucket refresh */
-    azureus_dht_kbucket_refresh(ad);
+    if (curr_time >= ad->next_refresh) {
 
-    /* database refresh */
-    azureus_dht_db_refresh(ad);
+        /* kbucket refresh */
+        azureus_dht_kbucket_refresh(ad);
 
-    /* the main task processing loop */
-    TAILQ_FOREACH_SAFE(at, &ad->task_list, next, atn) {
+        /* database refresh */
+        azureus_dht_db_refresh(ad);
+        azureus_dht_db_expire(ad, curr_time);
+
+        if (ad->dht.snapshot_path[0] && (curr_time >= ad->next_snapshot)) {
+            azureus_dht_snapshot_save(ad);
+            ad->next_snapshot = curr_time + AZUREUS_SNAPSHOT_INTERVAL;
+        }
+
+        ad->next_refresh = curr_time + AZUREUS_REFRESH_INTERVAL;
+    }
+
+    if (ad->n_republish && ((ad->n_republish_ready == ad->n_republish)
+                            || (curr_time >= ad->republish_deadline))) {
+        azureus_dht_republish_flush(ad, curr_time);
+    }
+
+    /* only the tasks whose rpc timed out are touched here */
+    while ((t = timer_expire(&ad->task_timers, curr_time))) {
+
+        at = azureus_task_get_ref(container_of(t, struct task, timer));
 
         if (at->task.type == TASK_TYPE_PARENT) {
             /* FIXME: maybe do some garbage collect */
             continue;
         }
 
-        if (at->task.state == TASK_STATE_WAIT) {
-
-            if (curr_time < at->task.access_time) {
-                continue;       /* FIXME: BUG!!! use adjtime() ?? */
-            }
-
-            if ((curr_time - at->task.access_time) < AZUREUS_RPC_TIMEOUT) {
-                /* this task hasn't timed out yet, so wait some more! */
-                continue;
-            }
+        ASSERT(at->task.state == TASK_STATE_WAIT);
 
-            DEBUG("task %p timed out %lld %lld\n", 
-                    at, curr_time, at->task.access_time);
-            an = azureus_node_get_ref(at->task.node);
-            ASSERT(an);
+        DEBUG("task %p timed out %lld %lld\n", 
+                at, curr_time, at->task.access_time);
+        an = azureus_node_get_ref(at->task.node);
+        ASSERT(an);
 
-            an->alive = FALSE;
-            an->node.state = NODE_STATE_QUESTIONABLE;
-            an->failures++;
-            an->last_ping = 0;
+        an->alive = FALSE;
+        an->node.state = NODE_STATE_QUESTIONABLE;
+        an->failures++;
+        an->last_ping = 0;
 
-            if (an->failures == MAX_RPC_FAILURES) {
-                an->node.state = NODE_STATE_BAD;
-            }
+        if (an->failures == MAX_RPC_FAILURES) {
+            an->node.state = NODE_STATE_BAD;
+        }
 
-            if (at->task.parent) {
+        if (at->task.parent) {
 
-                aparent = azureus_task_get_ref(at->task.parent);
-                azureus_dht_notify_parent_db_task(ad, at, FAILURE, NULL);
+            aparent = azureus_task_get_ref(at->task.parent);
+            azureus_dht_notify_parent_db_task(ad, at, FAILURE, NULL);
 
-                DEBUG("deleting_here1\n");
-                azureus_dht_delete_task(ad, at);      
+            DEBUG("deleting_here1\n");
+            azureus_dht_delete_task(ad, at);      
 
-            } else {
+        } else {
 
-                DEBUG("deleting_here1\n");
-                azureus_dht_delete_task(ad, at);      
+            DEBUG("deleting_here1\n");
+            azureus_dht_delete_task(ad, at);      
 
-                if (an->node.state == NODE_STATE_BAD) {
-                    azureus_dht_delete_node(ad, an);
-                }
+            if (an->node.state == NODE_STATE_BAD) {
+                azureus_dht_delete_node(ad, an);
             }
-
-            continue;
         }
+    }
 
-        if (!rate_limit_allow) {
-            /* don't process any more outgoing pkts! */
+    /* send out the tasks that are still pending */
+    TAILQ_FOREACH_SAFE(at, &ad->pending_list, next_pending, atn) {
+
+        if (at->task.type == TASK_TYPE_PARENT) {
+            /* parent tasks are driven by their children */
+            TAILQ_REMOVE(&ad->pending_list, at, next_pending);
+            at->pending = FALSE;
             continue;
         }
 
@@ -351,6 +506,8 @@ azureus_dht_task_schedule(struct dht *dht)
         switch (pkt->dir) {
             case PKT_DIR_RX:
                 DEBUG("RX\n");
+                TAILQ_REMOVE(&ad->pending_list, at, next_pending);
+                at->pending = FALSE;
                 break;
 
             case PKT_DIR_TX:
@@ -364,15 +521,45 @@ azureus_dht_task_schedule(struct dht *dht)
                 // pkt_reset_data(&msg->pkt);
                 /* FIXME: encode everytime? */
 
-                azureus_dht_rpc_tx(ad, at, msg);
+                if (azureus_dht_rpc_tx(ad, at, msg) != SUCCESS) {
+                    /* give up on it, as if it had timed out */
+                    if (at->task.parent) {
+                        azureus_dht_notify_parent_db_task(ad, at, 
+                                                            FAILURE, NULL);
+                    }
+                    azureus_dht_delete_task(ad, at);
+                }
 
                 break;
 
             default:
                 return FAILURE;
         }
+
+        if (!rate_limit_allow) {
+            /* don't process any more outgoing pkts! */
+            break;
+        }
+    }
+
+    /* work out when we need to be called again */
+    deadline = ad->next_refresh;
+
+    t = timer_peek(&ad->task_timers);
+    if (t && (t->expires < deadline)) {
+        deadline = t->expires;
+    }
+
+    if (!TAILQ_EMPTY(&ad->pending_list) 
+            && ((curr_time + AZUREUS_TX_RETRY_INTERVAL) < deadline)) {
+        deadline = curr_time + AZUREUS_TX_RETRY_INTERVAL;
     }
 
+    ad->dht.next_deadline = deadline;
+
+    /* everything sent during this tick goes out in one batch */
+    dht_txq_flush(&ad->dht);
+
     return SUCCESS;
 }
 
@@ -388,25 +575,39 @@ azureus_dht_rpc_tx(struct azureus_dht *ad, struct azureus_task *at,
 
     curr_time = dht_get_current_time();
 
-    ret = sendto(ad->dht.net_if.sock, msg->pkt.data, msg->pkt.len, 0, 
-            (struct sockaddr *)&msg->pkt.ss, sizeof(struct sockaddr_in));
-    if (ret < 0) {
-        ERROR("sendto() - %s\n", strerror(errno));
-        ERROR("error sending %d bytes to %s/%hu\n", 
-            ret,
+    /* a request that could never time out must not go out at all, it is 
+     * left pending for the scheduler to deal with */
+    if (at) {
+        ret = timer_add(&ad->task_timers, &at->task.timer, 
+                            curr_time + AZUREUS_RPC_TIMEOUT);
+        if (ret != SUCCESS) {
+            ERROR("cannot arm the rpc timeout\n");
+            return FAILURE;
+        }
+    }
+
+    /* queue it up, the whole batch goes out at the end of this 
+     * scheduler tick or rx batch */
+    ret = dht_txq_add(&ad->dht, &msg->pkt.ss, msg->pkt.data, msg->pkt.len);
+    if (ret != SUCCESS) {
+        ERROR("error queueing %d bytes to %s/%hu\n", 
+            msg->pkt.len,
             inet_ntoa(((struct sockaddr_in *)&msg->pkt.ss)->sin_addr),
             ntohs(((struct sockaddr_in *)&msg->pkt.ss)->sin_port));
+        if (at) {
+            timer_del(&ad->task_timers, &at->task.timer);
+        }
         return FAILURE;
     }
 
-    DEBUG("sent %d bytes to %s/%hu\n", 
-            ret,
+    DEBUG("queued %d bytes to %s/%hu\n", 
+            msg->pkt.len,
             inet_ntoa(((struct sockaddr_in *)&msg->pkt.ss)->sin_addr),
             ntohs(((struct sockaddr_in *)&msg->pkt.ss)->sin_port));
 
     pkt_dump(&msg->pkt);
 
-    azureus_dht_net_usage_update(ad, ret, PKT_DIR_TX);
+    azureus_dht_net_usage_update(ad, msg->pkt.len, PKT_DIR_TX);
 
     azureus_dht_update_rpc_stats(ad, msg->action, msg->pkt.dir);
 
@@ -417,6 +618,11 @@ azureus_dht_rpc_tx(struct azureus_dht *ad, struct azureus_task *at,
     at->task.state = TASK_STATE_WAIT;
     at->task.access_time = curr_time;
 
+    if (at->pending) {
+        TAILQ_REMOVE(&ad->pending_list, at, next_pending);
+        at->pending = FALSE;
+    }
+
     an = azureus_node_get_ref(at->task.node);
     ASSERT(an);
 
@@ -501,6 +707,11 @@ azureus_dht_rpc_rx(struct dht *dht, struct sockaddr_storage *from,
 
         /* prepare a response for the request */
         rsp = azureus_rpc_msg_new(ad, from, fromlen, NULL, 0);
+        if (!rsp) {
+            /* out of rpc msgs, drop the request */
+            azureus_rpc_msg_delete(msg);
+            return FAILURE;
+        }
         rsp->pkt.dir = PKT_DIR_TX;
         rsp->r.req = msg;
 
@@ -645,17 +856,10 @@ azureus_dht_rpc_rx(struct dht *dht, struct sockaddr_storage *from,
     } else {            /* REPLY   */
 
         /* look for a matching request */
-        TAILQ_FOREACH(at, &ad->task_list, next) {
-            
-            if (at->task.state != TASK_STATE_WAIT) {
-                continue;
-            }
-
+        at = azureus_task_table_find(&ad->task_table, msg->u.udp_rsp.conn_id);
+        if (at && (at->task.state == TASK_STATE_WAIT)) {
             msg1 = azureus_rpc_msg_get_ref(at->task.pkt);
-            if (azureus_rpc_match_req_rsp(msg1, msg)) {
-                found = TRUE;
-                break;
-            }
+            found = azureus_rpc_match_req_rsp(msg1, msg);
         }
 
         if (!found) {
@@ -683,6 +887,7 @@ azureus_dht_rpc_rx(struct dht *dht, struct sockaddr_storage *from,
             case ACT_REPLY_FIND_NODE:
 
                 an->my_rnd_id = msg->m.find_node_rsp.rnd_id;
+                an->last_find_node_rsp = curr_time;
 
                 /* FIXME: fix this later! */
                 if (ad->est_dht_size < msg->m.find_node_rsp.est_dht_size) {
@@ -789,68 +994,142 @@ int
 azureus_dht_put(struct dht *dht, struct tinydht_msg *msg)
 {
     struct azureus_dht *ad = NULL;
+
+    DEBUG("PUT received\n");
+
+    if (!dht) {
+        return FAILURE;
+    }
+
+    ad = azureus_dht_get_ref(dht);
+
+    if (!azureus_dht_put_item(ad, msg)) {
+        return FAILURE;
+    }
+
+    DEBUG("PUT successful\n");
+
+    return SUCCESS;
+}
+
+/* Stores the values of a batch of PUTs, and publishes them right away 
+ * instead of one at a time on the next refresh, so the keys that go to 
+ * the same nodes can share lookups and store value requests. */
+int
+azureus_dht_put_batch(struct dht *dht, struct tinydht_msg **tmsg, int n_tmsg)
+{
+    struct azureus_dht *ad = NULL;
+    struct azureus_db_item **db_item = NULL;
+    int n_items = 0;
+    int i, j;
+
+    DEBUG("PUT batch of %d received\n", n_tmsg);
+
+    if (!dht || !tmsg || (n_tmsg <= 0)) {
+        return FAILURE;
+    }
+
+    ad = azureus_dht_get_ref(dht);
+
+    db_item = (struct azureus_db_item **) 
+                    malloc(n_tmsg*sizeof(struct azureus_db_item *));
+    if (!db_item) {
+        return FAILURE;
+    }
+
+    for (i = 0; i < n_tmsg; i++) {
+        /* a key put again replaces the db item from before */
+        for (j = 0; j < i; j++) {
+            if ((tmsg[j]->req.key_len == tmsg[i]->req.key_len)
+                    && (memcmp(tmsg[j]->req.key, tmsg[i]->req.key, 
+                                    tmsg[i]->req.key_len) == 0)) {
+                db_item[j] = NULL;
+            }
+        }
+
+        db_item[i] = azureus_dht_put_item(ad, tmsg[i]);
+        if (db_item[i]) {
+            tmsg[i]->rsp.status = TINYDHT_RESPONSE_SUCCESS;
+        }
+    }
+
+    for (i = 0; i < n_tmsg; i++) {
+        if (db_item[i]) {
+            db_item[n_items++] = db_item[i];
+        }
+    }
+
+    azureus_dht_publish(ad, db_item, n_items, FALSE);
+
+    free(db_item);
+
+    return SUCCESS;
+}
+
+/* adds the value of a PUT to the database as our own, it goes out on the 
+ * next refresh */
+static struct azureus_db_item *
+azureus_dht_put_item(struct azureus_dht *ad, struct tinydht_msg *msg)
+{
     struct azureus_db_key *db_key = NULL;
     struct azureus_db_valset *db_valset = NULL;
     struct azureus_db_val *db_val = NULL;
     int ret;
     u64 curr_time = 0;
 
-    DEBUG("PUT received\n");
+    ASSERT(ad && msg);
 
     curr_time = dht_get_current_time();
 
-    if (!dht || (msg->req.key_len <= 0) || (msg->req.val_len <= 0)) {
-        return FAILURE;
+    if ((msg->req.key_len <= 0) || (msg->req.val_len <= 0)) {
+        return NULL;
     }
 
     if (msg->req.key_len > AZUREUS_MAX_KEY_LEN) {
-        return FAILURE;
+        return NULL;
     }
 
     if ((msg->req.val_len/AZUREUS_MAX_VAL_LEN) > AZUREUS_MAX_VALS_PER_KEY) {
-        return FAILURE;
+        return NULL;
     }
 
-    ad = azureus_dht_get_ref(dht);
-
-    db_key = azureus_db_key_new();
+    db_key = azureus_db_key_new(MAX_KEY_SIZE);
     if (!db_key) {
-        return FAILURE;
+        return NULL;
     }
 
     crypto_get_sha1_digest(msg->req.key, msg->req.key_len, db_key->data);
-    db_key->len = MAX_KEY_SIZE;
 
     db_valset = azureus_db_valset_new();
     if (!db_valset) {
         azureus_db_key_delete(db_key);
-        return FAILURE;
+        return NULL;
     }
 
-    db_val = azureus_db_val_new();
+    db_val = azureus_db_val_new(msg->req.val_len);
     if (!db_val) {
         azureus_db_key_delete(db_key);
         azureus_db_valset_delete(db_valset);
+        return NULL;
     }
     /* FIXME: need a better constructor for db_val */
     db_val->ver = 0x1;
-    db_val->len = msg->req.val_len;
     memcpy(db_val->data, msg->req.val, msg->req.val_len);
     db_val->flags = FLAG_SINGLE_VALUE;
     db_val->timestamp = curr_time;
-    memcpy(&db_val->orig_node, ad->this_node, sizeof(struct azureus_node));
+    azureus_db_orig_set(&db_val->orig, &ad->this_node->ext_addr, 
+                        ad->this_node->proto_ver);
 
     TAILQ_INSERT_TAIL(&db_valset->val_list, db_val, next);
     db_valset->n_vals++;
 
     ret = azureus_dht_add_db_item(ad, db_key, db_valset, TRUE);
     if (ret != SUCCESS) {
-        return FAILURE;
+        return NULL;
     }
 
-    DEBUG("PUT successful\n");
-
-    return SUCCESS;
+    /* the db item owns db_key now */
+    return azureus_dht_find_db_item(ad, db_key);
 }
 
 int
@@ -859,6 +1138,7 @@ azureus_dht_get(struct dht *dht, struct tinydht_msg *tmsg)
     struct azureus_dht *ad = NULL;
     struct azureus_db_key *db_key = NULL;
     struct azureus_task *at = NULL;
+    struct azureus_db_cache_entry *e = NULL;
 
     ASSERT(dht && tmsg);
 
@@ -870,17 +1150,28 @@ azureus_dht_get(struct dht *dht, struct tinydht_msg *tmsg)
 
     ad = azureus_dht_get_ref(dht);
 
-    db_key = azureus_db_key_new();
+    db_key = azureus_db_key_new(MAX_KEY_SIZE);
     if (!db_key) {
         return FAILURE;
     }
 
     /* FIXME: we are not interested in the 'real' key, but only its key-hash */
     crypto_get_sha1_digest(tmsg->req.key, tmsg->req.key_len, db_key->data);
-    db_key->len = MAX_KEY_SIZE;
+
+    e = azureus_db_cache_find(&ad->db_cache, db_key, dht_get_current_time());
+    if (e && e->valset) {
+        DEBUG("GET answered from the cache\n");
+        ad->db_cache.stats.n_hit++;
+        azureus_dht_respond(tmsg, e->valset);
+        azureus_db_key_delete(db_key);
+        return SUCCESS;
+    }
+
+    ad->db_cache.stats.n_miss++;
 
     at = azureus_dht_add_parent_db_task(ad, tmsg, AZUREUS_TASK_TYPE_FIND_VALUE, 
-                                            db_key, NULL);
+                                            db_key);
+    azureus_db_key_delete(db_key);
     if (!at) {
         return FAILURE;
     }
@@ -918,6 +1209,11 @@ azureus_dht_add_task(struct azureus_dht *ad, struct azureus_task *at)
     TAILQ_INSERT_TAIL(&ad->task_list, at, next);
     ad->n_tasks++;
 
+    TAILQ_INSERT_TAIL(&ad->pending_list, at, next_pending);
+    at->pending = TRUE;
+
+    azureus_task_table_add(&ad->task_table, at);
+
     msg = azureus_rpc_msg_get_ref(at->task.pkt);
     DEBUG("%#llx\n", msg->p.pr_udp_req.conn_id);
 
@@ -942,8 +1238,22 @@ azureus_dht_delete_task(struct azureus_dht *ad, struct azureus_task *at)
     TAILQ_REMOVE(&ad->task_list, at, next);
     ad->n_tasks--;
 
+    if (at->pending) {
+        TAILQ_REMOVE(&ad->pending_list, at, next_pending);
+        at->pending = FALSE;
+    }
+
+    timer_del(&ad->task_timers, &at->task.timer);
+
+    azureus_task_table_remove(&ad->task_table, at);
+
     azureus_node_delete_task(an, at);
 
+    if (an->orphan && !an->n_tasks) {
+        /* the lookup that held this node is already over */
+        azureus_node_delete(an);
+    }
+
     azureus_task_delete(at);
 
     return SUCCESS;
@@ -1108,7 +1418,7 @@ azureus_dht_find_value_task_new(struct azureus_dht *ad,
 
     msg->m.find_value_req.flags = FLAG_SINGLE_VALUE;
     msg->m.find_value_req.max_vals = AZUREUS_MAX_VALS_PER_KEY;
-    memcpy(&msg->m.find_value_req.key, db_key, sizeof(struct azureus_db_key));
+    azureus_db_key_copy(&msg->m.find_value_req.key, db_key);
 
     ret = azureus_rpc_msg_encode(msg);  
     if (ret != SUCCESS) {
@@ -1157,25 +1467,22 @@ azureus_dht_add_find_value_task(struct azureus_dht *ad,
     return at;
 }
 
+/* one store value request for the n_items db items, they all go to an */
 static struct azureus_task *
 azureus_dht_store_value_task_new(struct azureus_dht *ad, 
                                     struct azureus_node *an,
-                                    struct azureus_db_key *db_key,
-                                    struct azureus_db_valset *db_valset)
+                                    struct azureus_db_item **db_item,
+                                    int n_items)
 {
     struct azureus_rpc_msg *msg = NULL;
     struct azureus_task *at = NULL;
-    struct key key;
     int ret;
+    int i;
 
     DEBUG("entering ...\n");
 
-    ASSERT(ad && an && db_key && db_valset);
-
-    ret = key_new(&key, KEY_TYPE_SHA1, db_key->data, db_key->len);
-    if (ret != SUCCESS) {
-        return NULL;
-    }
+    ASSERT(ad && an && db_item && (n_items > 0) 
+            && (n_items <= AZUREUS_MAX_KEYS_PER_PKT));
 
     msg = azureus_rpc_msg_new(ad, &an->ext_addr, 
                                 sizeof(struct sockaddr_storage), NULL, 0);
@@ -1191,14 +1498,24 @@ azureus_dht_store_value_task_new(struct azureus_dht *ad,
     // ASSERT(!an->failures);
 
     TAILQ_INIT(&msg->m.store_value_req.key_list);
-    TAILQ_INSERT_TAIL(&msg->m.store_value_req.key_list, db_key, next);
-    msg->m.store_value_req.n_keys = 1;
-
     TAILQ_INIT(&msg->m.store_value_req.valset_list);
-    TAILQ_INSERT_TAIL(&msg->m.store_value_req.valset_list, db_valset, next);
-    msg->m.store_value_req.n_valsets = 1;
+
+    for (i = 0; i < n_items; i++) {
+        TAILQ_INSERT_TAIL(&msg->m.store_value_req.key_list, 
+                            db_item[i]->key, next);
+        TAILQ_INSERT_TAIL(&msg->m.store_value_req.valset_list, 
+                            db_item[i]->valset, next);
+    }
+    msg->m.store_value_req.n_keys = n_items;
+    msg->m.store_value_req.n_valsets = n_items;
 
     ret = azureus_rpc_msg_encode(msg);  
+
+    /* the keys and the values still belong to the db items, the packet has
+     * its own copy of them now */
+    TAILQ_INIT(&msg->m.store_value_req.key_list);
+    TAILQ_INIT(&msg->m.store_value_req.valset_list);
+
     if (ret != SUCCESS) {
         azureus_rpc_msg_delete(msg);
         return NULL;
@@ -1218,14 +1535,14 @@ azureus_dht_store_value_task_new(struct azureus_dht *ad,
 static struct azureus_task *
 azureus_dht_add_store_value_task(struct azureus_dht *ad, 
                                     struct azureus_node *an,
-                                    struct azureus_db_key *db_key,
-                                    struct azureus_db_valset *db_valset)
+                                    struct azureus_db_item **db_item,
+                                    int n_items)
 {
     struct azureus_task *at = NULL;
 
-    ASSERT(ad && an && db_key && db_valset);
+    ASSERT(ad && an && db_item);
 
-    at = azureus_dht_store_value_task_new(ad, an, db_key, db_valset);
+    at = azureus_dht_store_value_task_new(ad, an, db_item, n_items);
     if (!at) {
         return NULL;
     }
@@ -1237,49 +1554,164 @@ azureus_dht_add_store_value_task(struct azureus_dht *ad,
     return at;
 }
 
+/* Stores the values of every key of a STORE parent on an. Returns the 
+ * number of requests sent, 0 if none of the keys has a db item any more. */
 static int
-azureus_dht_add_find_node_db_task(struct azureus_dht *ad,
-                                    struct azureus_task *aparent,
-                                    struct azureus_task *achild,
-                                    struct key *lookup_id,
-                                    struct kbucket_node_search_list_head *list,
-                                    int *n_list,
-                                    struct key *find_node_id,
-                                    bool *need_find_node)
+azureus_dht_store_values(struct azureus_dht *ad, 
+                            struct azureus_task *aparent,
+                            struct azureus_node *an)
 {
-    struct node *tn = NULL, *tnn = NULL;
-    struct azureus_node *an = NULL;
-    struct azureus_rpc_msg *msg = NULL;
-    struct azureus_task *at = NULL, *att = NULL;
-    struct azureus_task *fnt = NULL;
-    u64 curr_time = 0;
+    struct azureus_db_item **db_item = NULL;
+    struct azureus_db_item *item = NULL;
+    struct azureus_db_key *key = NULL;
+    int n_items = 0;
+    int count = 0;
 
-    DEBUG("entering ...\n");
+    ASSERT(ad && aparent && an);
 
-    ASSERT(ad && aparent && lookup_id && list && n_list 
-            && find_node_id && need_find_node);
+    db_item = (struct azureus_db_item **) 
+                malloc((1 + aparent->n_db_keys)*sizeof(*db_item));
+    if (!db_item) {
+        return 0;
+    }
 
-    curr_time = dht_get_current_time();
-    *need_find_node = FALSE;
+    for (key = aparent->db_key; key; 
+            key = (key == aparent->db_key) 
+                    ? TAILQ_FIRST(&aparent->db_key_list) 
+                    : TAILQ_NEXT(key, next)) {
 
-    TAILQ_INIT(list);
+        item = azureus_dht_find_db_item(ad, key);
+        if (!item) {
+            /* the value went away while we were looking */
+            continue;
+        }
 
-    azureus_dht_get_k_closest_nodes(ad, 
-                                    lookup_id, 
-                                    AZUREUS_K, 
-                                    list, 
-                                    n_list, 
-                                    PROTOCOL_VERSION_MIN, 
-                                    TRUE, 
-                                    TRUE);
+        db_item[n_items++] = item;
+    }
 
-    TAILQ_FOREACH_SAFE(tn, list, next, tnn) {
+    count = azureus_dht_store_items(ad, aparent, an, db_item, n_items);
 
-        an = azureus_node_get_ref(tn);
+    free(db_item);
 
-        TAILQ_FOREACH_SAFE(at, &an->task_list, next_node_task, att) {
+    return count;
+}
 
-            if (at->type == AZUREUS_TASK_TYPE_FIND_NODE) {
+/* Stores n_items db items on an, packing as many of them as fit into each 
+ * store value request. Returns the number of requests sent. */
+static int
+azureus_dht_store_items(struct azureus_dht *ad, 
+                            struct azureus_task *aparent,
+                            struct azureus_node *an,
+                            struct azureus_db_item **db_item,
+                            int n_items)
+{
+    size_t pkt_len, len;
+    int first = 0;
+    int count = 0;
+    int i;
+
+    ASSERT(ad && aparent && an && db_item);
+
+    pkt_len = AZUREUS_STORE_VALUE_HDR_LEN;
+
+    for (i = 0; i < n_items; i++) {
+
+        len = azureus_pkt_db_key_len(db_item[i]->key) 
+                + azureus_pkt_db_valset_len(db_item[i]->valset);
+
+        if ((i > first) && (((i - first) == AZUREUS_MAX_KEYS_PER_PKT) 
+                            || ((pkt_len + len) > MAX_PKT_LEN))) {
+            if (azureus_dht_send_store_value(ad, aparent, an, 
+                                    &db_item[first], i - first) == SUCCESS) {
+                count++;
+            }
+            first = i;
+            pkt_len = AZUREUS_STORE_VALUE_HDR_LEN;
+        }
+
+        pkt_len += len;
+    }
+
+    if (n_items > first) {
+        if (azureus_dht_send_store_value(ad, aparent, an, 
+                                &db_item[first], n_items - first) == SUCCESS) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static int
+azureus_dht_send_store_value(struct azureus_dht *ad, 
+                                struct azureus_task *aparent,
+                                struct azureus_node *an,
+                                struct azureus_db_item **db_item,
+                                int n_items)
+{
+    struct azureus_task *svt = NULL;
+    struct azureus_rpc_msg *msg = NULL;
+
+    ASSERT(ad && aparent && an && db_item);
+
+    svt = azureus_dht_store_value_task_new(ad, an, db_item, n_items);
+    if (!svt) {
+        ERROR("cannot store %d keys on %p\n", n_items, an);
+        return FAILURE;
+    }
+
+    task_add_child_task(&aparent->task, &svt->task);
+    azureus_dht_add_task(ad, svt);
+    /* we need to schedule these tasks right away! */
+    msg = azureus_rpc_msg_get_ref(svt->task.pkt);
+    azureus_dht_rpc_tx(ad, svt, msg);
+
+    return SUCCESS;
+}
+
+static int
+azureus_dht_add_find_node_db_task(struct azureus_dht *ad,
+                                    struct azureus_task *aparent,
+                                    struct azureus_task *achild,
+                                    struct key *lookup_id,
+                                    struct kbucket_node_search_list_head *list,
+                                    int *n_list,
+                                    struct key *find_node_id,
+                                    bool *need_find_node)
+{
+    struct node *tn = NULL, *tnn = NULL;
+    struct azureus_node *an = NULL;
+    struct azureus_rpc_msg *msg = NULL;
+    struct azureus_task *at = NULL, *att = NULL;
+    struct azureus_task *fnt = NULL;
+    u64 curr_time = 0;
+
+    DEBUG("entering ...\n");
+
+    ASSERT(ad && aparent && lookup_id && list && n_list 
+            && find_node_id && need_find_node);
+
+    curr_time = dht_get_current_time();
+    *need_find_node = FALSE;
+
+    TAILQ_INIT(list);
+
+    azureus_dht_get_k_closest_nodes(ad, 
+                                    lookup_id, 
+                                    AZUREUS_K, 
+                                    list, 
+                                    n_list, 
+                                    PROTOCOL_VERSION_MIN, 
+                                    TRUE, 
+                                    TRUE);
+
+    TAILQ_FOREACH_SAFE(tn, list, next, tnn) {
+
+        an = azureus_node_get_ref(tn);
+
+        TAILQ_FOREACH_SAFE(at, &an->task_list, next_node_task, att) {
+
+            if (at->type == AZUREUS_TASK_TYPE_FIND_NODE) {
 
                 if (!at->task.parent) {
                     /* there is no parent for this task, so piggyback it */
@@ -1310,8 +1742,8 @@ azureus_dht_add_find_node_db_task(struct azureus_dht *ad,
                     fnt = azureus_dht_find_node_task_new(ad, an, 
                             find_node_id);
                     if (!fnt) {
-                        /* FIXME: need a better way to handle this! */
-                        ASSERT(0);      
+                        /* out of tasks or msgs, do without this node */
+                        continue;
                     }
 
                     task_add_child_task(&aparent->task, &fnt->task);
@@ -1328,8 +1760,9 @@ azureus_dht_add_find_node_db_task(struct azureus_dht *ad,
              * get the random spoof id */
             fnt = azureus_dht_find_node_task_new(ad, an, find_node_id);
             if (!fnt) {
-                /* FIXME: need a better way to handle this! */
-                ASSERT(0);      
+                /* out of tasks or msgs, the lookup fetches its spoof id 
+                 * later on, if it needs to */
+                continue;
             }
 
             task_add_child_task(&aparent->task, &fnt->task);
@@ -1345,44 +1778,107 @@ azureus_dht_add_find_node_db_task(struct azureus_dht *ad,
     return SUCCESS;
 }
 
+/* Starts the lookup of db_key for a GET or STORE, or joins the one that 
+ * is already going on for it.  The parent task keeps a copy of db_key; a
+ * STORE takes the values of the db item once the lookup has converged, 
+ * so a joined STORE also gets its values out. */
 static struct azureus_task *
 azureus_dht_add_parent_db_task(struct azureus_dht *ad, 
                                 struct tinydht_msg *tmsg,
                                 enum azureus_task_type type, 
-                                struct azureus_db_key *db_key, 
-                                struct azureus_db_valset *db_valset)
+                                struct azureus_db_key *db_key)
 {
-    struct azureus_node *an = NULL, *ancopy = NULL;
     struct azureus_task *aparent = NULL;
     struct key lookup_id;
     struct kbucket_node_search_list_head list;
     int n_list = 0;
-    struct node *tn = NULL, *tnn = NULL;
     bool need_find_node = FALSE;
-    struct azureus_task *fnt = NULL;
-    struct azureus_rpc_msg *msg = NULL;
+    struct azureus_db_cache_entry *e = NULL;
+    struct azureus_db_val *v = NULL;
+    bool done = FALSE;
 
     DEBUG("entering ...\n");
 
     ASSERT(ad && type && db_key);
 
+    aparent = azureus_task_lookup_table_find(&ad->lookup_table, type, db_key);
+    if (aparent) {
+        DEBUG("joined %p\n", aparent);
+        ad->stats.db.n_joined++;
+        if (tmsg) {
+            TAILQ_INSERT_TAIL(&aparent->tmsg_list, tmsg, next);
+            /* catch up on the values the lookup has streamed so far */
+            if ((type == AZUREUS_TASK_TYPE_FIND_VALUE) && aparent->db_valset) {
+                TAILQ_FOREACH(v, &aparent->db_valset->val_list, next) {
+                    azureus_dht_respond_partial(tmsg, v);
+                }
+            }
+        }
+        return aparent;
+    }
+
     aparent = azureus_task_new(ad, ad->this_node, NULL);
     if (!aparent) {
         return NULL;
     }
 
+    /* even before it has any children, as it may never get one */
+    aparent->task.type = TASK_TYPE_PARENT;
+
+    aparent->db_key = azureus_db_key_new(db_key->len);
+    if (!aparent->db_key) {
+        azureus_task_delete(aparent);
+        return NULL;
+    }
+
+    azureus_db_key_copy(aparent->db_key, db_key);
+
     aparent->type = type;
-    aparent->db_key = db_key;
-    aparent->db_valset = db_valset;
-    aparent->tmsg = tmsg;
+    if (tmsg) {
+        TAILQ_INSERT_TAIL(&aparent->tmsg_list, tmsg, next);
+    }
+
+    azureus_task_lookup_table_add(&ad->lookup_table, aparent);
 
     aparent->state = AZUREUS_TASK_STATE_FIND_NODE_THIS;
 
     bzero(&lookup_id, sizeof(struct key));
     key_new(&lookup_id, KEY_TYPE_SHA1, db_key->data, db_key->len);
 
+    e = azureus_db_cache_find(&ad->db_cache, db_key, dht_get_current_time());
+    if (e && e->n_nodes) {
+        /* the nodes that answered the last lookup of this key are still 
+         * the closest ones we know of */
+        DEBUG("lookup seeded from the cache\n");
+        ad->db_cache.stats.n_node_hit++;
+        azureus_dht_lookup_start(ad, aparent, &e->node_list);
+        done = azureus_dht_lookup_next(ad, aparent, &lookup_id);
+
+        goto out;
+    }
+
     TAILQ_INIT(&list);
 
+    azureus_dht_get_k_closest_nodes(ad, 
+                                    &lookup_id, 
+                                    AZUREUS_K, 
+                                    &list, 
+                                    &n_list, 
+                                    PROTOCOL_VERSION_MIN, 
+                                    TRUE, 
+                                    TRUE);
+
+    if (azureus_dht_is_warm(ad, &list)) {
+        /* the find nodes of the lookup fetch the spoof id of every node that
+         * responds, and only those get a store value, so there is no need 
+         * to find node our own id first */
+        DEBUG("warm routing table\n");
+        azureus_dht_lookup_start(ad, aparent, &list);
+        done = azureus_dht_lookup_next(ad, aparent, &lookup_id);
+
+        goto out;
+    }
+
     /* do we need to do find node first? */
     azureus_dht_add_find_node_db_task(ad, 
                                         aparent, 
@@ -1399,32 +1895,9 @@ azureus_dht_add_parent_db_task(struct azureus_dht *ad,
          /* we are not done looking up our own id */
         goto out;
     } else {
-        /* make a copy of the k-closest nodes because we will be operating only
-         * on the copies from now on */
-
-        ASSERT(aparent->n_nodes == 0);
-
-        TAILQ_FOREACH_SAFE(tn, &list, next, tnn) {
-
-            an = azureus_node_get_ref(tn);
-
-            ancopy = azureus_node_copy(an);
-            ASSERT(ancopy);
-
-            TAILQ_INSERT_TAIL(&aparent->node_list, &ancopy->node, next);
-            aparent->n_nodes++;
-
-            fnt = azureus_dht_find_node_task_new(ad, ancopy, &lookup_id);
-            if (!fnt) {
-                /* FIXME: need a better way to handle this! */
-                ASSERT(0);      
-            }
-
-            task_add_child_task(&aparent->task, &fnt->task);
-            azureus_dht_add_task(ad, fnt);
-            msg = azureus_rpc_msg_get_ref(fnt->task.pkt);
-            azureus_dht_rpc_tx(ad, fnt, msg);
-        }
+        /* we can start looking up the db key right away */
+        azureus_dht_lookup_start(ad, aparent, &list);
+        done = azureus_dht_lookup_next(ad, aparent, &lookup_id);
 
         goto out;
     }
@@ -1488,9 +1961,206 @@ azureus_dht_add_parent_db_task(struct azureus_dht *ad,
 #endif
 
 out:
+    if (done) {
+        /* there was nobody to ask, e.g. the routing table is still empty, 
+         * so the lookup is over before it began and nobody else can have 
+         * joined it yet; the caller answers tmsg */
+        if (tmsg) {
+            TAILQ_REMOVE(&aparent->tmsg_list, tmsg, next);
+        }
+        azureus_dht_parent_db_task_done(ad, aparent, dht_get_current_time());
+        return NULL;
+    }
+
     return aparent;
 }
 
+static void
+azureus_dht_lookup_start(struct azureus_dht *ad, 
+                            struct azureus_task *aparent,
+                            struct kbucket_node_search_list_head *list)
+{
+    struct node *tn = NULL, *tnn = NULL;
+    struct azureus_node *an = NULL, *ancopy = NULL;
+
+    ASSERT(ad && aparent && list);
+
+    ASSERT(aparent->n_nodes == 0);
+
+    aparent->state = AZUREUS_TASK_STATE_FIND_NODE_DB_KEY;
+
+    /* seed the shortlist with a copy of the k-closest nodes (already sorted 
+     * by distance), because we will be operating only on the copies from 
+     * now on */
+    TAILQ_FOREACH_SAFE(tn, list, next, tnn) {
+
+        an = azureus_node_get_ref(tn);
+
+        ancopy = azureus_node_copy(an);
+        if (!ancopy) {
+            /* out of nodes, so the lookup makes do without this one; 
+             * with none at all, lookup_next() finds it is over */
+            continue;
+        }
+
+        TAILQ_INSERT_TAIL(&aparent->node_list, &ancopy->node, next);
+        aparent->n_nodes++;
+    }
+}
+
+/* Sends a find node on the db key to the closest shortlist nodes that were 
+ * not asked yet, with at most AZUREUS_W of them in flight.  Only the 
+ * AZUREUS_K closest nodes that have not failed count, farther nodes that 
+ * were never asked are dropped.  Returns TRUE once all those have 
+ * responded and nothing is in flight, i.e. the lookup has converged. */
+static bool
+azureus_dht_lookup_next(struct azureus_dht *ad, 
+                            struct azureus_task *aparent,
+                            struct key *lookup_id)
+{
+    struct node *tn = NULL, *tnn = NULL;
+    struct azureus_node *an = NULL;
+    struct azureus_task *fnt = NULL;
+    struct azureus_rpc_msg *msg = NULL;
+    bool done = TRUE;
+    int count = 0;
+
+    ASSERT(ad && aparent && lookup_id);
+
+    TAILQ_FOREACH_SAFE(tn, &aparent->node_list, next, tnn) {
+
+        an = azureus_node_get_ref(tn);
+
+        if (an->lookup == AZUREUS_NODE_LOOKUP_FAILED) {
+            continue;
+        }
+
+        if (count == AZUREUS_K) {
+            /* queried nodes are still referenced by their task */
+            if (an->lookup == AZUREUS_NODE_LOOKUP_NONE) {
+                TAILQ_REMOVE(&aparent->node_list, tn, next);
+                aparent->n_nodes--;
+                azureus_node_delete(an);
+            }
+            continue;
+        }
+
+        if (an->lookup == AZUREUS_NODE_LOOKUP_RESPONDED) {
+            count++;
+            continue;
+        }
+
+        if ((an->lookup == AZUREUS_NODE_LOOKUP_QUERIED) 
+                || (aparent->task.n_child >= AZUREUS_W)) {
+            count++;
+            done = FALSE;
+            continue;
+        }
+
+        fnt = azureus_dht_find_node_task_new(ad, an, lookup_id);
+        if (!fnt) {
+            /* out of tasks or msgs, so this node is as good as 
+             * unreachable, let the next closest one stand in for it */
+            an->lookup = AZUREUS_NODE_LOOKUP_FAILED;
+            continue;
+        }
+
+        task_add_child_task(&aparent->task, &fnt->task);
+        azureus_dht_add_task(ad, fnt);
+        msg = azureus_rpc_msg_get_ref(fnt->task.pkt);
+        azureus_dht_rpc_tx(ad, fnt, msg);
+
+        an->lookup = AZUREUS_NODE_LOOKUP_QUERIED;
+        count++;
+        done = FALSE;
+    }
+
+    DEBUG("aparent %p n_nodes %d n_child %d done %d\n", 
+            aparent, aparent->n_nodes, aparent->task.n_child, done);
+
+    return (done && (aparent->task.n_child == 0));
+}
+
+/* remember the closest nodes that answered the lookup of aparent */
+static void
+azureus_dht_cache_nodes(struct azureus_dht *ad, struct azureus_task *aparent,
+                            u64 curr_time)
+{
+    struct azureus_db_cache_entry *e = NULL;
+    struct node *tn = NULL;
+    struct azureus_node *an = NULL, *ancopy = NULL;
+
+    ASSERT(ad && aparent);
+
+    e = azureus_db_cache_add(&ad->db_cache, aparent->db_key);
+    if (!e) {
+        return;
+    }
+
+    azureus_db_cache_flush_nodes(e);
+
+    TAILQ_FOREACH(tn, &aparent->node_list, next) {
+
+        an = azureus_node_get_ref(tn);
+
+        if (an->lookup != AZUREUS_NODE_LOOKUP_RESPONDED) {
+            continue;
+        }
+
+        ancopy = azureus_node_copy(an);
+        if (!ancopy) {
+            break;
+        }
+
+        TAILQ_INSERT_TAIL(&e->node_list, &ancopy->node, next);
+        e->n_nodes++;
+
+        if (e->n_nodes == AZUREUS_K) {
+            break;
+        }
+    }
+
+    e->node_expire = curr_time + AZUREUS_DB_CACHE_NODE_TTL;
+}
+
+/* hand a value the lookup has just found to a pending service request, 
+ * ahead of the final response */
+static void
+azureus_dht_respond_partial(struct tinydht_msg *tmsg, 
+                                struct azureus_db_val *v)
+{
+    ASSERT(tmsg && v);
+
+    tmsg->rsp.status = TINYDHT_RESPONSE_PARTIAL;
+    tmsg->rsp.val_len = (v->len < MAX_VAL_LEN) ? v->len : MAX_VAL_LEN;
+    memcpy(tmsg->rsp.val, v->data, tmsg->rsp.val_len);
+    tmsg->rsp.val_len = htonl(tmsg->rsp.val_len);
+
+    tinydht_respond_partial(tmsg);
+}
+
+/* answer a pending service request with the first of db_valset, or with a
+ * failure if there is none */
+static void
+azureus_dht_respond(struct tinydht_msg *tmsg, 
+                        struct azureus_db_valset *db_valset)
+{
+    struct azureus_db_val *v = NULL;
+
+    ASSERT(tmsg);
+
+    if (db_valset && (v = TAILQ_FIRST(&db_valset->val_list))) {
+        tmsg->rsp.status = TINYDHT_RESPONSE_SUCCESS;
+        tmsg->rsp.val_len = (v->len < MAX_VAL_LEN) ? v->len : MAX_VAL_LEN;
+        memcpy(tmsg->rsp.val, v->data, tmsg->rsp.val_len);
+        tmsg->rsp.val_len = htonl(tmsg->rsp.val_len);
+    } else {
+        tmsg->rsp.status = TINYDHT_RESPONSE_FAILURE;
+    }
+
+    tinydht_respond(tmsg);
+}
+
 static int
 azureus_dht_notify_parent_db_task(struct azureus_dht *ad, 
                                 struct azureus_task *achild, 
@@ -1504,15 +2174,14 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
     struct kbucket_node_search_list_head list;
     int n_list = 0;
     bool need_find_node = FALSE;
-    struct azureus_task *fnt = NULL;
-    struct azureus_task *fvt = NULL, *svt = NULL;
+    struct azureus_task *fvt = NULL;
     struct azureus_node *an = NULL, *ann = NULL;
     struct node *tn = NULL, *tnn = NULL;
     struct azureus_node *tan = NULL, *tann = NULL;
     bool found = FALSE;
     struct tinydht_msg *tmsg = NULL;
-    struct azureus_node *ancopy = NULL;
-    struct azureus_db_item *db_item = NULL;
+    struct azureus_db_valset *valset = NULL;
+    struct azureus_db_val *v = NULL, *vn = NULL;
     u64 curr_time;
     int count = 0;
     int ret;
@@ -1525,8 +2194,7 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
     ASSERT(achild->task.parent);
     aparent = azureus_task_get_ref(achild->task.parent);
     ASSERT(aparent);
-    ASSERT((aparent->state == AZUREUS_TASK_STATE_FIND_NODE_THIS) 
-            || (aparent->state == AZUREUS_TASK_STATE_FIND_NODE_DB_KEY));
+    ASSERT(aparent->state != AZUREUS_TASK_STATE_UNKNOWN);
 
     curr_time = dht_get_current_time();
 
@@ -1577,51 +2245,41 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
 
                     return SUCCESS;
 
-                } else {
-
-                    DEBUG("starting a find node for db key\n");
-
-                    /* we can now just do a find node on the db key */
-                    aparent->state = AZUREUS_TASK_STATE_FIND_NODE_DB_KEY;
-
-                    ASSERT(aparent->n_nodes == 0);
+                }
 
-                    TAILQ_FOREACH_SAFE(tn, &list, next, tnn) {
+                DEBUG("starting a find node for db key\n");
 
-                        an = azureus_node_get_ref(tn);
-                        ancopy = azureus_node_copy(an);
-                        ASSERT(ancopy);
-
-                        TAILQ_INSERT_TAIL(&aparent->node_list, &ancopy->node, 
-                                            next);
-                        aparent->n_nodes++;
-
-                        fnt = azureus_dht_find_node_task_new(ad, ancopy, 
-                                &lookup_id);
-                        if (!fnt) {
-                            /* FIXME: need a better way to handle this! */
-                            ASSERT(0);      
-                        }
+                azureus_dht_lookup_start(ad, aparent, &list);
 
-                        task_add_child_task(&aparent->task, &fnt->task);
-                        azureus_dht_add_task(ad, fnt);
-                        msg = azureus_rpc_msg_get_ref(fnt->task.pkt);
-                        azureus_dht_rpc_tx(ad, fnt, msg);
-                    }
+                DEBUG("aparent->n_nodes %d\n", aparent->n_nodes);
 
-                    DEBUG("aparent->n_nodes %d\n", aparent->n_nodes);
-                }
+                /* the reply was for our own id, so there is nothing in it
+                 * for the db key lookup */
+                reply = NULL;
             }
 
-            return SUCCESS;
+            /* fall through */
 
         case AZUREUS_TASK_STATE_FIND_NODE_DB_KEY:
 
+            /* children of the lookup were sent to shortlist nodes, the one
+             * that got us here from FIND_NODE_THIS was not */
+            an = azureus_node_get_ref(achild->task.node);
+            if (an->lookup == AZUREUS_NODE_LOOKUP_QUERIED) {
+                an->lookup = (status == SUCCESS) 
+                                ? AZUREUS_NODE_LOOKUP_RESPONDED 
+                                : AZUREUS_NODE_LOOKUP_FAILED;
+            }
+
             if (reply != NULL) {
 
                 TAILQ_FOREACH_SAFE(an, &reply->m.find_node_rsp.node_list, 
                         next, ann) {
 
+                    if (key_cmp(&an->node.id, &ad->this_node->node.id) == 0) {
+                        continue;
+                    }
+
                     /* Add these nodes into the aparent->node_list */
                     found = FALSE;
                     TAILQ_FOREACH_SAFE(tn, &aparent->node_list, next, tnn) {
@@ -1646,54 +2304,54 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
                                                     aparent->n_nodes+1);
                     ASSERT(ret == SUCCESS);
                     aparent->n_nodes += 1;
-
-                    fnt = azureus_dht_find_node_task_new(ad, an, 
-                            &lookup_id);
-                    if (!fnt) {
-                        /* FIXME: need a better way to handle this! */
-                        ASSERT(0);      
-                    }
-
-                    task_add_child_task(&aparent->task, &fnt->task);
-                    azureus_dht_add_task(ad, fnt);
-                    msg = azureus_rpc_msg_get_ref(fnt->task.pkt);
-                    azureus_dht_rpc_tx(ad, fnt, msg);
                 }
             }
 
-            if (aparent->task.n_child != 0) {
-                /* we have more waiting to do! */
+            /* keep AZUREUS_W find nodes going until the k closest nodes 
+             * we know of have all answered */
+            if (!azureus_dht_lookup_next(ad, aparent, &lookup_id)) {
                 DEBUG("aparent %p n_child %d type %d status %d\n", 
                         aparent, aparent->task.n_child, achild->type, status);
                 return SUCCESS;
-
             } 
 
+            azureus_dht_cache_nodes(ad, aparent, curr_time);
+
             /* finally, we are ready to do the actual find/store value */
 
             if (aparent->type == AZUREUS_TASK_TYPE_FIND_VALUE) {
                 aparent->state = AZUREUS_TASK_STATE_FIND_VALUE;
             } else if (aparent->type == AZUREUS_TASK_TYPE_STORE_VALUE) {
                 aparent->state = AZUREUS_TASK_STATE_STORE_VALUE;
+
+                /* whatever is stored from now on needs a lookup of its own */
+                azureus_task_lookup_table_remove(&ad->lookup_table, aparent);
+
+                if (aparent->republish) {
+                    /* the stores go out with the rest of the round */
+                    ad->n_republish_ready++;
+                    return SUCCESS;
+                }
             } 
 
             count = 0;
 
-            TAILQ_FOREACH_SAFE(tn, &list, next, tnn) {
+            TAILQ_FOREACH_SAFE(tn, &aparent->node_list, next, tnn) {
+
+                an = azureus_node_get_ref(tn);
 
-                if (tn->state != NODE_STATE_GOOD) {
+                if (an->lookup != AZUREUS_NODE_LOOKUP_RESPONDED) {
                     continue;
                 }
 
-                an = azureus_node_get_ref(tn);
-
                 if (aparent->type == AZUREUS_TASK_TYPE_FIND_VALUE) {
                     /* send a find value request */
                     fvt = azureus_dht_find_value_task_new(ad, an, 
                                                             aparent->db_key);
                     if (!fvt) {
-                        /* FIXME: need a better way to handle this! */
-                        ASSERT(0);      
+                        /* out of tasks or msgs, ask the others */
+                        an->lookup = AZUREUS_NODE_LOOKUP_FAILED;
+                        continue;
                     }
 
                     task_add_child_task(&aparent->task, &fvt->task);
@@ -1703,20 +2361,11 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
                     azureus_dht_rpc_tx(ad, fvt, msg);
 
                 } else if (aparent->type == AZUREUS_TASK_TYPE_STORE_VALUE) {
-                    /* send a store value request */
-                    svt = azureus_dht_store_value_task_new(ad, an, 
-                                                            aparent->db_key, 
-                                                            aparent->db_valset);
-                    if (!svt) {
-                        /* FIXME: need a better way to handle this! */
-                        ASSERT(0);      
+                    /* send the store value requests */
+                    if (!azureus_dht_store_values(ad, aparent, an)) {
+                        /* the values went away while we were looking */
+                        break;
                     }
-
-                    task_add_child_task(&aparent->task, &svt->task);
-                    azureus_dht_add_task(ad, svt);
-                    /* we need to schedule these tasks right away! */
-                    msg = azureus_rpc_msg_get_ref(svt->task.pkt);
-                    azureus_dht_rpc_tx(ad, svt, msg);
                 }
 
                 count++;
@@ -1725,12 +2374,48 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
                 }
             }
 
-            return SUCCESS;
+            if (count) {
+                return SUCCESS;
+            }
+
+            /* nobody answered the lookup, or there is nothing to store */
+            break;
 
         case AZUREUS_TASK_STATE_FIND_VALUE:
 
-            if (reply && reply->m.find_value_rsp.has_vals) {
-                ASSERT(0);
+            if (reply && reply->m.find_value_rsp.has_vals 
+                    && reply->m.find_value_rsp.valset) {
+                valset = reply->m.find_value_rsp.valset;
+                reply->m.find_value_rsp.valset = NULL;
+
+                if (!aparent->db_valset) {
+                    aparent->db_valset = azureus_db_valset_new();
+                    if (!aparent->db_valset) {
+                        aparent->db_valset = valset;
+                        valset = NULL;
+                    }
+                }
+
+                /* collect the values we have not seen yet, and stream them 
+                 * out to the clients right away instead of waiting for 
+                 * the other replicas */
+                if (valset) {
+                    TAILQ_FOREACH_SAFE(v, &valset->val_list, next, vn) {
+                        if (azureus_db_valset_has_val(aparent->db_valset, v)) {
+                            continue;
+                        }
+                        TAILQ_REMOVE(&valset->val_list, v, next);
+                        valset->n_vals--;
+                        TAILQ_INSERT_TAIL(&aparent->db_valset->val_list, 
+                                            v, next);
+                        aparent->db_valset->n_vals++;
+
+                        TAILQ_FOREACH(tmsg, &aparent->tmsg_list, next) {
+                            azureus_dht_respond_partial(tmsg, v);
+                        }
+                    }
+                    azureus_db_valset_delete(valset);
+                }
             }
 
             if (aparent->task.n_child != 0) {
@@ -1751,40 +2436,51 @@ azureus_dht_notify_parent_db_task(struct azureus_dht *ad,
                 return SUCCESS;
             }
 
-            db_item = azureus_dht_find_db_item(ad, aparent->db_key);
-            ASSERT(db_item);
-
-            /* FIXME: should we be storing all the nodes? */
-            TAILQ_FOREACH_SAFE(tn, &aparent->node_list, next, tnn) {
-                TAILQ_REMOVE(&aparent->node_list, tn, next);
-                TAILQ_INSERT_TAIL(&db_item->node_list, tn, next);
-                db_item->n_nodes++;
-            }
-
             break;
 
         default:
             ASSERT(0);
     }
 
-    /* finally, respond to the pending service request */
-    tmsg = aparent->tmsg;
-    if (tmsg) {
-        tmsg->rsp.status = TINYDHT_RESPONSE_FAILURE;
-        ret = send(tmsg->sock, &tmsg->rsp, sizeof(tmsg->rsp), 0);
-        if (ret < 0) {
-            ERROR("send() - %s\n", strerror(errno));
-        }
+    azureus_dht_parent_db_task_done(ad, aparent, curr_time);
+
+    return SUCCESS;
+}
+
+/* the parent task is over, answer whoever was waiting for it */
+static void
+azureus_dht_parent_db_task_done(struct azureus_dht *ad, 
+                                struct azureus_task *aparent,
+                                u64 curr_time)
+{
+    struct tinydht_msg *tmsg = NULL, *tmsgn = NULL;
+    struct azureus_db_cache_entry *e = NULL;
 
-        close(tmsg->sock);
-        free(tmsg);
-        aparent->tmsg = NULL;
+    ASSERT(ad && aparent);
+
+    azureus_task_lookup_table_remove(&ad->lookup_table, aparent);
+
+    /* finally, respond to the pending service requests */
+    TAILQ_FOREACH_SAFE(tmsg, &aparent->tmsg_list, next, tmsgn) {
+        TAILQ_REMOVE(&aparent->tmsg_list, tmsg, next);
+        azureus_dht_respond(tmsg, 
+                (aparent->type == AZUREUS_TASK_TYPE_FIND_VALUE) 
+                        ? aparent->db_valset : NULL);
+    }
+
+    if ((aparent->type == AZUREUS_TASK_TYPE_FIND_VALUE) 
+            && aparent->db_valset) {
+        /* the cache takes over the values */
+        e = azureus_db_cache_add(&ad->db_cache, aparent->db_key);
+        if (e) {
+            azureus_db_cache_set_valset(e, aparent->db_valset, 
+                                    curr_time + AZUREUS_DB_CACHE_VAL_TTL);
+            aparent->db_valset = NULL;
+        }
     }
 
     DEBUG("deleting parent task\n");
     azureus_task_delete(aparent);
-
-    return SUCCESS;
 }
 
 static int
@@ -1811,6 +2507,13 @@ azureus_dht_add_node(struct azureus_dht *ad, struct azureus_node *an)
     DEBUG("index %d\n", index);
 
     ret = kbucket_insert_node(&ad->kbucket[index], &an->node, AZUREUS_K);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    /* may already hold this address under the id of another protocol 
+     * version, azureus_dht_get_node() copes with that */
+    azureus_node_addr_table_add(&ad->addr_table, an);
 
     DEBUG("azureus_node_count %d\n", ad->stats.mem.node);
     DEBUG("azureus_dht_node_count %d\n", azureus_dht_get_node_count(ad));
@@ -1882,6 +2585,10 @@ azureus_dht_delete_node(struct azureus_dht *ad, struct azureus_node *an)
     }
 
     n = kbucket_delete_node(&ad->kbucket[index], &an->node);
+    if (n) {
+        azureus_node_addr_table_remove(&ad->addr_table, 
+                                        azureus_node_get_ref(n));
+    }
     if (n && (an != azureus_node_get_ref(n))) {
         azureus_node_delete(azureus_node_get_ref(n));
     }
@@ -1901,9 +2608,21 @@ azureus_dht_get_node(struct azureus_dht *ad, struct sockaddr_storage *ss,
     struct key k;
     int index;
     struct node *n = NULL;
+    struct azureus_node *an = NULL;
     int ret;
 
-    ret = azureus_node_get_id(&k, ss, proto_ver);
+    /* a known address only maps to the same id if both protocol versions 
+     * derive it the same way */
+    an = azureus_node_addr_table_find(&ad->addr_table, ss);
+    if (an && ((an->proto_ver >= PROTOCOL_VERSION_RESTRICT_ID_PORTS) == 
+                (proto_ver >= PROTOCOL_VERSION_RESTRICT_ID_PORTS))) {
+        return an;
+    }
+
+    ret = azureus_node_get_cached_id(&ad->id_cache, &k, ss, proto_ver);
+    if (ret != SUCCESS) {
+        return NULL;
+    }
 
     /* is it in any kbucket? */
     index = kbucket_index(&ad->this_node->node.id, &k);
@@ -2123,309 +2842,1171 @@ azureus_dht_insert_sort_closest_node(struct kbucket_node_search_list_head *list,
         }
     }
 
-    return FAILURE;
+    return FAILURE;
+}
+
+/* candidate for the k closest nodes, with its distance worked out once */
+struct azureus_dht_closest {
+    struct key          dist;
+    struct node         *node;
+};
+
+static void
+azureus_dht_closest_heap_down(struct azureus_dht_closest *heap, int n, int i)
+{
+    struct azureus_dht_closest tmp;
+    int child;
+
+    /* max-heap on distance, so heap[0] is the farthest candidate */
+    while ((child = 2*i + 1) < n) {
+        if (((child + 1) < n) 
+                && (key_cmp(&heap[child].dist, &heap[child + 1].dist) < 0)) {
+            child++;
+        }
+        if (key_cmp(&heap[i].dist, &heap[child].dist) >= 0) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void
+azureus_dht_closest_heap_add(struct azureus_dht_closest *heap, int *n, int k,
+                                struct key *lookup_id, struct node *candidate)
+{
+    struct azureus_dht_closest tmp;
+    struct key dist;
+    int i, parent;
+
+    key_distance(lookup_id, &candidate->id, &dist);
+
+    if (*n == k) {
+        /* full, so it has to beat the farthest one we have */
+        if (key_cmp(&dist, &heap[0].dist) >= 0) {
+            return;
+        }
+        heap[0].dist = dist;
+        heap[0].node = candidate;
+        azureus_dht_closest_heap_down(heap, *n, 0);
+        return;
+    }
+
+    i = (*n)++;
+    heap[i].dist = dist;
+    heap[i].node = candidate;
+
+    while (i > 0) {
+        parent = (i - 1)/2;
+        if (key_cmp(&heap[parent].dist, &heap[i].dist) >= 0) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void
+azureus_dht_closest_add_kbucket(struct kbucket *kb,
+                                struct azureus_dht_closest *heap, int *n, 
+                                int k, struct key *lookup_id, 
+                                u8 min_proto_ver, bool use_ext, 
+                                bool use_questionable)
+{
+    struct node *tn = NULL;
+    struct azureus_node *an = NULL;
+
+    LIST_FOREACH(tn, &kb->node_list, kb_next) {
+
+        an = azureus_node_get_ref(tn);
+        if (use_questionable 
+                && (an->node.state == NODE_STATE_BAD)) {
+            continue;
+        }
+
+        if (an->proto_ver < min_proto_ver) {
+            continue;
+        }
+
+        if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
+            continue;
+        }
+
+        azureus_dht_closest_heap_add(heap, n, k, lookup_id, tn);
+    }
+
+    if (!use_ext) {
+        return;
+    }
+
+    LIST_FOREACH(tn, &kb->ext_node_list, kb_next) {
+
+        an = azureus_node_get_ref(tn);
+        if (use_questionable 
+                && (an->node.state == NODE_STATE_BAD)) {
+            continue;
+        }
+
+        if (an->proto_ver < min_proto_ver) {
+            continue;
+        }
+
+        if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
+            continue;
+        }
+
+        azureus_dht_closest_heap_add(heap, n, k, lookup_id, tn);
+    }
+}
+
+static int
+azureus_dht_get_k_closest_nodes(struct azureus_dht *ad, 
+                                struct key *lookup_id,
+                                int k,
+                                struct kbucket_node_search_list_head *list, 
+                                int *n_list, 
+                                u8 min_proto_ver, 
+                                bool use_ext, 
+                                bool use_questionable)
+{
+    struct key this_id_dist;
+    int index, max_index;
+    int count = 0;
+    struct azureus_dht_closest heap[AZUREUS_K];
+    struct azureus_dht_closest tmp;
+    int n_heap = 0;
+    int i;
+
+    /* Nodes in kbucket i share the first i bits with this dht id and 
+     * differ in bit i, so for the lookup_id they are all closer than any 
+     * node in kbucket j > i if bit i of (lookup_id ^ this id) is 1, and all
+     * farther if it is 0. That makes the kbuckets totally ordered by 
+     * distance: the ones with a 1 bit in ascending order, then the ones 
+     * with a 0 bit in descending order. Walk them in that order, keep the 
+     * k best candidates in a bounded max-heap, and stop as soon as a whole
+     * kbucket has been added with the heap full. */
+
+    ASSERT(ad && lookup_id && k && (k <= AZUREUS_K) && list && n_list); 
+
+    if (key_cmp(lookup_id, &ad->this_node->node.id) == 0) {
+        /* should never lookup this dht's id */
+        ASSERT(0);
+    }
+
+    key_distance(lookup_id, &ad->this_node->node.id, &this_id_dist);
+
+    max_index = lookup_id->len*8*sizeof(lookup_id->data[0]);
+
+    /* first, the kbuckets that are closer than everything after them */
+    for (index = 0; (index < max_index) && (n_heap < k); index++) {
+
+        if (key_nth_bit(&this_id_dist, (max_index - 1) - index) != 1) {
+            continue;
+        }
+
+        azureus_dht_closest_add_kbucket(&ad->kbucket[index], heap, 
+                                &n_heap, k, lookup_id, min_proto_ver, 
+                                use_ext, use_questionable);
+    }
+
+    /* then the ones that are farther, nearest first */
+    for (index = (max_index - 1); (index >= 0) && (n_heap < k); index--) {
+
+        if (key_nth_bit(&this_id_dist, (max_index - 1) - index) != 0) {
+            continue;
+        }
+
+        azureus_dht_closest_add_kbucket(&ad->kbucket[index], heap, 
+                                &n_heap, k, lookup_id, min_proto_ver, 
+                                use_ext, use_questionable);
+    }
+
+    /* heapsort in place, which leaves the closest node first */
+    count = n_heap;
+    for (i = (n_heap - 1); i > 0; i--) {
+        tmp = heap[0];
+        heap[0] = heap[i];
+        heap[i] = tmp;
+        azureus_dht_closest_heap_down(heap, i, 0);
+    }
+
+    for (i = 0; i < count; i++) {
+        TAILQ_INSERT_TAIL(list, heap[i].node, next);
+    }
+
+    *n_list += count;
+
+    return SUCCESS;
+}
+
+static int
+azureus_dht_get_node_count(struct azureus_dht *ad)
+{
+    int index = 0;
+    int count = 0;
+    int max_index;
+
+    ASSERT(ad);
+
+    max_index = (ad->this_node->node.id.len)*8
+                        *sizeof(ad->this_node->node.id.data[0]);
+
+    for (index = 0; index < max_index; index++) {
+        count += ad->kbucket[index].n_nodes;
+
+    }
+
+    return count;
+}
+
+/* Republishes the local items that are due, in the order they fell due, 
+ * with no more than AZUREUS_REPUBLISH_BUDGET of them looking up at a time. 
+ * They join the round of republishes going on: the stores wait until the 
+ * lookups are done, so that every node they found gets all of its keys in 
+ * as few store value requests as possible. */
+static int
+azureus_dht_db_refresh(struct azureus_dht *ad)
+{
+    struct azureus_db_item *due[AZUREUS_REPUBLISH_BUDGET];
+    struct timer *t = NULL;
+    u64 curr_time = 0;
+    int n_due = 0;
+    int i;
+    int ret;
+
+    ASSERT(ad);
+
+    curr_time = dht_get_current_time();
+
+    while ((ad->n_republish + n_due) < AZUREUS_REPUBLISH_BUDGET) {
+        t = timer_expire(&ad->republish_timers, curr_time);
+        if (!t) {
+            break;
+        }
+        due[n_due++] = container_of(t, struct azureus_db_item, 
+                                    republish_timer);
+    }
+
+    if (n_due == 0) {
+        return SUCCESS;
+    }
+
+    ret = azureus_dht_publish(ad, due, n_due, TRUE);
+    if (ret != SUCCESS) {
+        /* none of them went out, so they are still due */
+        for (i = 0; i < n_due; i++) {
+            timer_add(&ad->republish_timers, &due[i]->republish_timer, 
+                        curr_time);
+        }
+    }
+
+    return ret;
+}
+
+/* A local item is due STORE_VALUE_TIMEOUT after it was last published, less
+ * some jitter, so that the nodes storing it never see it expire and the 
+ * items published together do not all come due together again. Items that 
+ * have never been published are due right away. */
+static void
+azureus_dht_schedule_republish(struct azureus_dht *ad, 
+                                struct azureus_db_item *db_item)
+{
+    u64 due = 0;
+
+    ASSERT(ad && db_item && db_item->is_local);
+
+    if (db_item->last_refresh) {
+        due = db_item->last_refresh + STORE_VALUE_TIMEOUT 
+                - ((u64)random() % AZUREUS_REPUBLISH_JITTER);
+    }
+
+    timer_add(&ad->republish_timers, &db_item->republish_timer, due);
+}
+
+/* a node that the lookup of a republished key found */
+struct azureus_dht_republish_entry {
+    struct azureus_node         *an;
+    struct azureus_task         *aparent;
+    struct azureus_db_item      *db_item;
+};
+
+static int
+azureus_dht_republish_entry_cmp(const void *p1, const void *p2)
+{
+    const struct azureus_dht_republish_entry *e1 = p1, *e2 = p2;
+    int ret;
+
+    ret = key_cmp(&e1->an->node.id, &e2->an->node.id);
+    if (ret) {
+        return ret;
+    }
+
+    /* the same key may have come up in more than one lookup */
+    if (e1->db_item != e2->db_item) {
+        return (e1->db_item < e2->db_item) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Sends out the stores of the republishes that are done looking up. Each 
+ * node gets the keys of every lookup that found it, packed together; the 
+ * requests are children of the first of those parents, the one whose copy
+ * of the node they go to. Lookups that are still going past their own 
+ * deadline are dropped from the round, so that they cannot hold on to the 
+ * republish budget for good. */
+static void
+azureus_dht_republish_flush(struct azureus_dht *ad, u64 curr_time)
+{
+    struct azureus_dht_republish_entry *entry = NULL;
+    struct azureus_db_item **db_item = NULL;
+    struct azureus_db_item *item = NULL;
+    struct azureus_db_key *key = NULL;
+    struct azureus_task *aparent = NULL, *aparentn = NULL;
+    struct azureus_node *an = NULL;
+    struct node *tn = NULL;
+    int n_entries = 0;
+    int n_items = 0;
+    int count;
+    int i, j;
+
+    ASSERT(ad);
+
+    TAILQ_FOREACH(aparent, &ad->republish_list, next_republish) {
+        if (aparent->state == AZUREUS_TASK_STATE_STORE_VALUE) {
+            n_entries += AZUREUS_K*(1 + aparent->n_db_keys);
+        }
+    }
+
+    entry = (struct azureus_dht_republish_entry *) 
+                malloc(n_entries*sizeof(*entry));
+    db_item = (struct azureus_db_item **) malloc(n_entries*sizeof(*db_item));
+    if (n_entries && (!entry || !db_item)) {
+        /* try again on the next go */
+        free(entry);
+        free(db_item);
+        return;
+    }
+
+    n_entries = 0;
+
+    TAILQ_FOREACH(aparent, &ad->republish_list, next_republish) {
+
+        if (aparent->state != AZUREUS_TASK_STATE_STORE_VALUE) {
+            continue;
+        }
+
+        for (key = aparent->db_key; key; 
+                key = (key == aparent->db_key) 
+                        ? TAILQ_FIRST(&aparent->db_key_list) 
+                        : TAILQ_NEXT(key, next)) {
+
+            item = azureus_dht_find_db_item(ad, key);
+            if (!item) {
+                /* the value went away while we were looking */
+                continue;
+            }
+
+            count = 0;
+
+            TAILQ_FOREACH(tn, &aparent->node_list, next) {
+                an = azureus_node_get_ref(tn);
+                if (an->lookup != AZUREUS_NODE_LOOKUP_RESPONDED) {
+                    continue;
+                }
+
+                entry[n_entries].an = an;
+                entry[n_entries].aparent = aparent;
+                entry[n_entries].db_item = item;
+                n_entries++;
+
+                count++;
+                if (count >= AZUREUS_K) {
+                    break;
+                }
+            }
+        }
+    }
+
+    /* qsort is not stable, but which parent ends up sending to a node does
+     * not matter as long as it is one of those that found it */
+    qsort(entry, n_entries, sizeof(*entry), azureus_dht_republish_entry_cmp);
+
+    for (i = 0; i < n_entries; i = j) {
+
+        n_items = 0;
+        db_item[n_items++] = entry[i].db_item;
+
+        for (j = i + 1; (j < n_entries) 
+                && (key_cmp(&entry[i].an->node.id, 
+                            &entry[j].an->node.id) == 0); j++) {
+            if (entry[j].db_item != entry[j - 1].db_item) {
+                db_item[n_items++] = entry[j].db_item;
+            }
+        }
+
+        ad->stats.db.n_republish_pkts += azureus_dht_store_items(ad, 
+                                                        entry[i].aparent, 
+                                                        entry[i].an, 
+                                                        db_item, n_items);
+    }
+
+    free(entry);
+    free(db_item);
+
+    /* the round is out, the parents go on as plain STOREs */
+    TAILQ_FOREACH_SAFE(aparent, &ad->republish_list, next_republish, 
+                        aparentn) {
+
+        if (aparent->state != AZUREUS_TASK_STATE_STORE_VALUE) {
+
+            if (curr_time < aparent->republish_deadline) {
+                /* it waits for the next round */
+                continue;
+            }
+
+            /* it goes on as a plain STORE that new publishes no longer 
+             * join, and its items come due again for a lookup of their 
+             * own */
+            TAILQ_REMOVE(&ad->republish_list, aparent, next_republish);
+            aparent->republish = FALSE;
+            ad->n_republish--;
+            azureus_task_lookup_table_remove(&ad->lookup_table, aparent);
+            ad->stats.db.n_republish_late++;
+
+            for (key = aparent->db_key; key; 
+                    key = (key == aparent->db_key) 
+                            ? TAILQ_FIRST(&aparent->db_key_list) 
+                            : TAILQ_NEXT(key, next)) {
+                item = azureus_dht_find_db_item(ad, key);
+                if (item && item->is_local) {
+                    timer_add(&ad->republish_timers, &item->republish_timer, 
+                                curr_time);
+                }
+            }
+
+            continue;
+        }
+
+        TAILQ_REMOVE(&ad->republish_list, aparent, next_republish);
+        aparent->republish = FALSE;
+        ad->n_republish--;
+        ad->n_republish_ready--;
+
+        if (aparent->task.n_child == 0) {
+            /* its nodes are being stored to by the other parents */
+            azureus_dht_parent_db_task_done(ad, aparent, curr_time);
+        }
+    }
+
+    ASSERT(ad->n_republish_ready == 0);
+
+    if (ad->n_republish) {
+        /* the oldest of what is left comes up first */
+        aparent = TAILQ_FIRST(&ad->republish_list);
+        ad->republish_deadline = aparent->republish_deadline;
+    }
+}
+
+/* Starts storing n_items db items on the network now. Keys that have the 
+ * same k-closest nodes in our routing table will most likely end up on 
+ * the same nodes, so only the first of them is looked up and the others 
+ * are stored along with it, packed into the same store value requests. 
+ * The stores of a republish wait for the rest of its round, see 
+ * azureus_dht_republish_flush(). */
+static int
+azureus_dht_publish(struct azureus_dht *ad, 
+                        struct azureus_db_item **db_item, int n_items,
+                        bool republish)
+{
+    struct node *(*set)[AZUREUS_K] = NULL;
+    int *n_set = NULL;
+    struct azureus_task *aparent = NULL;
+    struct azureus_db_key *key = NULL;
+    u64 curr_time = 0;
+    bool joined = FALSE;
+    int i, j;
+
+    ASSERT(ad && db_item);
+
+    if (n_items == 0) {
+        return SUCCESS;
+    }
+
+    set = malloc(n_items*sizeof(*set));
+    n_set = (int *) malloc(n_items*sizeof(int));
+    if (!set || !n_set) {
+        free(set);
+        free(n_set);
+        return FAILURE;
+    }
+
+    curr_time = dht_get_current_time();
+
+    for (i = 0; i < n_items; i++) {
+        n_set[i] = azureus_dht_get_closest_set(ad, db_item[i]->key, set[i]);
+    }
+
+    for (i = 0; i < n_items; i++) {
+        if (!db_item[i]) {
+            /* grouped with an earlier key */
+            continue;
+        }
+
+        joined = (azureus_task_lookup_table_find(&ad->lookup_table, 
+                                                AZUREUS_TASK_TYPE_STORE_VALUE, 
+                                                db_item[i]->key) != NULL);
+
+        aparent = azureus_dht_add_parent_db_task(ad, 
+                                                NULL,
+                                                AZUREUS_TASK_TYPE_STORE_VALUE, 
+                                                db_item[i]->key);
+
+        /* an item that did not go out keeps its last publish time, so it 
+         * comes due again before its values expire anywhere */
+        if (aparent) {
+            db_item[i]->last_refresh = curr_time;
+        }
+        azureus_dht_schedule_republish(ad, db_item[i]);
+
+        if (!aparent) {
+            continue;
+        }
+
+        if (republish && !joined) {
+            aparent->republish_deadline = curr_time + AZUREUS_REPUBLISH_WAIT;
+            if (ad->n_republish == 0) {
+                ad->republish_deadline = aparent->republish_deadline;
+            }
+            TAILQ_INSERT_TAIL(&ad->republish_list, aparent, next_republish);
+            aparent->republish = TRUE;
+            ad->n_republish++;
+        }
+
+        for (j = i + 1; (j < n_items) && n_set[i]; j++) {
+            if (!db_item[j] || !azureus_dht_same_closest_set(set[i], n_set[i],
+                                                        set[j], n_set[j])) {
+                continue;
+            }
+
+            key = azureus_db_key_new(db_item[j]->key->len);
+            if (!key) {
+                continue;
+            }
+            azureus_db_key_copy(key, db_item[j]->key);
+
+            TAILQ_INSERT_TAIL(&aparent->db_key_list, key, next);
+            aparent->n_db_keys++;
+            ad->stats.db.n_grouped++;
+
+            db_item[j]->last_refresh = curr_time;
+            azureus_dht_schedule_republish(ad, db_item[j]);
+            db_item[j] = NULL;
+        }
+    }
+
+    free(set);
+    free(n_set);
+
+    return SUCCESS;
+}
+
+/* the k-closest nodes to db_key in our routing table */
+static int
+azureus_dht_get_closest_set(struct azureus_dht *ad, 
+                                struct azureus_db_key *db_key,
+                                struct node **set)
+{
+    struct key lookup_id;
+    struct kbucket_node_search_list_head list;
+    struct node *tn = NULL;
+    int n_list = 0;
+    int n_set = 0;
+
+    ASSERT(ad && db_key && set);
+
+    bzero(&lookup_id, sizeof(struct key));
+    key_new(&lookup_id, KEY_TYPE_SHA1, db_key->data, db_key->len);
+
+    TAILQ_INIT(&list);
+
+    azureus_dht_get_k_closest_nodes(ad, 
+                                    &lookup_id, 
+                                    AZUREUS_K, 
+                                    &list, 
+                                    &n_list, 
+                                    PROTOCOL_VERSION_MIN, 
+                                    TRUE, 
+                                    TRUE);
+
+    TAILQ_FOREACH(tn, &list, next) {
+        set[n_set++] = tn;
+        if (n_set == AZUREUS_K) {
+            break;
+        }
+    }
+
+    return n_set;
+}
+
+static bool
+azureus_dht_same_closest_set(struct node **set1, int n_set1,
+                                struct node **set2, int n_set2)
+{
+    int i, j;
+
+    if (n_set1 != n_set2) {
+        return FALSE;
+    }
+
+    /* the same nodes, each key may have them in a different order */
+    for (i = 0; i < n_set1; i++) {
+        for (j = 0; j < n_set2; j++) {
+            if (set1[i] == set2[j]) {
+                break;
+            }
+        }
+        if (j == n_set2) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* The k-closest nodes of a lookup come from a warm routing table if enough
+ * of them have answered a find node lately to fill the first round of the 
+ * lookup, and so have handed us a spoof id that is still good. */
+static bool
+azureus_dht_is_warm(struct azureus_dht *ad, 
+                        struct kbucket_node_search_list_head *list)
+{
+    struct node *tn = NULL;
+    struct azureus_node *an = NULL;
+    u64 curr_time = 0;
+    int count = 0;
+
+    ASSERT(ad && list);
+
+    curr_time = dht_get_current_time();
+
+    TAILQ_FOREACH(tn, list, next) {
+
+        an = azureus_node_get_ref(tn);
+
+        if ((tn->state == NODE_STATE_GOOD) && an->last_find_node_rsp
+                && ((curr_time - an->last_find_node_rsp) <= FIND_NODE_TIMEOUT)) {
+            count++;
+            if (count == AZUREUS_W) {
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+static bool
+azureus_dht_is_stable(struct azureus_dht *ad)
+{
+    static u64 prev_time = 0;
+    u64 curr_time = 0;
+    static int prev_count = 0;
+    int curr_count = 0;
+    u64 elapsed = 0;
+
+    ASSERT(ad);
+
+    /* first, find out if the DHT's routing table is stable */
+    curr_time = dht_get_current_time();
+
+    if ((curr_time - prev_time) < DHT_STABLE_TEST_WINDOW) {
+        return FALSE;
+    }
+
+    /* if here, we have a one second sample */
+
+    prev_time = curr_time;
+
+    curr_count = azureus_dht_get_node_count(ad);
+    if (!curr_count) {
+        prev_count = 0;
+        return FALSE;
+    }
+
+    if ((curr_count - prev_count) != 0) {
+        prev_count = curr_count;
+        return FALSE;
+    }
+
+    if (ad->stats.mem.rpc_msg > 0) {
+        return FALSE;
+    }
+
+    elapsed = (curr_time - ad->cr_time)/(1000*1000);
+    DEBUG("stable in %llu seconds\n", elapsed);
+
+    azureus_dht_summary(ad);
+
+    return TRUE;
+}
+
+void
+azureus_dht_exit(struct dht *dht)
+{
+    struct azureus_dht *ad = NULL;
+
+    ASSERT(dht);
+
+    ad = azureus_dht_get_ref(dht);
+
+    if (ad->dht.snapshot_path[0]) {
+        azureus_dht_snapshot_save(ad);
+    }
+
+    azureus_dht_summary(ad);
+
+    return;
+}
+
+#define AZUREUS_SNAPSHOT_PAD(len)       (((len) + 7) & ~((size_t)7))
+
+int
+azureus_dht_snapshot_load(struct dht *dht)
+{
+    struct azureus_dht *ad = NULL;
+    struct azureus_snapshot_hdr *hdr = NULL;
+    struct stat st;
+    u8 *base = NULL;
+    int fd;
+    int ret = FAILURE;
+
+    ASSERT(dht);
+
+    ad = azureus_dht_get_ref(dht);
+
+    /* don't overwrite whatever is there before it has been read */
+    ad->next_snapshot = dht_get_current_time() + AZUREUS_SNAPSHOT_INTERVAL;
+
+    fd = open(dht->snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        return FAILURE;
+    }
+
+    if ((fstat(fd, &st) < 0) 
+            || (st.st_size < (off_t)sizeof(struct azureus_snapshot_hdr))) {
+        close(fd);
+        return FAILURE;
+    }
+
+    base = (u8 *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return FAILURE;
+    }
+
+    hdr = (struct azureus_snapshot_hdr *)base;
+
+    if ((hdr->dht.magic != DHT_SNAPSHOT_MAGIC) 
+            || (hdr->dht.version != DHT_SNAPSHOT_VERSION)
+            || (hdr->dht.type != DHT_TYPE_AZUREUS)
+            || (hdr->dht.len != st.st_size)
+            || (hdr->node_size != sizeof(struct azureus_snapshot_node))
+            || (hdr->item_off < sizeof(struct azureus_snapshot_hdr) 
+                            + (u64)hdr->n_nodes*hdr->node_size)
+            || (hdr->item_off > hdr->dht.len)) {
+        ERROR("%s is not a usable snapshot\n", dht->snapshot_path);
+        goto out;
+    }
+
+    ret = azureus_dht_snapshot_load_nodes(ad, base, hdr);
+    if (ret != SUCCESS) {
+        goto out;
+    }
+
+    ret = azureus_dht_snapshot_load_items(ad, base, hdr);
+
+    INFO("restored %u nodes and %u values from %s\n", 
+            hdr->n_nodes, hdr->n_items, dht->snapshot_path);
+
+out:
+    munmap(base, st.st_size);
+    return ret;
 }
 
 static int
-azureus_dht_get_k_closest_nodes(struct azureus_dht *ad, 
-                                struct key *lookup_id,
-                                int k,
-                                struct kbucket_node_search_list_head *list, 
-                                int *n_list, 
-                                u8 min_proto_ver, 
-                                bool use_ext, 
-                                bool use_questionable)
+azureus_dht_snapshot_load_nodes(struct azureus_dht *ad, u8 *base, 
+                                struct azureus_snapshot_hdr *hdr)
 {
-    struct key this_id_dist;
-    int index, max_index;
-    int count = 0;
-    int ret;
-    struct node *tn = NULL, *tnn = NULL;
+    struct azureus_snapshot_node *sn = NULL;
     struct azureus_node *an = NULL;
-    struct kbucket_node_search_list_head sort_list;
-
-    /* First, find the key distance between the lookup_id and this dht id.
-     * This will give the subtree/kbucket to start looking in.
-     * Then, find and sort the nodes closest to the lookup_id from a list of
-     * candidate nodes, which could be all of the nodes in this dht. */
+    struct sockaddr_storage ss;
+    u32 i;
 
-    ASSERT(ad && lookup_id && k && list && n_list); 
+    ASSERT(ad && base && hdr);
 
-    if (key_cmp(lookup_id, &ad->this_node->node.id) == 0) {
-        /* should never lookup this dht's id */
-        ASSERT(0);
-    }
+    sn = (struct azureus_snapshot_node *)(base + sizeof(*hdr));
 
-    TAILQ_INIT(&sort_list);
+    for (i = 0; i < hdr->n_nodes; i++, sn++) {
 
-    ret = key_distance(lookup_id, &ad->this_node->node.id, &this_id_dist);
+        azureus_db_orig_get_addr(&sn->addr, &ss);
 
-    max_index = lookup_id->len*8*sizeof(lookup_id->data[0]);
+        if (azureus_dht_get_node(ad, &ss, sn->addr.proto_ver)) {
+            continue;
+        }
 
-    /* first, walk - 159th bit, 158th bit, ... 0th bit */
-    for (index = (max_index - 1); (index >= 0); index--) {
+        an = azureus_node_new(ad, sn->addr.proto_ver, &ss);
+        if (!an) {
+            return FAILURE;
+        }
 
-        if (key_nth_bit(&this_id_dist, index) != 1) {
+        if (key_cmp(&ad->this_node->node.id, &an->node.id) == 0) {
+            azureus_node_delete(an);
             continue;
         }
 
-        LIST_FOREACH_SAFE(tn, 
-                &ad->kbucket[(max_index - 1) - index].node_list, 
-                kb_next, tnn) {
+        /* the state is stale, let the refresh find out afresh */
+        an->failures = sn->failures;
+        memcpy(an->viv_pos, sn->viv_pos, sizeof(an->viv_pos));
+        an->node.state = NODE_STATE_UNKNOWN;
 
-            an = azureus_node_get_ref(tn);
-            if (use_questionable 
-                    && (an->node.state == NODE_STATE_BAD)) {
-                continue;
-            }
+        /* its kbucket may already be full */
+        if (azureus_dht_add_node(ad, an) != SUCCESS) {
+            azureus_node_delete(an);
+        }
+    }
 
-            if (an->proto_ver < min_proto_ver) {
-                continue;
-            }
+    return SUCCESS;
+}
 
-            if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
-                continue;
-            }
+static int
+azureus_dht_snapshot_load_items(struct azureus_dht *ad, u8 *base, 
+                                struct azureus_snapshot_hdr *hdr)
+{
+    struct azureus_snapshot_item *si = NULL;
+    struct azureus_snapshot_val *sv = NULL;
+    struct azureus_db_key *db_key = NULL;
+    struct azureus_db_valset *db_valset = NULL;
+    struct azureus_db_val *db_val = NULL;
+    struct azureus_db_item *db_item = NULL;
+    u64 off, end, voff;
+    u32 i, j;
+    int ret;
 
-            azureus_dht_insert_sort_closest_node(&sort_list, 
-                    lookup_id,
-                    tn, 
-                    k);
-        }
+    ASSERT(ad && base && hdr);
 
-        if (use_ext) {
+    off = hdr->item_off;
 
-            LIST_FOREACH_SAFE(tn, 
-                    &ad->kbucket[(max_index - 1) - index].ext_node_list, 
-                    kb_next, tnn) {
+    for (i = 0; i < hdr->n_items; i++, off = end) {
 
-                an = azureus_node_get_ref(tn);
-                if (use_questionable 
-                        && (an->node.state == NODE_STATE_BAD)) {
-                    continue;
-                }
+        si = (struct azureus_snapshot_item *)(base + off);
 
-                if (an->proto_ver < min_proto_ver) {
-                    continue;
-                }
+        if ((off + sizeof(*si) > hdr->dht.len)
+                || (si->len < sizeof(*si) + AZUREUS_SNAPSHOT_PAD(si->key_len))
+                || (off + si->len > hdr->dht.len)) {
+            return FAILURE;
+        }
 
-                if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
-                    continue;
-                }
+        end = off + si->len;
 
-                azureus_dht_insert_sort_closest_node(&sort_list, 
-                        lookup_id,
-                        tn, 
-                        k);
-            }
+        db_key = azureus_db_key_new(si->key_len);
+        db_valset = azureus_db_valset_new();
+        if (!db_key || !db_valset) {
+            goto err;
         }
-    }
 
-    /* we walk backwards now - 0th bit, 1st bit ... 159th bit */
-    for (index = 0; (index <= (max_index - 1)); index++) {
+        memcpy(db_key->data, base + off + sizeof(*si), si->key_len);
 
-        if (key_nth_bit(&this_id_dist, index) != 0) {
-            continue;
-        }
+        voff = off + sizeof(*si) + AZUREUS_SNAPSHOT_PAD(si->key_len);
 
-        LIST_FOREACH_SAFE(tn, 
-                &ad->kbucket[(max_index - 1) - index].node_list, 
-                kb_next, tnn) {
+        for (j = 0; j < si->n_vals; j++) {
 
-            an = azureus_node_get_ref(tn);
-            if (use_questionable 
-                    && (an->node.state == NODE_STATE_BAD)) {
-                continue;
-            }
+            sv = (struct azureus_snapshot_val *)(base + voff);
 
-            if (an->proto_ver < min_proto_ver) {
-                continue;
+            if ((voff + sizeof(*sv) > end) 
+                    || (voff + sizeof(*sv) + sv->len > end)) {
+                goto err;
             }
 
-            if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
-                continue;
+            db_val = azureus_db_val_new(sv->len);
+            if (!db_val) {
+                goto err;
             }
 
-            azureus_dht_insert_sort_closest_node(&sort_list, 
-                    lookup_id,
-                    tn, 
-                    k);
-        }
-
-        if (use_ext) {
-
-            LIST_FOREACH_SAFE(tn, 
-                    &ad->kbucket[(max_index - 1) - index].ext_node_list, 
-                    kb_next, tnn) {
-
-                an = azureus_node_get_ref(tn);
-                if (use_questionable 
-                        && (an->node.state == NODE_STATE_BAD)) {
-                    continue;
-                }
-
-                if (an->proto_ver < min_proto_ver) {
-                    continue;
-                }
+            db_val->timestamp = sv->timestamp;
+            db_val->ver = sv->ver;
+            db_val->flags = sv->flags;
+            memcpy(&db_val->orig, &sv->orig, sizeof(struct azureus_db_orig));
+            memcpy(db_val->data, base + voff + sizeof(*sv), sv->len);
 
-                if (an->node_status == AZUREUS_NODE_STATUS_BOOTSTRAP) {
-                    continue;
-                }
+            TAILQ_INSERT_TAIL(&db_valset->val_list, db_val, next);
+            db_valset->n_vals++;
 
-                azureus_dht_insert_sort_closest_node(&sort_list, 
-                        lookup_id,
-                        tn, 
-                        k);
-            }
+            voff += sizeof(*sv) + AZUREUS_SNAPSHOT_PAD(sv->len);
         }
-    }
 
-    /* once all the parsing and sorting has been done,
-     * pick the top 'k' nodes */
+        ret = azureus_dht_add_db_item(ad, db_key, db_valset, TRUE);
+        if (ret != SUCCESS) {
+            /* add_db_item() frees them on any failure */
+            return ret;
+        }
 
-    count = 0;
-    TAILQ_FOREACH_SAFE(tn, &sort_list, next, tnn) {
-        TAILQ_REMOVE(&sort_list, tn, next);
-        TAILQ_INSERT_TAIL(list, tn, next);
-        count++;
-        if (count == k) {
-            break;
+        /* keep the republish schedule from before the restart */
+        db_item = azureus_dht_find_db_item(ad, db_key);
+        if (db_item) {
+            db_item->last_refresh = si->last_refresh;
+            azureus_dht_schedule_republish(ad, db_item);
         }
     }
 
-    *n_list += count;
-
     return SUCCESS;
+
+err:
+    if (db_key) {
+        azureus_db_key_delete(db_key);
+    }
+    if (db_valset) {
+        azureus_db_valset_delete(db_valset);
+    }
+    return FAILURE;
 }
 
 static int
-azureus_dht_get_node_count(struct azureus_dht *ad)
+azureus_dht_snapshot_save(struct azureus_dht *ad)
 {
-    int index = 0;
-    int count = 0;
-    int max_index;
+    struct azureus_snapshot_hdr hdr;
+    struct azureus_snapshot_node sn;
+    struct azureus_snapshot_item si;
+    struct azureus_snapshot_val sv;
+    struct azureus_db_item *item = NULL;
+    struct azureus_db_val *v = NULL;
+    struct node *node = NULL;
+    struct azureus_node *an = NULL;
+    char tmp_path[DHT_SNAPSHOT_PATH_LEN + 8];
+    FILE *fp = NULL;
+    int i, pass;
+    int ret;
 
     ASSERT(ad);
 
-    max_index = (ad->this_node->node.id.len)*8
-                        *sizeof(ad->this_node->node.id.data[0]);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ad->dht.snapshot_path);
 
-    for (index = 0; index < max_index; index++) {
-        count += ad->kbucket[index].n_nodes;
+    fp = fopen(tmp_path, "w");
+    if (!fp) {
+        ERROR("cannot write %s - %s\n", tmp_path, strerror(errno));
+        return FAILURE;
+    }
 
+    /* the header goes out first as a placeholder, and again once the 
+     * counts are known */
+    bzero(&hdr, sizeof(hdr));
+    hdr.dht.magic = DHT_SNAPSHOT_MAGIC;
+    hdr.dht.version = DHT_SNAPSHOT_VERSION;
+    hdr.dht.type = DHT_TYPE_AZUREUS;
+    hdr.dht.port = ad->dht.port;
+    hdr.dht.timestamp = dht_get_current_time();
+    hdr.node_size = sizeof(struct azureus_snapshot_node);
+
+    if (azureus_dht_snapshot_write(fp, &hdr, sizeof(hdr)) != SUCCESS) {
+        goto err;
     }
 
-    return count;
-}
+    for (i = 0; i < 160; i++) {
+        for (pass = 0; pass < 2; pass++) {
+            node = pass ? LIST_FIRST(&ad->kbucket[i].ext_node_list)
+                        : LIST_FIRST(&ad->kbucket[i].node_list);
+            for (; node; node = LIST_NEXT(node, kb_next)) {
+                an = azureus_node_get_ref(node);
+                if ((an == ad->bootstrap) 
+                        || (an->node.state == NODE_STATE_BAD)) {
+                    continue;
+                }
 
-static int
-azureus_dht_db_refresh(struct azureus_dht *ad)
-{
-    struct azureus_db_item *db_item = NULL, *db_itemn = NULL;
-    u64 curr_time = 0;
-    struct azureus_task *at = NULL;
+                bzero(&sn, sizeof(sn));
+                if (azureus_db_orig_set(&sn.addr, &an->ext_addr, 
+                                        an->proto_ver) != SUCCESS) {
+                    continue;
+                }
+                sn.failures = an->failures;
+                memcpy(sn.viv_pos, an->viv_pos, sizeof(sn.viv_pos));
 
-    ASSERT(ad);
+                if (azureus_dht_snapshot_write(fp, &sn, sizeof(sn)) 
+                        != SUCCESS) {
+                    goto err;
+                }
+                hdr.n_nodes++;
+            }
+        }
+    }
 
-    curr_time = dht_get_current_time();
+    hdr.item_off = sizeof(hdr) 
+                    + hdr.n_nodes*AZUREUS_SNAPSHOT_PAD(sizeof(sn));
+    ASSERT(AZUREUS_SNAPSHOT_PAD(sizeof(sn)) == sizeof(sn));
 
-    TAILQ_FOREACH_SAFE(db_item, &ad->db_list, db_next, db_itemn) {
-        if (!db_item->is_local) {
-            /* FIXME: we don't publish the key-value pair if this is not the
-             * originating node */
+    /* remote values are someone else's to republish */
+    TAILQ_FOREACH(item, &ad->db_list, db_next) {
+        if (!item->is_local) {
             continue;
         }
 
-        if ((curr_time - db_item->last_refresh) > STORE_VALUE_TIMEOUT) {
-            db_item->last_refresh = curr_time;
-            at = azureus_dht_add_parent_db_task(ad, 
-                                                NULL,
-                                                AZUREUS_TASK_TYPE_STORE_VALUE, 
-                                                db_item->key, 
-                                                db_item->valset);
+        bzero(&si, sizeof(si));
+        si.last_refresh = item->last_refresh;
+        si.key_len = item->key->len;
+        si.n_vals = item->valset->n_vals;
+        si.len = sizeof(si) + AZUREUS_SNAPSHOT_PAD(si.key_len);
+        TAILQ_FOREACH(v, &item->valset->val_list, next) {
+            si.len += sizeof(sv) + AZUREUS_SNAPSHOT_PAD(v->len);
         }
-    }
 
-    return SUCCESS;
-}
-
-static bool
-azureus_dht_is_stable(struct azureus_dht *ad)
-{
-    static u64 prev_time = 0;
-    u64 curr_time = 0;
-    static int prev_count = 0;
-    int curr_count = 0;
-    u64 elapsed = 0;
-
-    ASSERT(ad);
+        if ((azureus_dht_snapshot_write(fp, &si, sizeof(si)) != SUCCESS)
+                || (azureus_dht_snapshot_write(fp, item->key->data, 
+                                                si.key_len) != SUCCESS)) {
+            goto err;
+        }
 
-    /* first, find out if the DHT's routing table is stable */
-    curr_time = dht_get_current_time();
+        TAILQ_FOREACH(v, &item->valset->val_list, next) {
+            bzero(&sv, sizeof(sv));
+            sv.timestamp = v->timestamp;
+            sv.ver = v->ver;
+            memcpy(&sv.orig, &v->orig, sizeof(struct azureus_db_orig));
+            sv.len = v->len;
+            sv.flags = v->flags;
+
+            if ((azureus_dht_snapshot_write(fp, &sv, sizeof(sv)) != SUCCESS)
+                    || (azureus_dht_snapshot_write(fp, v->data, v->len) 
+                                                            != SUCCESS)) {
+                goto err;
+            }
+        }
 
-    if ((curr_time - prev_time) < DHT_STABLE_TEST_WINDOW) {
-        return FALSE;
+        hdr.n_items++;
     }
 
-    /* if here, we have a one second sample */
-
-    prev_time = curr_time;
+    hdr.dht.len = ftell(fp);
 
-    curr_count = azureus_dht_get_node_count(ad);
-    if (!curr_count) {
-        prev_count = 0;
-        return FALSE;
+    if ((fseek(fp, 0, SEEK_SET) < 0)
+            || (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)) {
+        goto err;
     }
 
-    if ((curr_count - prev_count) != 0) {
-        prev_count = curr_count;
-        return FALSE;
+    /* a failed fclose() still releases the stream */
+    ret = fclose(fp);
+    fp = NULL;
+    if (ret != 0) {
+        goto err;
     }
 
-    if (ad->stats.mem.rpc_msg > 0) {
-        return FALSE;
+    /* readers only ever see a complete snapshot */
+    if (rename(tmp_path, ad->dht.snapshot_path) < 0) {
+        goto err;
     }
 
-    elapsed = (curr_time - ad->cr_time)/(1000*1000);
-    DEBUG("stable in %llu seconds\n", elapsed);
+    DEBUG("saved %u nodes and %u values to %s\n", 
+            hdr.n_nodes, hdr.n_items, ad->dht.snapshot_path);
 
-    azureus_dht_summary(ad);
+    return SUCCESS;
 
-    return TRUE;
+err:
+    ERROR("cannot write %s - %s\n", tmp_path, strerror(errno));
+    if (fp) {
+        fclose(fp);
+    }
+    unlink(tmp_path);
+    return FAILURE;
 }
 
-void
-azureus_dht_exit(struct dht *dht)
+static int
+azureus_dht_snapshot_write(FILE *fp, void *data, size_t len)
 {
-    struct azureus_dht *ad = NULL;
+    static const u8 zero[8];
+    size_t pad;
 
-    ASSERT(dht);
+    pad = AZUREUS_SNAPSHOT_PAD(len) - len;
 
-    ad = azureus_dht_get_ref(dht);
+    if (len && (fwrite(data, len, 1, fp) != 1)) {
+        return FAILURE;
+    }
 
-    azureus_dht_summary(ad);
+    if (pad && (fwrite(zero, pad, 1, fp) != 1)) {
+        return FAILURE;
+    }
 
-    return;
+    return SUCCESS;
 }
 
 static int
 azureus_dht_add_db_item(struct azureus_dht *ad, struct azureus_db_key *db_key, 
                         struct azureus_db_valset *db_valset, bool is_local)
 {
-    struct azureus_db_item *db_item = NULL;
+    struct azureus_db_item *db_item = NULL, *old = NULL;
+    size_t old_mem = 0;
+    u64 old_expires = 0;
+    int ret = SUCCESS;
 
     ASSERT(ad && db_key && db_valset);
 
-    /* if there was already a db_item, remove it! */
-    azureus_dht_delete_db_item(ad, db_key);
+    old = azureus_db_table_find(&ad->db_table, db_key);
+    if (old && old->is_local && !is_local) {
+        /* others announcing a key we PUT ourselves, ours stays */
+        azureus_db_key_delete(db_key);
+        azureus_db_valset_delete(db_valset);
+        return SUCCESS;
+    }
 
     db_item = azureus_db_item_new(ad, db_key, db_valset);
     if (!db_item) {
+        azureus_db_key_delete(db_key);
+        azureus_db_valset_delete(db_valset);
         return FAILURE;
     }
 
     db_item->is_local = is_local;
+    db_item->mem = azureus_db_item_mem(db_item);
+
+    /* our own values are never given up for remote ones */
+    if (!is_local) {
+        /* the old item gives up its room to the new one, so it must not 
+         * be evicted to make that room */
+        if (old) {
+            old_mem = old->mem;
+            old_expires = old->expire_timer.expires;
+            timer_del(&ad->db_timers, &old->expire_timer);
+        }
+
+        if (db_item->mem > old_mem) {
+            ret = azureus_dht_db_make_room(ad, db_item->mem - old_mem);
+        }
 
+        if (old) {
+            timer_add(&ad->db_timers, &old->expire_timer, old_expires);
+        }
+
+        if (ret != SUCCESS) {
+            ad->stats.db.n_rejected++;
+            azureus_db_item_delete(db_item);
+            return FAILURE;
+        }
+    }
+
+    /* if there was already a db_item, remove it! */
+    azureus_dht_delete_db_item(ad, db_key);
+
+    if (!is_local) {
+        timer_add(&ad->db_timers, &db_item->expire_timer, 
+                    db_item->cr_time + ad->db_ttl);
+    } else {
+        azureus_dht_schedule_republish(ad, db_item);
+        /* a GET must not be answered with what was there before */
+        azureus_db_cache_drop_valset(&ad->db_cache, db_key);
+    }
+
+    ad->db_mem += db_item->mem;
+
+    azureus_db_table_add(&ad->db_table, db_item);
     TAILQ_INSERT_TAIL(&ad->db_list, db_item, db_next);
     DEBUG("Added new db item %p\n", db_item);
 
@@ -2436,40 +4017,83 @@ static int
 azureus_dht_delete_db_item(struct azureus_dht *ad, 
                             struct azureus_db_key *db_key)
 {
-    struct azureus_db_item *item = NULL, *itemn = NULL;
+    struct azureus_db_item *item = NULL;
 
     ASSERT(ad && db_key);
 
-    TAILQ_FOREACH_SAFE(item, &ad->db_list, db_next, itemn) {
-        if (!azureus_db_key_equal(item->key, db_key)) {
-            continue;
-        }
-
-        TAILQ_REMOVE(&ad->db_list, item, db_next);
-        azureus_db_item_delete(item);
-        DEBUG("Deleted db item %p\n", item);
+    item = azureus_db_table_find(&ad->db_table, db_key);
+    if (!item) {
+        return SUCCESS;
     }
 
+    azureus_dht_unlink_db_item(ad, item);
+    DEBUG("Deleted db item %p\n", item);
+
     return SUCCESS;
 }
 
-static struct azureus_db_item *
-azureus_dht_find_db_item(struct azureus_dht *ad, struct azureus_db_key *db_key)
+static void
+azureus_dht_unlink_db_item(struct azureus_dht *ad, struct azureus_db_item *item)
 {
-    struct azureus_db_item *item = NULL, *itemn = NULL;
+    ASSERT(ad && item);
+
+    azureus_db_table_remove(&ad->db_table, item);
+    TAILQ_REMOVE(&ad->db_list, item, db_next);
+    timer_del(&ad->db_timers, &item->expire_timer);
+    timer_del(&ad->republish_timers, &item->republish_timer);
+    ad->db_mem -= item->mem;
+    azureus_db_item_delete(item);
+}
 
-    ASSERT(ad && db_key);
+static int
+azureus_dht_db_make_room(struct azureus_dht *ad, size_t mem)
+{
+    struct timer *t = NULL;
+    int n;
 
-    TAILQ_FOREACH_SAFE(item, &ad->db_list, db_next, itemn) {
-        DEBUG("key_cmp\n");
-        pkt_dump_data(item->key->data, item->key->len);
-        pkt_dump_data(db_key->data, db_key->len);
-        if (azureus_db_key_equal(item->key, db_key)) {
-            return item;
+    ASSERT(ad);
+
+    /* evict the remote items that would expire first anyway */
+    for (n = 0; (ad->db_mem + mem > ad->db_max_mem) 
+                    && (n < AZUREUS_DB_EXPIRE_BUDGET); n++) {
+        t = timer_peek(&ad->db_timers);
+        if (!t) {
+            break;
         }
+        azureus_dht_unlink_db_item(ad, 
+                container_of(t, struct azureus_db_item, expire_timer));
+        ad->stats.db.n_evicted++;
     }
 
-    return NULL;
+    return (ad->db_mem + mem > ad->db_max_mem) ? FAILURE : SUCCESS;
+}
+
+static void
+azureus_dht_db_expire(struct azureus_dht *ad, u64 curr_time)
+{
+    struct timer *t = NULL;
+    int n;
+
+    ASSERT(ad);
+
+    /* whatever is left over is picked up on the next refresh */
+    for (n = 0; n < AZUREUS_DB_EXPIRE_BUDGET; n++) {
+        t = timer_peek(&ad->db_timers);
+        if (!t || (t->expires > curr_time)) {
+            break;
+        }
+        azureus_dht_unlink_db_item(ad, 
+                container_of(t, struct azureus_db_item, expire_timer));
+        ad->stats.db.n_expired++;
+    }
+}
+
+static struct azureus_db_item *
+azureus_dht_find_db_item(struct azureus_dht *ad, struct azureus_db_key *db_key)
+{
+    ASSERT(ad && db_key);
+
+    return azureus_db_table_find(&ad->db_table, db_key);
 }
 
 static void
@@ -2588,6 +4212,12 @@ azureus_dht_summary(struct azureus_dht *ad)
     INFO("\ttask        %d (%d KB)\n", ad->stats.mem.task,
             ad->stats.mem.task*sizeof(struct azureus_task)/1024);
 
+    INFO("\n");
+    INFO("pools:\n");
+    pool_dump_stats(&ad->pool.rpc_msg);
+    pool_dump_stats(&ad->pool.task);
+    pool_dump_stats(&ad->pool.node);
+
     INFO("\n");
     INFO("net usage:\n");
     INFO("\trx          %llu bytes %llu Bps\n", 
@@ -2595,6 +4225,45 @@ azureus_dht_summary(struct azureus_dht *ad)
     INFO("\ttx          %llu bytes %llu Bps\n", 
             ad->stats.net.tx, ad->stats.net.tx/elapsed);
 
+    INFO("\n");
+    INFO("db:\n");
+    INFO("\titems       %u (%u KB)\n", ad->db_table.n_items, 
+            (u32)(ad->db_mem/1024));
+    INFO("\texpired     %u\n", ad->stats.db.n_expired);
+    INFO("\tevicted     %u\n", ad->stats.db.n_evicted);
+    INFO("\trejected    %u\n", ad->stats.db.n_rejected);
+    INFO("\tjoined      %u\n", ad->stats.db.n_joined);
+    INFO("\tgrouped     %u\n", ad->stats.db.n_grouped);
+    INFO("\trepublished %u\n", ad->stats.db.n_republish_pkts);
+    INFO("\tlate        %u\n", ad->stats.db.n_republish_late);
+
+    INFO("\n");
+    INFO("node id cache:\n");
+    INFO("\thits        %llu\n", 
+            (unsigned long long)ad->id_cache.stats.n_hit);
+    INFO("\tmisses      %llu\n", 
+            (unsigned long long)ad->id_cache.stats.n_miss);
+
+    INFO("\n");
+    INFO("lookup cache:\n");
+    INFO("\thits        %llu\n", 
+            (unsigned long long)ad->db_cache.stats.n_hit);
+    INFO("\tnode hits   %llu\n", 
+            (unsigned long long)ad->db_cache.stats.n_node_hit);
+    INFO("\tmisses      %llu\n", 
+            (unsigned long long)ad->db_cache.stats.n_miss);
+
+    INFO("\n");
+    INFO("tx batching:\n");
+    INFO("\tflushes     %llu\n", 
+            (unsigned long long)ad->dht.txq.stats.n_flush);
+    INFO("\tpkts        %llu (%llu per flush, max %u)\n", 
+            (unsigned long long)ad->dht.txq.stats.n_pkts,
+            (unsigned long long)(ad->dht.txq.stats.n_flush 
+                ? ad->dht.txq.stats.n_pkts/ad->dht.txq.stats.n_flush : 0),
+            ad->dht.txq.stats.max_batch);
+    INFO("\terrors      %u\n", ad->dht.txq.stats.n_errors);
+
     INFO("\n");
     INFO("rpc stats:\n");
     INFO("\tping        req rx %d\n", ad->stats.rpc.ping_req_rx);
@@ -2736,7 +4405,6 @@ azureus_dht_net_usage_update(struct azureus_dht *ad, size_t size,
 static bool
 azureus_dht_rate_limit_allow(struct azureus_dht *ad)
 {
-    static u64 prev_time = 0;
     u64 curr_time = 0;
     u64 elapsed = 0;
     u64 n_rx_tx = 0;
@@ -2747,12 +4415,12 @@ azureus_dht_rate_limit_allow(struct azureus_dht *ad)
 
     curr_time = dht_get_current_time();
 
-    if (prev_time == 0) {
-        prev_time = curr_time;
+    if (ad->rate_limit_start == 0) {
+        ad->rate_limit_start = curr_time;
         return TRUE;
     }
 
-    elapsed = (curr_time - prev_time)/1000;
+    elapsed = (curr_time - ad->rate_limit_start)/1000;
 
     // DEBUG("elapsed %lld size %lld\n", elapsed, n_rx_tx);
     // DEBUG("result %lld\n", (elapsed*(RATE_LIMIT_BITS_PER_SEC/1000)));
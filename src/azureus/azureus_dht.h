@@ -34,6 +34,8 @@ struct azureus_dht;
 #include "dht.h"
 #include "kbucket.h"
 #include "queue.h"
+#include "timer.h"
+#include "pool.h"
 #include "azureus_node.h"
 #include "azureus_task.h"
 #include "azureus_db.h"
@@ -49,6 +51,16 @@ struct azureus_dht_net_stats {
     u64         tx;
 };
 
+struct azureus_dht_db_stats {
+    u32         n_expired;
+    u32         n_evicted;
+    u32         n_rejected;
+    u32         n_joined;       /* GETs/STOREs that joined a lookup */
+    u32         n_grouped;      /* keys stored using another key's lookup */
+    u32         n_republish_pkts;   /* store values sent by republishes */
+    u32         n_republish_late;   /* lookups dropped from their round */
+};
+
 struct azureus_dht_rpc_stats {
     u32         ping_req_rx;
     u32         ping_rsp_tx;
@@ -69,6 +81,41 @@ struct azureus_dht_rpc_stats {
     u32         other_rx;
 };
 
+/* snapshot file layout: the header, n_nodes fixed-size node records, then
+ * from item_off on the local db items, each one an item record, its key
+ * and its values, with every part padded to 8 bytes */
+struct azureus_snapshot_hdr {
+    struct dht_snapshot_hdr     dht;
+    u32                         n_nodes;
+    u32                         node_size;
+    u32                         n_items;
+    u32                         item_off;
+};
+
+struct azureus_snapshot_node {
+    struct azureus_db_orig      addr;       /* same record as for values */
+    u16                         failures;
+    u16                         pad;
+    struct azureus_vivaldi_pos  viv_pos[MAX_RPC_VIVALDI_POS];
+};
+
+struct azureus_snapshot_item {
+    u64                         last_refresh;
+    u32                         len;        /* of the record, all padded */
+    u16                         n_vals;
+    u8                          key_len;
+    u8                          pad;
+};
+
+struct azureus_snapshot_val {
+    u64                         timestamp;
+    u32                         ver;
+    struct azureus_db_orig      orig;
+    u16                         len;
+    u8                          flags;
+    u8                          pad[5];
+};
+
 struct azureus_dht {
     struct dht                  dht;
     u64                         cr_time;
@@ -80,15 +127,57 @@ struct azureus_dht {
     struct azureus_node         *this_node;
     struct azureus_node         *bootstrap;
     struct kbucket              kbucket[160];
+    /* every node in the kbuckets, by id and by address */
+    struct node_table           node_table;
+    struct azureus_node_addr_table  addr_table;
+    /* ids of recently seen addresses */
+    struct azureus_node_id_cache    id_cache;
     u32                         n_tasks;
     TAILQ_HEAD(azureus_task_list_head, azureus_task)    task_list;
+    /* tasks that still have to be sent out */
+    TAILQ_HEAD(azureus_pending_list_head, azureus_task) pending_list;
+    /* since when our traffic counts against the rate limit */
+    u64                         rate_limit_start;
+    /* rpc timeouts of the tasks in WAIT state */
+    struct timer_heap           task_timers;
+    /* outstanding requests by conn_id */
+    struct azureus_task_table   task_table;
+    /* parent tasks by db key, for the ones that can still be joined */
+    struct azureus_task_lookup_table    lookup_table;
+    u64                         next_refresh;
+    u64                         next_snapshot;
+    /* db items by key; db_list keeps them in insertion order for refresh */
+    struct azureus_db_table     db_table;
     TAILQ_HEAD(azureus_db_list_head, azureus_db_item)   db_list;
+    /* remote db items by expiry time, and the memory the db holds */
+    struct timer_heap           db_timers;
+    /* local db items by when they are due to be published again */
+    struct timer_heap           republish_timers;
+    u64                         db_ttl;
+    size_t                      db_mem;
+    size_t                      db_max_mem;
+    /* what recent lookups found */
+    struct azureus_db_cache     db_cache;
+    /* the round of republishes going on, and how many of them are done 
+     * looking up */
+    TAILQ_HEAD(azureus_republish_list_head, azureus_task)   republish_list;
+    int                         n_republish;
+    int                         n_republish_ready;
+    u64                         republish_deadline;
+
+    /* fixed-size object pools, see stats.mem for what is in use */
+    struct {
+        struct pool             rpc_msg;
+        struct pool             task;
+        struct pool             node;
+    } pool;
 
     /* DHT stats */
     struct {
         struct azureus_dht_mem_stats    mem;
         struct azureus_dht_net_stats    net;
         struct azureus_dht_rpc_stats    rpc;
+        struct azureus_dht_db_stats     db;
     } stats;
 };
 
@@ -97,6 +186,14 @@ struct azureus_dht {
 
 #define MAX_OUTSTANDING_TASKS   128
 
+/* object pool sizes, these bound the memory a DHT instance can use */
+#define AZUREUS_RPC_MSG_SLAB    32
+#define AZUREUS_RPC_MSG_MAX     4096
+#define AZUREUS_TASK_SLAB       64
+#define AZUREUS_TASK_MAX        4096
+#define AZUREUS_NODE_SLAB       128
+#define AZUREUS_NODE_MAX        16384
+
 #define PING_TIMEOUT            ((u64)15*60*1000*1000)          
 /* 15 minutes */
 #define FIND_NODE_TIMEOUT       PING_TIMEOUT
@@ -104,10 +201,51 @@ struct azureus_dht {
 
 #define STORE_VALUE_TIMEOUT     ((u64)30*60*1000*1000)
 
+/* room taken up in a store value request by everything but the keys and 
+ * the value sets, when packing more than one of them into it */
+#define AZUREUS_STORE_VALUE_HDR_LEN     128
+
+/* how long the stores of a republish round wait for its slowest lookups,
+ * 1 minute */
+#define AZUREUS_REPUBLISH_WAIT  ((u64)60*1000*1000)
+
+/* local items are published again up to this much before STORE_VALUE_TIMEOUT
+ * is up, at random, so that the ones put together drift apart, 5 minutes */
+#define AZUREUS_REPUBLISH_JITTER    ((u64)5*60*1000*1000)
+
+/* max. local items that a refresh starts to publish again */
+#define AZUREUS_REPUBLISH_BUDGET    128
+
 #define DHT_STABLE_TEST_WINDOW  AZUREUS_RPC_TIMEOUT
 
 #define AZUREUS_RATE_LIMIT_BITS_PER_SEC (4*1024)
 
+#define AZUREUS_REFRESH_INTERVAL        ((u64)1*1000*1000)
+/* kbucket and database refresh, 1 second */
+#define AZUREUS_TX_RETRY_INTERVAL       ((u64)100*1000)
+/* recheck the rate limit for pending tasks, 100 millisecs */
+
+#ifndef AZUREUS_DB_TTL
+#define AZUREUS_DB_TTL                  ((u64)2*60*60*1000*1000)
+#endif
+/* remote values are dropped 2 hours after they were last stored */
+#ifndef AZUREUS_DB_MAX_MEM
+#define AZUREUS_DB_MAX_MEM              ((size_t)64*1024*1024)
+#endif
+/* above this, the remote values closest to expiry make room for new ones */
+#define AZUREUS_DB_EXPIRE_BUDGET        256
+/* max. remote items dropped per refresh or per STORE */
+#ifndef AZUREUS_DB_CACHE_VAL_TTL
+#define AZUREUS_DB_CACHE_VAL_TTL        ((u64)60*1000*1000)
+#endif
+/* the values a GET found answer the same GET for 1 minute */
+#ifndef AZUREUS_DB_CACHE_NODE_TTL
+#define AZUREUS_DB_CACHE_NODE_TTL       ((u64)10*60*1000*1000)
+#endif
+/* the nodes that answered a lookup seed the next one of its key for 10 mins */
+#define AZUREUS_SNAPSHOT_INTERVAL       ((u64)5*60*1000*1000)
+/* save the routing table and the local values every 5 minutes */
+
 /*-------------------------------------------------------------
  *
  *      Static functions
@@ -129,8 +267,11 @@ azureus_dht_get_ref(struct dht *dht)
 struct dht * azureus_dht_new(struct dht_net_if *nif, int port);
 void azureus_dht_delete(struct dht *dht);
 int azureus_dht_put(struct dht *dht, struct tinydht_msg *tmsg);
+int azureus_dht_put_batch(struct dht *dht, struct tinydht_msg **tmsg, 
+                                int n_tmsg);
 int azureus_dht_get(struct dht *dht, struct tinydht_msg *tmsg);
 int azureus_dht_task_schedule(struct dht *dht);
+int azureus_dht_snapshot_load(struct dht *dht);
 int azureus_dht_rpc_rx(struct dht *dht, struct sockaddr_storage *from, 
                     size_t fromlen, u8 *data, int len, u64 timestamp);
 void azureus_dht_exit(struct dht *dht);
@@ -31,6 +31,14 @@
 #include "crypto.h"
 #include "azureus_dht.h"
 
+static bool azureus_node_addr_equal(struct sockaddr_storage *a, 
+                                    struct sockaddr_storage *b);
+static u64 azureus_node_addr_hash(struct sockaddr_storage *ss);
+static u32 azureus_node_addr_table_hash(struct azureus_node_addr_table *at, 
+                                    struct sockaddr_storage *ss);
+static int azureus_node_addr_table_resize(struct azureus_node_addr_table *at, 
+                                    u32 size);
+
 struct azureus_node *
 azureus_node_new(struct azureus_dht *ad, u8 proto_ver, 
                     struct sockaddr_storage *ss)
@@ -41,7 +49,7 @@ azureus_node_new(struct azureus_dht *ad, u8 proto_ver,
 
     ASSERT(ad && ss);
 
-    an = (struct azureus_node *) malloc(sizeof(struct azureus_node));
+    an = (struct azureus_node *) pool_alloc(&ad->pool.node);
     if (!an) {
         return NULL;
     }
@@ -50,10 +58,13 @@ azureus_node_new(struct azureus_dht *ad, u8 proto_ver,
 
     bzero(an, sizeof(struct azureus_node));
 
+    /* needed by azureus_node_delete() on the error path */
+    an->dht = ad;
     an->proto_ver = proto_ver;
     memcpy(&an->ext_addr, ss, sizeof(struct sockaddr_storage));
 
-    ret = azureus_node_get_id(&k, &an->ext_addr, proto_ver);
+    ret = azureus_node_get_cached_id(&ad->id_cache, &k, &an->ext_addr, 
+                                        proto_ver);
     if (ret != SUCCESS) {
         goto err;
     }
@@ -92,7 +103,7 @@ azureus_node_delete(struct azureus_node *an)
     ASSERT(!an->n_tasks);
 
     ad = an->dht;
-    free(an);
+    pool_free(&ad->pool.node, an);
     ad->stats.mem.node--;
 }
 
@@ -102,6 +113,10 @@ azureus_node_copy(struct azureus_node *an)
     struct azureus_node *copy = NULL;
 
     copy = azureus_node_new(an->dht, an->proto_ver, &an->ext_addr);
+    if (!copy) {
+        return NULL;
+    }
+
     copy->cr_time = an->cr_time;
     copy->node_status = an->node_status;
     copy->proto_ver = an->proto_ver;
@@ -113,6 +128,7 @@ azureus_node_copy(struct azureus_node *an)
     copy->alive = an->alive;
     copy->last_ping = an->last_ping;
     copy->last_find_node = an->last_find_node;
+    copy->last_find_node_rsp = an->last_find_node_rsp;
     copy->failures = an->failures;
     copy->dht = an->dht;
 
@@ -200,6 +216,69 @@ azureus_node_get_id(struct key *k, struct sockaddr_storage *ss, u8 proto_ver)
     return SUCCESS;
 }
 
+int
+azureus_node_get_cached_id(struct azureus_node_id_cache *c, struct key *k,
+                            struct sockaddr_storage *ss, u8 proto_ver)
+{
+    struct azureus_node_id_cache_entry *e = NULL;
+    struct sockaddr_in *in4 = NULL;
+    struct sockaddr_in6 *in6 = NULL;
+    u8 addr[16];
+    u16 port;
+    bool restrict_port;
+    int ret;
+
+    ASSERT(c && k && ss);
+
+    bzero(addr, sizeof(addr));
+
+    switch (ss->ss_family) {
+        case AF_INET:
+            in4 = (struct sockaddr_in *)ss;
+            memcpy(addr, &in4->sin_addr, sizeof(struct in_addr));
+            port = in4->sin_port;
+            break;
+
+        case AF_INET6:
+            in6 = (struct sockaddr_in6 *)ss;
+            memcpy(addr, &in6->sin6_addr, sizeof(struct in6_addr));
+            port = in6->sin6_port;
+            break;
+
+        default:
+            return FAILURE;
+    }
+
+    /* proto_ver only matters for whether the port gets folded */
+    restrict_port = (proto_ver >= PROTOCOL_VERSION_RESTRICT_ID_PORTS);
+
+    e = &c->slot[(u32)(azureus_node_addr_hash(ss) >> 32) 
+                    & (AZUREUS_NODE_ID_CACHE_SIZE - 1)];
+
+    if ((e->family == ss->ss_family) && (e->port == port) 
+            && (e->restrict_port == restrict_port)
+            && (memcmp(e->addr, addr, sizeof(addr)) == 0)) {
+        c->stats.n_hit++;
+        memcpy(k, &e->id, sizeof(struct key));
+        return SUCCESS;
+    }
+
+    c->stats.n_miss++;
+
+    ret = azureus_node_get_id(k, ss, proto_ver);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    memcpy(&e->id, k, sizeof(struct key));
+    memcpy(e->addr, addr, sizeof(addr));
+    e->port = port;
+    e->family = ss->ss_family;
+    e->restrict_port = restrict_port;
+
+    return SUCCESS;
+}
+
 int
 azureus_node_get_spoof_id(struct azureus_node *an, u32 *id)
 {
@@ -229,3 +308,213 @@ azureus_node_delete_task(struct azureus_node *an, struct azureus_task *at)
     TAILQ_REMOVE(&an->task_list, at, next_node_task);
     an->n_tasks--;
 }
+
+int
+azureus_node_addr_table_new(struct azureus_node_addr_table *at)
+{
+    ASSERT(at);
+
+    bzero(at, sizeof(struct azureus_node_addr_table));
+
+    return azureus_node_addr_table_resize(at, 
+                                    AZUREUS_NODE_ADDR_TABLE_INIT_SIZE);
+}
+
+void
+azureus_node_addr_table_delete(struct azureus_node_addr_table *at)
+{
+    ASSERT(at);
+
+    if (at->slot) {
+        free(at->slot);
+    }
+
+    bzero(at, sizeof(struct azureus_node_addr_table));
+}
+
+int
+azureus_node_addr_table_add(struct azureus_node_addr_table *at, 
+                            struct azureus_node *an)
+{
+    u32 i;
+    int ret;
+
+    ASSERT(at && an);
+
+    /* keep the load factor at or below 1/2 */
+    if (2*(at->n_nodes + 1) > at->size) {
+        ret = azureus_node_addr_table_resize(at, 2*at->size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    for (i = azureus_node_addr_table_hash(at, &an->ext_addr); at->slot[i]; 
+            i = (i + 1) & (at->size - 1)) {
+        /* the same address under an id of another protocol version */
+        if (azureus_node_addr_equal(&at->slot[i]->ext_addr, &an->ext_addr)) {
+            return FAILURE;
+        }
+    }
+
+    at->slot[i] = an;
+    at->n_nodes++;
+
+    return SUCCESS;
+}
+
+int
+azureus_node_addr_table_remove(struct azureus_node_addr_table *at, 
+                                struct azureus_node *an)
+{
+    u32 i, j, home;
+
+    ASSERT(at && an);
+
+    for (i = azureus_node_addr_table_hash(at, &an->ext_addr); 
+            at->slot[i] != an; i = (i + 1) & (at->size - 1)) {
+        if (!at->slot[i]) {
+            return FAILURE;
+        }
+    }
+
+    at->slot[i] = NULL;
+    at->n_nodes--;
+
+    /* shift back the rest of the cluster */
+    for (j = (i + 1) & (at->size - 1); at->slot[j]; 
+            j = (j + 1) & (at->size - 1)) {
+        home = azureus_node_addr_table_hash(at, &at->slot[j]->ext_addr);
+        if (((j - home) & (at->size - 1)) >= ((j - i) & (at->size - 1))) {
+            at->slot[i] = at->slot[j];
+            at->slot[j] = NULL;
+            i = j;
+        }
+    }
+
+    return SUCCESS;
+}
+
+struct azureus_node *
+azureus_node_addr_table_find(struct azureus_node_addr_table *at, 
+                                struct sockaddr_storage *ss)
+{
+    u32 i;
+
+    ASSERT(at && ss);
+
+    for (i = azureus_node_addr_table_hash(at, ss); at->slot[i]; 
+            i = (i + 1) & (at->size - 1)) {
+        if (azureus_node_addr_equal(&at->slot[i]->ext_addr, ss)) {
+            return at->slot[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+azureus_node_addr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+    struct sockaddr_in *a4 = NULL, *b4 = NULL;
+    struct sockaddr_in6 *a6 = NULL, *b6 = NULL;
+
+    if (a->ss_family != b->ss_family) {
+        return FALSE;
+    }
+
+    switch (a->ss_family) {
+        case AF_INET:
+            a4 = (struct sockaddr_in *)a;
+            b4 = (struct sockaddr_in *)b;
+            return (a4->sin_port == b4->sin_port) 
+                && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+
+        case AF_INET6:
+            a6 = (struct sockaddr_in6 *)a;
+            b6 = (struct sockaddr_in6 *)b;
+            return (a6->sin6_port == b6->sin6_port) 
+                && (memcmp(&a6->sin6_addr, &b6->sin6_addr, 
+                            sizeof(struct in6_addr)) == 0);
+
+        default:
+            break;
+    }
+
+    return FALSE;
+}
+
+static u64
+azureus_node_addr_hash(struct sockaddr_storage *ss)
+{
+    struct sockaddr_in6 *in6 = NULL;
+    u64 h = 0;
+    u32 w;
+    int i;
+
+    switch (ss->ss_family) {
+        case AF_INET:
+            h = ((struct sockaddr_in *)ss)->sin_addr.s_addr;
+            h = (h << 16) | ((struct sockaddr_in *)ss)->sin_port;
+            break;
+
+        case AF_INET6:
+            in6 = (struct sockaddr_in6 *)ss;
+            for (i = 0; i < 4; i++) {
+                memcpy(&w, &in6->sin6_addr.s6_addr[4*i], sizeof(w));
+                h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+            }
+            h ^= in6->sin6_port;
+            break;
+
+        default:
+            break;
+    }
+
+    return h * 0x9e3779b97f4a7c15ULL;
+}
+
+static u32
+azureus_node_addr_table_hash(struct azureus_node_addr_table *at, 
+                                struct sockaddr_storage *ss)
+{
+    return (u32)(azureus_node_addr_hash(ss) >> 32) & (at->size - 1);
+}
+
+static int
+azureus_node_addr_table_resize(struct azureus_node_addr_table *at, u32 size)
+{
+    struct azureus_node **old = NULL;
+    u32 old_size;
+    u32 i, j;
+
+    ASSERT(at && size && !(size & (size - 1)));
+
+    old = at->slot;
+    old_size = at->size;
+
+    at->slot = (struct azureus_node **) 
+                        malloc(size*sizeof(struct azureus_node *));
+    if (!at->slot) {
+        at->slot = old;
+        return FAILURE;
+    }
+
+    bzero(at->slot, size*sizeof(struct azureus_node *));
+    at->size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i]) {
+            continue;
+        }
+        for (j = azureus_node_addr_table_hash(at, &old[i]->ext_addr); 
+                at->slot[j]; j = (j + 1) & (at->size - 1));
+        at->slot[j] = old[i];
+    }
+
+    if (old) {
+        free(old);
+    }
+
+    return SUCCESS;
+}
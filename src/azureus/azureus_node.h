@@ -35,6 +35,14 @@ enum azureus_node_status {
     AZUREUS_NODE_STATUS_UNKNOWN = 0xffffffff
 };
 
+/* progress of a node on the shortlist of a db key lookup */
+enum azureus_node_lookup {
+    AZUREUS_NODE_LOOKUP_NONE = 0,
+    AZUREUS_NODE_LOOKUP_QUERIED,
+    AZUREUS_NODE_LOOKUP_RESPONDED,
+    AZUREUS_NODE_LOOKUP_FAILED
+};
+
 struct azureus_node {
     struct node                         node;
     struct sockaddr_storage             ext_addr;
@@ -52,11 +60,43 @@ struct azureus_node {
     bool                                ignore;
     u64                                 last_ping;
     u64                                 last_find_node;
+    u64                                 last_find_node_rsp;
     int                                 failures;
+    enum azureus_node_lookup            lookup;
+    bool                                orphan;     /* lookup is over */
     struct azureus_dht                  *dht;
     TAILQ_ENTRY(azureus_node)           next;
 };
 
+#define AZUREUS_NODE_ADDR_TABLE_INIT_SIZE   1024    /* must be a power of 2 */
+
+/* routing table nodes by ext_addr, so that a known sender can be found
+ * without hashing its address into an id first */
+struct azureus_node_addr_table {
+    struct azureus_node                 **slot;
+    u32                                 size;
+    u32                                 n_nodes;
+};
+
+#define AZUREUS_NODE_ID_CACHE_SIZE  512     /* must be a power of 2 */
+
+/* direct-mapped cache of azureus_node_get_id() results */
+struct azureus_node_id_cache_entry {
+    struct key                          id;
+    u8                                  addr[16];
+    u16                                 port;
+    u8                                  family;     /* 0 if unused */
+    bool                                restrict_port;
+};
+
+struct azureus_node_id_cache {
+    struct azureus_node_id_cache_entry  slot[AZUREUS_NODE_ID_CACHE_SIZE];
+    struct {
+        u64                             n_hit;
+        u64                             n_miss;
+    } stats;
+};
+
 struct azureus_node_serialized {
     struct sockaddr_storage         ext_addr;
     u32                             rnd_id;
@@ -75,9 +115,21 @@ struct azureus_node * azureus_node_copy(struct azureus_node *an);
 
 int azureus_node_get_id(struct key *k, struct sockaddr_storage *ss, 
                         u8 proto_ver);
+int azureus_node_get_cached_id(struct azureus_node_id_cache *c, struct key *k,
+                        struct sockaddr_storage *ss, u8 proto_ver);
 int azureus_node_get_spoof_id(struct azureus_node *an, u32 *id);
 
 void azureus_node_add_task(struct azureus_node *an, struct azureus_task *at);
 void azureus_node_delete_task(struct azureus_node *an, struct azureus_task *at);
 
+int azureus_node_addr_table_new(struct azureus_node_addr_table *at);
+void azureus_node_addr_table_delete(struct azureus_node_addr_table *at);
+int azureus_node_addr_table_add(struct azureus_node_addr_table *at, 
+                                struct azureus_node *an);
+int azureus_node_addr_table_remove(struct azureus_node_addr_table *at, 
+                                struct azureus_node *an);
+struct azureus_node * azureus_node_addr_table_find(
+                                struct azureus_node_addr_table *at, 
+                                struct sockaddr_storage *ss);
+
 #endif /* AZUREUS_NODE_H__ */
@@ -75,14 +75,18 @@ azureus_rpc_msg_new(struct azureus_dht *ad,
 
     ASSERT(ad && (len >= 0));
 
-    msg = (struct azureus_rpc_msg *) malloc(sizeof(struct azureus_rpc_msg));
+    msg = (struct azureus_rpc_msg *) pool_alloc(&ad->pool.rpc_msg);
     if (!msg) {
         return NULL;
     }
 
     ad->stats.mem.rpc_msg++;
 
-    bzero(msg, sizeof(struct azureus_rpc_msg));
+    /* clear everything but the pkt payload, pkt_new() takes care of the 
+     * rest of the pkt */
+    bzero(msg, offsetof(struct azureus_rpc_msg, pkt));
+    bzero(&msg->pkt + 1, sizeof(struct azureus_rpc_msg) 
+                - offsetof(struct azureus_rpc_msg, pkt) - sizeof(struct pkt));
 
     ret = pkt_new(&msg->pkt, &ad->dht, ss, sslen, data, len);
     if (ret != SUCCESS) {
@@ -156,7 +160,7 @@ azureus_rpc_msg_delete(struct azureus_rpc_msg *msg)
     }
 
 out:
-    free(msg);
+    pool_free(&ad->pool.rpc_msg, msg);
     ad->stats.mem.rpc_msg--;
 }
 
@@ -233,11 +237,19 @@ azureus_rpc_msg_decode(struct azureus_dht *ad,
     struct azureus_rpc_msg *msg = NULL;
     int ret;
 
-    msg = azureus_rpc_msg_new(ad, from, fromlen, data, len);
+    msg = azureus_rpc_msg_new(ad, from, fromlen, NULL, 0);
     if (!msg) {
         return FAILURE;
     }
 
+    /* decode straight out of the receive buffer, every field we keep is
+     * copied out of it by the decoders */
+    ret = pkt_borrow(&msg->pkt, data, len);
+    if (ret != SUCCESS) {
+        azureus_rpc_msg_delete(msg);
+        return FAILURE;
+    }
+
     pkt_dump(&msg->pkt);
 
     ret = msg_get_rpc_action(msg, &msg->action);
@@ -253,29 +253,88 @@ azureus_pkt_write_db_key(struct pkt *pkt, struct azureus_db_key *key)
 int
 azureus_pkt_read_db_key(struct pkt *pkt, struct azureus_db_key **key)
 {
+    u8 len;
     int ret;
     
     ASSERT(pkt && key);
 
-    *key = azureus_db_key_new();
+    *key = NULL;
+
+    ret = pkt_read_byte(pkt, &len);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    *key = azureus_db_key_new(len);
     if (!(*key)) {
-        *key = NULL;
         return FAILURE;
     }
 
-    ret = pkt_read_byte(pkt, &(*key)->len);
+    ret = pkt_read_arr(pkt, (*key)->data, len);
     if (ret != SUCCESS) {
+        azureus_db_key_delete(*key);
         *key = NULL;
         return ret;
     }
+    
+    return SUCCESS;
+}
+
+static int
+azureus_pkt_write_db_orig(struct pkt *pkt, struct azureus_db_orig *orig)
+{
+    struct sockaddr_storage ss;
+    int ret;
+
+    ASSERT(pkt && orig);
 
-    ret = pkt_read_arr(pkt, (*key)->data, (*key)->len);
+    /* same layout as azureus_pkt_write_node() */
+    ret = pkt_write_byte(pkt, CT_UDP);
     if (ret != SUCCESS) {
-        *key = NULL;
         return ret;
     }
-    
-    return SUCCESS;
+
+    ret = pkt_write_byte(pkt, orig->proto_ver);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    azureus_db_orig_get_addr(orig, &ss);
+
+    return azureus_pkt_write_inetaddr(pkt, &ss);
+}
+
+static int
+azureus_pkt_read_db_orig(struct pkt *pkt, struct azureus_db_orig *orig)
+{
+    struct sockaddr_storage ss;
+    u8 nd_type;
+    u8 proto_ver;
+    int ret;
+
+    ASSERT(pkt && orig);
+
+    ret = pkt_read_byte(pkt, &nd_type);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    if (nd_type != CT_UDP) {
+        ERROR("unsupported node type %d\n", nd_type);
+        return FAILURE;
+    }
+
+    ret = pkt_read_byte(pkt, &proto_ver);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = azureus_pkt_read_inetaddr(pkt, &ss);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    return azureus_db_orig_set(orig, &ss, proto_ver);
 }
 
 int
@@ -319,7 +378,7 @@ azureus_pkt_write_db_val(struct pkt *pkt, struct azureus_db_val *val,
         return ret;
     }
 
-    ret = azureus_pkt_write_node(pkt, &val->orig_node);
+    ret = azureus_pkt_write_db_orig(pkt, &val->orig);
     if (ret != SUCCESS) {
         return ret;
     }
@@ -338,73 +397,80 @@ int
 azureus_pkt_read_db_val(struct pkt *pkt, struct azureus_db_val **val, 
                         u8 proto_ver)
 {
+    u32 ver;
+    u64 timestamp;
+    u16 len;
     int ret;
     
     ASSERT(pkt && val);
 
-    *val = azureus_db_val_new();
-    if (!(*val)) {
-        *val = NULL;
-        return FAILURE;
-    }
+    *val = NULL;
 
-    ret = pkt_read_int(pkt, &(*val)->ver);
+    ret = pkt_read_int(pkt, &ver);
     if (ret != SUCCESS) {
-        *val = NULL;
         return ret;
     }
 
-    DEBUG("val_ver %#x\n", (*val)->ver);
+    DEBUG("val_ver %#x\n", ver);
 
     if (proto_ver >= PROTOCOL_VERSION_REMOVE_DIST_ADD_VER) {
 
     } else {
-        if ((*val)->ver != 0) {
+        if (ver != 0) {
             ERROR("expected all zeros\n");
         }
     }
 
-    ret = pkt_read_long(pkt, &(*val)->timestamp);
+    ret = pkt_read_long(pkt, &timestamp);
     if (ret != SUCCESS) {
-        *val = NULL;
         return ret;
     }
 
-    DEBUG("timestamp %#0llx\n", (*val)->timestamp);
+    DEBUG("timestamp %#0llx\n", timestamp);
 
-    ret = pkt_read_short(pkt, &(*val)->len);
+    ret = pkt_read_short(pkt, &len);
     if (ret != SUCCESS) {
-        *val = NULL;
         return ret;
     }
 
-    DEBUG("val_len %#x\n", (*val)->len);
+    DEBUG("val_len %#x\n", len);
+
+    /* the header fields are known now, so the value can be sized */
+    *val = azureus_db_val_new(len);
+    if (!(*val)) {
+        return FAILURE;
+    }
+
+    (*val)->ver = ver;
+    (*val)->timestamp = timestamp;
 
-    ret = pkt_read_arr(pkt, (*val)->data, (*val)->len);
+    ret = pkt_read_arr(pkt, (*val)->data, len);
     if (ret != SUCCESS) {
-        *val = NULL;
-        return ret;
+        goto err;
     }
 
     DEBUG("reading node\n");
 
-    ret = azureus_pkt_read_node(pkt, &(*val)->orig_node);
+    ret = azureus_pkt_read_db_orig(pkt, &(*val)->orig);
     if (ret != SUCCESS) {
-        *val = NULL;
-        return ret;
+        goto err;
     }
 
     DEBUG("reading flags\n");
 
     ret = pkt_read_byte(pkt, &(*val)->flags);
     if (ret != SUCCESS) {
-        *val = NULL;
-        return ret;
+        goto err;
     }
 
     DEBUG("flags %#x\n", (*val)->flags);
 
     return SUCCESS;
+
+err:
+    azureus_db_val_delete(*val);
+    *val = NULL;
+    return ret;
 }
 
 int
@@ -471,3 +537,36 @@ azureus_pkt_read_db_valset(struct pkt *pkt, struct azureus_db_valset **valset,
 
     return SUCCESS;
 }
+
+/* the number of bytes azureus_pkt_write_db_key() writes for key */
+size_t
+azureus_pkt_db_key_len(struct azureus_db_key *key)
+{
+    ASSERT(key);
+
+    return sizeof(u8) + key->len;
+}
+
+/* the number of bytes azureus_pkt_write_db_valset() writes for valset */
+size_t
+azureus_pkt_db_valset_len(struct azureus_db_valset *valset)
+{
+    struct azureus_db_val *val = NULL;
+    size_t len;
+
+    ASSERT(valset);
+
+    len = sizeof(u16);
+
+    TAILQ_FOREACH(val, &valset->val_list, next) {
+        /* ver, timestamp, len, data */
+        len += sizeof(u32) + sizeof(u64) + sizeof(u16) + val->len;
+        /* orig: contact type, proto ver, addr len, addr, port */
+        len += 3*sizeof(u8) + sizeof(u16);
+        len += (val->orig.family == AF_INET6) ? 16 : 4;
+        /* flags */
+        len += sizeof(u8);
+    }
+
+    return len;
+}
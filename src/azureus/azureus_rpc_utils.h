@@ -39,4 +39,7 @@ int azureus_pkt_write_db_valset(struct pkt *pkt,
 int azureus_pkt_read_db_valset(struct pkt *pkt, 
                                 struct azureus_db_valset **valset, u8 proto_ver);
 
+size_t azureus_pkt_db_key_len(struct azureus_db_key *key);
+size_t azureus_pkt_db_valset_len(struct azureus_db_valset *valset);
+
 #endif /* __AZUREUS_RPC_UTILS_H__ */
@@ -22,6 +22,13 @@
 #include "azureus_dht.h"
 #include "azureus_rpc.h"
 
+static u64 azureus_task_conn_id(struct azureus_task *at);
+static u32 azureus_task_table_hash(struct azureus_task_table *tt, u64 conn_id);
+static int azureus_task_table_resize(struct azureus_task_table *tt, u32 size);
+static struct azureus_task ** azureus_task_lookup_table_chain(
+                                        struct azureus_task_lookup_table *lt, 
+                                        struct azureus_db_key *db_key);
+
 struct azureus_task *
 azureus_task_new(struct azureus_dht *ad, struct azureus_node *an, 
                     struct azureus_rpc_msg *msg)
@@ -30,7 +37,7 @@ azureus_task_new(struct azureus_dht *ad, struct azureus_node *an,
 
     ASSERT(ad && an);
 
-    at = (struct azureus_task *) malloc(sizeof(struct azureus_task));
+    at = (struct azureus_task *) pool_alloc(&ad->pool.task);
     if (!at) {
         return NULL;
     }
@@ -48,6 +55,8 @@ azureus_task_new(struct azureus_dht *ad, struct azureus_node *an,
     at->dht = ad;
 
     TAILQ_INIT(&at->node_list);
+    TAILQ_INIT(&at->tmsg_list);
+    TAILQ_INIT(&at->db_key_list);
 
     return at;
 }
@@ -59,6 +68,9 @@ azureus_task_delete(struct azureus_task *at)
     struct pkt *pkt = NULL;
     struct azureus_rpc_msg *msg = NULL;
     struct azureus_dht *ad = NULL;
+    struct azureus_db_key *key = NULL, *keyn = NULL;
+    struct node *tn = NULL, *tnn = NULL;
+    struct azureus_node *an = NULL;
 
     ASSERT(at);
 
@@ -75,13 +87,294 @@ azureus_task_delete(struct azureus_task *at)
     } else if (task->type == TASK_TYPE_PARENT) {
         DEBUG("deleting parent\n");
         ASSERT(!task->n_child);
-        if (at->type == AZUREUS_TASK_TYPE_FIND_VALUE) {
-            azureus_db_key_delete(at->db_key);
+        ASSERT(TAILQ_EMPTY(&at->tmsg_list));
+        azureus_db_key_delete(at->db_key);
+        if (at->db_valset) {
             azureus_db_valset_delete(at->db_valset);
         }
+        TAILQ_FOREACH_SAFE(key, &at->db_key_list, next, keyn) {
+            TAILQ_REMOVE(&at->db_key_list, key, next);
+            azureus_db_key_delete(key);
+        }
+        /* the lookup shortlist holds copies, or nodes from replies */
+        TAILQ_FOREACH_SAFE(tn, &at->node_list, next, tnn) {
+            TAILQ_REMOVE(&at->node_list, tn, next);
+            an = azureus_node_get_ref(tn);
+            if (an->n_tasks) {
+                /* the child that finished us is still on it, it goes 
+                 * along with that */
+                an->orphan = TRUE;
+                continue;
+            }
+            azureus_node_delete(an);
+        }
+        if (at->republish) {
+            /* gave up before its round went out */
+            TAILQ_REMOVE(&ad->republish_list, at, next_republish);
+            ad->n_republish--;
+            if (at->state == AZUREUS_TASK_STATE_STORE_VALUE) {
+                ad->n_republish_ready--;
+            }
+        }
     }
 
-    free(at);
+    pool_free(&ad->pool.task, at);
 
     ad->stats.mem.task--;
 }
+
+int
+azureus_task_table_new(struct azureus_task_table *tt)
+{
+    ASSERT(tt);
+
+    bzero(tt, sizeof(struct azureus_task_table));
+
+    return azureus_task_table_resize(tt, AZUREUS_TASK_TABLE_INIT_SIZE);
+}
+
+void
+azureus_task_table_delete(struct azureus_task_table *tt)
+{
+    ASSERT(tt);
+
+    if (tt->slot) {
+        free(tt->slot);
+    }
+
+    bzero(tt, sizeof(struct azureus_task_table));
+}
+
+int
+azureus_task_table_add(struct azureus_task_table *tt, struct azureus_task *at)
+{
+    u64 conn_id;
+    u32 i;
+    int ret;
+
+    ASSERT(tt && at && at->task.pkt);
+
+    /* keep the load factor at or below 1/2 */
+    if (2*(tt->n_tasks + 1) > tt->size) {
+        ret = azureus_task_table_resize(tt, 2*tt->size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    conn_id = azureus_task_conn_id(at);
+
+    for (i = azureus_task_table_hash(tt, conn_id); tt->slot[i]; 
+            i = (i + 1) & (tt->size - 1)) {
+        if (azureus_task_conn_id(tt->slot[i]) == conn_id) {
+            ERROR("duplicate conn_id %#llx\n", (unsigned long long)conn_id);
+            return FAILURE;
+        }
+    }
+
+    tt->slot[i] = at;
+    tt->n_tasks++;
+
+    return SUCCESS;
+}
+
+int
+azureus_task_table_remove(struct azureus_task_table *tt, 
+                            struct azureus_task *at)
+{
+    u32 i, j, home;
+
+    ASSERT(tt && at && at->task.pkt);
+
+    for (i = azureus_task_table_hash(tt, azureus_task_conn_id(at)); 
+            tt->slot[i] != at; i = (i + 1) & (tt->size - 1)) {
+        if (!tt->slot[i]) {
+            return FAILURE;
+        }
+    }
+
+    tt->slot[i] = NULL;
+    tt->n_tasks--;
+
+    /* shift back the rest of the cluster, so that lookups never need
+     * tombstones to step over */
+    for (j = (i + 1) & (tt->size - 1); tt->slot[j]; 
+            j = (j + 1) & (tt->size - 1)) {
+        home = azureus_task_table_hash(tt, 
+                                    azureus_task_conn_id(tt->slot[j]));
+        /* move slot[j] into the hole at i, unless its home lies 
+         * cyclically in (i, j] */
+        if (((j - home) & (tt->size - 1)) >= ((j - i) & (tt->size - 1))) {
+            tt->slot[i] = tt->slot[j];
+            tt->slot[j] = NULL;
+            i = j;
+        }
+    }
+
+    return SUCCESS;
+}
+
+struct azureus_task *
+azureus_task_table_find(struct azureus_task_table *tt, u64 conn_id)
+{
+    u32 i;
+
+    ASSERT(tt);
+
+    for (i = azureus_task_table_hash(tt, conn_id); tt->slot[i]; 
+            i = (i + 1) & (tt->size - 1)) {
+        if (azureus_task_conn_id(tt->slot[i]) == conn_id) {
+            return tt->slot[i];
+        }
+    }
+
+    return NULL;
+}
+
+static u64
+azureus_task_conn_id(struct azureus_task *at)
+{
+    struct azureus_rpc_msg *msg = NULL;
+
+    msg = azureus_rpc_msg_get_ref(at->task.pkt);
+
+    return msg->p.pr_udp_req.conn_id;
+}
+
+static u32
+azureus_task_table_hash(struct azureus_task_table *tt, u64 conn_id)
+{
+    /* conn_ids are random, but the top bit is always set, so mix a bit */
+    conn_id *= 0x9e3779b97f4a7c15ULL;
+
+    return (u32)(conn_id >> 32) & (tt->size - 1);
+}
+
+static int
+azureus_task_table_resize(struct azureus_task_table *tt, u32 size)
+{
+    struct azureus_task **old = NULL;
+    u32 old_size;
+    u32 i, j;
+
+    ASSERT(tt && size && !(size & (size - 1)));
+
+    old = tt->slot;
+    old_size = tt->size;
+
+    tt->slot = (struct azureus_task **) 
+                        malloc(size*sizeof(struct azureus_task *));
+    if (!tt->slot) {
+        tt->slot = old;
+        return FAILURE;
+    }
+
+    bzero(tt->slot, size*sizeof(struct azureus_task *));
+    tt->size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i]) {
+            continue;
+        }
+        for (j = azureus_task_table_hash(tt, azureus_task_conn_id(old[i])); 
+                tt->slot[j]; j = (j + 1) & (tt->size - 1));
+        tt->slot[j] = old[i];
+    }
+
+    if (old) {
+        free(old);
+    }
+
+    return SUCCESS;
+}
+
+int
+azureus_task_lookup_table_new(struct azureus_task_lookup_table *lt)
+{
+    ASSERT(lt);
+
+    bzero(lt, sizeof(struct azureus_task_lookup_table));
+
+    lt->chain = (struct azureus_task **) 
+        calloc(AZUREUS_TASK_LOOKUP_TABLE_SIZE, sizeof(struct azureus_task *));
+    if (!lt->chain) {
+        return FAILURE;
+    }
+
+    lt->size = AZUREUS_TASK_LOOKUP_TABLE_SIZE;
+
+    return SUCCESS;
+}
+
+void
+azureus_task_lookup_table_delete(struct azureus_task_lookup_table *lt)
+{
+    ASSERT(lt);
+
+    if (lt->chain) {
+        free(lt->chain);
+    }
+
+    bzero(lt, sizeof(struct azureus_task_lookup_table));
+}
+
+void
+azureus_task_lookup_table_add(struct azureus_task_lookup_table *lt, 
+                                struct azureus_task *at)
+{
+    struct azureus_task **head = NULL;
+
+    ASSERT(lt && at && at->db_key);
+
+    head = azureus_task_lookup_table_chain(lt, at->db_key);
+    at->lookup_next = *head;
+    *head = at;
+    lt->n_tasks++;
+}
+
+int
+azureus_task_lookup_table_remove(struct azureus_task_lookup_table *lt, 
+                                struct azureus_task *at)
+{
+    struct azureus_task **pp = NULL;
+
+    ASSERT(lt && at && at->db_key);
+
+    for (pp = azureus_task_lookup_table_chain(lt, at->db_key); *pp; 
+            pp = &(*pp)->lookup_next) {
+        if (*pp == at) {
+            *pp = at->lookup_next;
+            at->lookup_next = NULL;
+            lt->n_tasks--;
+            return SUCCESS;
+        }
+    }
+
+    return FAILURE;
+}
+
+struct azureus_task *
+azureus_task_lookup_table_find(struct azureus_task_lookup_table *lt, 
+                                enum azureus_task_type type,
+                                struct azureus_db_key *db_key)
+{
+    struct azureus_task *at = NULL;
+
+    ASSERT(lt && db_key);
+
+    for (at = *azureus_task_lookup_table_chain(lt, db_key); at; 
+            at = at->lookup_next) {
+        if ((at->type == type) && azureus_db_key_equal(at->db_key, db_key)) {
+            return at;
+        }
+    }
+
+    return NULL;
+}
+
+static struct azureus_task **
+azureus_task_lookup_table_chain(struct azureus_task_lookup_table *lt, 
+                                struct azureus_db_key *db_key)
+{
+    return &lt->chain[azureus_db_table_hash(db_key) & (lt->size - 1)];
+}
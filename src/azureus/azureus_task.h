@@ -20,6 +20,30 @@
 #define __AZUREUS_TASK_H__
 
 struct azureus_rpc_msg;
+struct azureus_task;
+
+#include "types.h"
+
+/* open addressing (linear probing) table of the outstanding requests,
+ * keyed on the pr_udp conn_id so that replies are matched in O(1).
+ * azureus_dht.h embeds it, so it is defined ahead of the includes. */
+#define AZUREUS_TASK_TABLE_INIT_SIZE    256     /* must be a power of 2 */
+
+struct azureus_task_table {
+    struct azureus_task         **slot;
+    u32                         size;
+    u32                         n_tasks;
+};
+
+/* chained hash table of the parent tasks that a GET or STORE of the same
+ * db key can still join, see azureus_dht_add_parent_db_task() */
+#define AZUREUS_TASK_LOOKUP_TABLE_SIZE  256     /* must be a power of 2 */
+
+struct azureus_task_lookup_table {
+    struct azureus_task         **chain;
+    u32                         size;
+    u32                         n_tasks;
+};
 
 #include "task.h"
 #include "azureus_dht.h"
@@ -51,12 +75,26 @@ struct azureus_task {
     struct azureus_dht          *dht;
     struct azureus_db_key       *db_key;
     struct azureus_db_valset    *db_valset;
+    /* STORE only: more keys stored to the nodes the lookup of db_key finds */
+    TAILQ_HEAD(azureus_task_db_key_list_head, azureus_db_key)
+                                db_key_list;
+    int                         n_db_keys;
     TAILQ_ENTRY(azureus_task)   next;
+    TAILQ_ENTRY(azureus_task)   next_pending;
+    bool                        pending;
     TAILQ_ENTRY(azureus_task)   next_node_task;
     struct kbucket_node_search_list_head 
                                 node_list;
     int                         n_nodes;
-    struct tinydht_msg          *tmsg;
+    /* service requests waiting for this parent task */
+    TAILQ_HEAD(tinydht_msg_list_head, tinydht_msg)  
+                                tmsg_list;
+    struct azureus_task         *lookup_next;
+    /* STORE only: a republish, whose stores wait for the rest of its round,
+     * but no longer than republish_deadline */
+    bool                        republish;
+    u64                         republish_deadline;
+    TAILQ_ENTRY(azureus_task)   next_republish;
 };
 
 static inline struct azureus_task *
@@ -70,4 +108,24 @@ struct azureus_task * azureus_task_new(struct azureus_dht *ad,
                                         struct azureus_rpc_msg *msg);
 void azureus_task_delete(struct azureus_task *at);
 
+int azureus_task_table_new(struct azureus_task_table *tt);
+void azureus_task_table_delete(struct azureus_task_table *tt);
+int azureus_task_table_add(struct azureus_task_table *tt, 
+                                        struct azureus_task *at);
+int azureus_task_table_remove(struct azureus_task_table *tt, 
+                                        struct azureus_task *at);
+struct azureus_task * azureus_task_table_find(struct azureus_task_table *tt, 
+                                        u64 conn_id);
+
+int azureus_task_lookup_table_new(struct azureus_task_lookup_table *lt);
+void azureus_task_lookup_table_delete(struct azureus_task_lookup_table *lt);
+void azureus_task_lookup_table_add(struct azureus_task_lookup_table *lt, 
+                                        struct azureus_task *at);
+int azureus_task_lookup_table_remove(struct azureus_task_lookup_table *lt, 
+                                        struct azureus_task *at);
+struct azureus_task * azureus_task_lookup_table_find(
+                                        struct azureus_task_lookup_table *lt, 
+                                        enum azureus_task_type type,
+                                        struct azureus_db_key *db_key);
+
 #endif /* __AZUREUS_TASK_H__ */
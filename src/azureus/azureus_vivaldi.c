@@ -27,7 +27,8 @@
 static const float initial_err = 10.0f;
 static const float cc = 0.25f;
 static const float ce = 0.5f;
-static int nb_updates = 0;
+/* per dht instance, each runs in a thread of its own */
+static __thread int nb_updates = 0;
 static const int CONVERGE_EVERY = 5;
 static const float CONVERGE_FACTOR = 50.0f;
 static const float ERROR_MIN = 0.1f;
@@ -16,11 +16,216 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
 
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
 #include "debug.h"
 #include "types.h"
 
-int 
-td_log(void)
+/* Log lines are formatted straight into a fixed ring by the caller and
+ * written out to the log file by a separate thread, so logging never
+ * blocks on stdio. Producers reserve a line with a CAS on the head, and
+ * publish it by setting its sequence number; when the ring is full the
+ * line is dropped and counted instead of waiting. */
+
+#define TD_LOG_FLUSH_INTERVAL   10      /* millisecs */
+
+struct td_log_line {
+    volatile u32        seq;            /* position + 1, once written */
+    int                 len;
+    char                buf[TD_LOG_LINE_LEN];
+};
+
+struct td_log_ring {
+    volatile u32        head;           /* next line to reserve */
+    volatile u32        tail;           /* next line to write out */
+    volatile u32        n_dropped;
+    struct td_log_line  line[TD_LOG_RING_SIZE];
+};
+
+int td_log_level = TD_LOG_DEFAULT_LEVEL;
+
+static struct td_log_ring td_log_ring;
+static FILE *td_log_fp = NULL;
+static pthread_t td_log_thread;
+static volatile bool td_log_running = FALSE;
+static volatile bool td_log_stop = FALSE;
+
+static int td_log_drain(void);
+static void * td_log_flush_thread(void *arg);
+
+int
+td_log_init(const char *path, int level)
 {
+    int ret;
+
+    td_log_set_level(level);
+
+    if (path) {
+        td_log_fp = fopen(path, "a");
+        if (!td_log_fp) {
+            ERROR("cannot open log file %s\n", path);
+            return FAILURE;
+        }
+    } else {
+        td_log_fp = stdout;
+    }
+
+    td_log_stop = FALSE;
+
+    ret = pthread_create(&td_log_thread, NULL, td_log_flush_thread, NULL);
+    if (ret != 0) {
+        if (td_log_fp != stdout) {
+            fclose(td_log_fp);
+        }
+        td_log_fp = NULL;
+        return FAILURE;
+    }
+
+    td_log_running = TRUE;
+
     return SUCCESS;
 }
+
+void
+td_log_exit(void)
+{
+    if (!td_log_running) {
+        return;
+    }
+
+    td_log_stop = TRUE;
+    pthread_join(td_log_thread, NULL);
+    td_log_running = FALSE;
+
+    /* whatever came in after the last drain */
+    td_log_drain();
+
+    if (td_log_fp != stdout) {
+        fclose(td_log_fp);
+    }
+    td_log_fp = NULL;
+}
+
+void
+td_log_set_level(int level)
+{
+    if (level < TD_LOG_LEVEL_NONE) {
+        level = TD_LOG_LEVEL_NONE;
+    } else if (level > TD_LOG_LEVEL_DEBUG) {
+        level = TD_LOG_LEVEL_DEBUG;
+    }
+
+    td_log_level = level;
+}
+
+void
+td_log(int level, const char *fmt, ...)
+{
+    struct td_log_line *line = NULL;
+    va_list ap;
+    u32 head;
+    int len;
+
+    if (level > td_log_level) {
+        return;
+    }
+
+    va_start(ap, fmt);
+
+    if (!td_log_running) {
+        /* no sink yet (or any more), so just print it */
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    do {
+        head = td_log_ring.head;
+        if ((head - td_log_ring.tail) >= TD_LOG_RING_SIZE) {
+            __sync_fetch_and_add(&td_log_ring.n_dropped, 1);
+            va_end(ap);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&td_log_ring.head, 
+                                            head, head + 1));
+
+    line = &td_log_ring.line[head & (TD_LOG_RING_SIZE - 1)];
+
+    len = vsnprintf(line->buf, sizeof(line->buf), fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int)sizeof(line->buf)) {
+        /* truncated, but keep the line break */
+        len = sizeof(line->buf) - 1;
+        line->buf[len - 1] = '\n';
+    }
+    line->len = len;
+
+    __sync_synchronize();
+    line->seq = head + 1;
+}
+
+static int
+td_log_drain(void)
+{
+    struct td_log_line *line = NULL;
+    u32 tail;
+    u32 n_dropped;
+    int count = 0;
+
+    for (tail = td_log_ring.tail; tail != td_log_ring.head; tail++) {
+
+        line = &td_log_ring.line[tail & (TD_LOG_RING_SIZE - 1)];
+        if (line->seq != (tail + 1)) {
+            /* reserved, but still being written */
+            break;
+        }
+
+        fwrite(line->buf, 1, line->len, td_log_fp);
+        count++;
+
+        __sync_synchronize();
+        td_log_ring.tail = tail + 1;
+    }
+
+    n_dropped = td_log_ring.n_dropped;
+    if (n_dropped) {
+        __sync_fetch_and_sub(&td_log_ring.n_dropped, n_dropped);
+        fprintf(td_log_fp, "[LOG] dropped %u lines\n", n_dropped);
+        count++;
+    }
+
+    if (count) {
+        fflush(td_log_fp);
+    }
+
+    return count;
+}
+
+static void *
+td_log_flush_thread(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)TD_LOG_FLUSH_INTERVAL*1000*1000;
+
+    while (TRUE) {
+        if (td_log_drain()) {
+            continue;
+        }
+        if (td_log_stop) {
+            break;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
@@ -38,21 +38,66 @@
         }                                                       \
     } while (0)
 
+/* Log levels. Anything above TD_LOG_MAX_LEVEL is compiled out, anything
+ * above td_log_level is skipped at runtime. */
+#define TD_LOG_LEVEL_NONE       0
+#define TD_LOG_LEVEL_ERROR      1
+#define TD_LOG_LEVEL_INFO       2
+#define TD_LOG_LEVEL_DEBUG      3
+
+#ifndef TD_LOG_MAX_LEVEL
+#define TD_LOG_MAX_LEVEL        TD_LOG_LEVEL_DEBUG
+#endif
+
+#define TD_LOG_DEFAULT_LEVEL    TD_LOG_LEVEL_INFO
+
+#define TD_LOG_RING_SIZE        4096    /* lines, must be a power of 2 */
+#define TD_LOG_LINE_LEN         256
+
+#ifdef TD_LOG_PRINTF
+
+/* standalone programs (the test clients) just print */
+#define TD_LOG_ENABLED(_level)  ((_level) <= TD_LOG_MAX_LEVEL)
+#define td_log(_level, _fmt, _args...)  printf(_fmt, ##_args)
+
+#else
+
+#define TD_LOG_ENABLED(_level)                                  \
+    (((_level) <= TD_LOG_MAX_LEVEL) && ((_level) <= td_log_level))
+
+extern int td_log_level;
+
+int td_log_init(const char *path, int level);
+void td_log_exit(void);
+void td_log_set_level(int level);
+void td_log(int level, const char *fmt, ...)
+                        __attribute__ ((format (printf, 2, 3)));
+
+#endif
+
 #define ERROR(_fmt, _args...)                                   \
     do {                                                        \
-        printf("[ERROR] %s:%d %s() - " _fmt,                    \
-                __FILE__, __LINE__, __FUNCTION__, ##_args);     \
+        if (TD_LOG_ENABLED(TD_LOG_LEVEL_ERROR)) {               \
+            td_log(TD_LOG_LEVEL_ERROR,                          \
+                    "[ERROR] %s:%d %s() - " _fmt,               \
+                    __FILE__, __LINE__, __FUNCTION__, ##_args); \
+        }                                                       \
     } while (0)
 
 #define INFO(_fmt, _args...)                                    \
     do {                                                        \
-        printf(_fmt, ##_args);                                  \
+        if (TD_LOG_ENABLED(TD_LOG_LEVEL_INFO)) {                \
+            td_log(TD_LOG_LEVEL_INFO, _fmt, ##_args);           \
+        }                                                       \
     } while (0)
 
 #define DEBUG(_fmt, _args...)                                   \
     do {                                                        \
-        printf("[DEBUG] %s:%d %s() - " _fmt,                    \
-                __FILE__, __LINE__, __FUNCTION__, ##_args);     \
+        if (TD_LOG_ENABLED(TD_LOG_LEVEL_DEBUG)) {               \
+            td_log(TD_LOG_LEVEL_DEBUG,                          \
+                    "[DEBUG] %s:%d %s() - " _fmt,               \
+                    __FILE__, __LINE__, __FUNCTION__, ##_args); \
+        }                                                       \
     } while (0)
 
 #endif /* __DEBUG_H__ */
@@ -16,10 +16,18 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sendmmsg() */
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -27,6 +35,7 @@
 #include "dht_types.h"
 #include "tinydht.h"
 #include "crypto.h"
+#include "debug.h"
 
 int
 dht_net_if_new(struct dht_net_if *net_if, 
@@ -115,8 +124,10 @@ dht_new(struct dht *dht, unsigned int type,
         if (dht_table[i]->type == type) {
             dht->get            = dht_table[i]->get;
             dht->put            = dht_table[i]->put;
+            dht->put_batch      = dht_table[i]->put_batch;
             dht->rpc_rx         = dht_table[i]->rpc_rx;
             dht->task_schedule  = dht_table[i]->task_schedule;
+            dht->snapshot_load  = dht_table[i]->snapshot_load;
             dht->exit           = dht_table[i]->exit;
             break;
         }
@@ -128,6 +139,164 @@ err:
     return FAILURE;
 }
 
+int
+dht_txq_add(struct dht *dht, struct sockaddr_storage *ss, 
+                u8 *data, unsigned int len)
+{
+    struct dht_txq *q = NULL;
+    int ret;
+
+    ASSERT(dht && ss && data && (len <= MAX_PKT_LEN));
+
+    q = &dht->txq;
+
+    if (q->n_pkts == MAX_TX_BATCH) {
+        ret = dht_txq_flush(dht);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    switch (ss->ss_family) {
+        case AF_INET:
+            q->sslen[q->n_pkts] = sizeof(struct sockaddr_in);
+            break;
+        case AF_INET6:
+            q->sslen[q->n_pkts] = sizeof(struct sockaddr_in6);
+            break;
+        default:
+            return FAILURE;
+    }
+
+    memcpy(&q->ss[q->n_pkts], ss, q->sslen[q->n_pkts]);
+    memcpy(q->data[q->n_pkts], data, len);
+    q->len[q->n_pkts] = len;
+    q->n_pkts++;
+
+    return SUCCESS;
+}
+
+#ifdef TINYDHT_USE_MMSG
+int
+dht_txq_flush(struct dht *dht)
+{
+    struct dht_txq *q = NULL;
+    struct mmsghdr msg[MAX_TX_BATCH];
+    struct iovec iov[MAX_TX_BATCH];
+    int sent = 0;
+    int i;
+    int ret;
+
+    ASSERT(dht);
+
+    q = &dht->txq;
+
+    if (q->n_pkts == 0) {
+        return SUCCESS;
+    }
+
+    bzero(msg, q->n_pkts*sizeof(struct mmsghdr));
+
+    for (i = 0; i < q->n_pkts; i++) {
+        iov[i].iov_base = q->data[i];
+        iov[i].iov_len = q->len[i];
+        msg[i].msg_hdr.msg_name = &q->ss[i];
+        msg[i].msg_hdr.msg_namelen = q->sslen[i];
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent < q->n_pkts) {
+        ret = sendmmsg(dht->net_if.sock, &msg[sent], q->n_pkts - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* drop the datagram that failed, the task will time out */
+            ERROR("sendmmsg() - %s\n", strerror(errno));
+            q->stats.n_errors++;
+            sent++;
+            continue;
+        }
+        sent += ret;
+    }
+
+    q->stats.n_flush++;
+    q->stats.n_pkts += q->n_pkts;
+    if ((u32)q->n_pkts > q->stats.max_batch) {
+        q->stats.max_batch = q->n_pkts;
+    }
+
+    q->n_pkts = 0;
+
+    return SUCCESS;
+}
+#else
+int
+dht_txq_flush(struct dht *dht)
+{
+    struct dht_txq *q = NULL;
+    int i;
+    int ret;
+
+    ASSERT(dht);
+
+    q = &dht->txq;
+
+    if (q->n_pkts == 0) {
+        return SUCCESS;
+    }
+
+    for (i = 0; i < q->n_pkts; i++) {
+        ret = sendto(dht->net_if.sock, q->data[i], q->len[i], 0, 
+                        (struct sockaddr *)&q->ss[i], q->sslen[i]);
+        if (ret < 0) {
+            ERROR("sendto() - %s\n", strerror(errno));
+            q->stats.n_errors++;
+        }
+    }
+
+    q->stats.n_flush++;
+    q->stats.n_pkts += q->n_pkts;
+    if ((u32)q->n_pkts > q->stats.max_batch) {
+        q->stats.max_batch = q->n_pkts;
+    }
+
+    q->n_pkts = 0;
+
+    return SUCCESS;
+}
+#endif
+
+int
+dht_snapshot_get_port(const char *path, unsigned int type, u16 *port)
+{
+    struct dht_snapshot_hdr hdr;
+    ssize_t len;
+    int fd;
+
+    ASSERT(path && port);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return FAILURE;
+    }
+
+    len = read(fd, &hdr, sizeof(hdr));
+    close(fd);
+
+    if ((len != sizeof(hdr)) 
+            || (hdr.magic != DHT_SNAPSHOT_MAGIC)
+            || (hdr.version != DHT_SNAPSHOT_VERSION)
+            || (hdr.type != type)) {
+        return FAILURE;
+    }
+
+    *port = hdr.port;
+
+    return SUCCESS;
+}
+
 u64
 dht_get_current_time(void)
 {
@@ -38,6 +38,43 @@ struct dht_net_if {
     int                         sock;
 };
 
+#define MAX_TX_BATCH            32      /* datagrams per sendmmsg() */
+
+struct dht_txq_stats {
+    u64                 n_flush;        /* no. of flushes */
+    u64                 n_pkts;         /* no. of pkts flushed */
+    u32                 max_batch;      /* most pkts in one flush */
+    u32                 n_errors;
+};
+
+/* outgoing datagrams, collected during a scheduler tick or an rx batch
+ * and handed to the kernel in one go by dht_txq_flush() */
+struct dht_txq {
+    int                         n_pkts;
+    struct sockaddr_storage     ss[MAX_TX_BATCH];
+    socklen_t                   sslen[MAX_TX_BATCH];
+    unsigned int                len[MAX_TX_BATCH];
+    u8                          data[MAX_TX_BATCH][MAX_PKT_LEN];
+    struct dht_txq_stats        stats;
+};
+
+#define DHT_SNAPSHOT_MAGIC      0x53484454      /* "TDHS" */
+#define DHT_SNAPSHOT_VERSION    1
+#define DHT_SNAPSHOT_PATH_LEN   256
+
+/* every snapshot file starts with this, what follows is up to the dht 
+ * type. Records are fixed-size or length-prefixed and 8-byte aligned, in
+ * host byte order, so a snapshot is only read back on the same host. */
+struct dht_snapshot_hdr {
+    u32                 magic;
+    u16                 version;
+    u16                 type;
+    u32                 len;            /* of the whole file */
+    u16                 port;           /* network byte order */
+    u16                 pad;
+    u64                 timestamp;      /* dht_get_current_time() */
+};
+
 struct dht {
     /* type */
     int                 type;
@@ -48,12 +85,22 @@ struct dht {
     int                 k;
     int                 b;
     struct kbucket      kbucket[160];
+    /* batched transmit */
+    struct dht_txq      txq;
+    /* earliest time (usecs) at which task_schedule() has work to do, 
+     * kept up to date by task_schedule() itself */
+    u64                 next_deadline;
+    /* where the routing table and local values are saved, if anywhere */
+    char                snapshot_path[DHT_SNAPSHOT_PATH_LEN];
     /* DHT api */
     int (*get)(struct dht *dht, struct tinydht_msg *msg);
     int (*put)(struct dht *dht, struct tinydht_msg *msg);
+    /* optional, sets rsp.status to success on the msgs it took */
+    int (*put_batch)(struct dht *dht, struct tinydht_msg **msg, int n_msg);
     int (*rpc_rx)(struct dht *dht, struct sockaddr_storage *from, 
                         size_t fromlen, u8 *data, int len, u64 timestamp);
     int (*task_schedule)(struct dht *dht);
+    int (*snapshot_load)(struct dht *dht);
     void (*exit)(struct dht *dht);
 };
 
@@ -62,6 +109,12 @@ int dht_net_if_new(struct dht_net_if *net_if, const char *ifname,
 int dht_new(struct dht *dht, unsigned int type, 
                         struct dht_net_if *net_if, short port);
 
+int dht_txq_add(struct dht *dht, struct sockaddr_storage *ss, 
+                        u8 *data, unsigned int len);
+int dht_txq_flush(struct dht *dht);
+
+int dht_snapshot_get_port(const char *path, unsigned int type, u16 *port);
+
 u64 dht_get_current_time(void);
 int dht_get_rnd_port(u16 *port);
 
@@ -35,9 +35,11 @@ struct dht_prototype {
     void (*destructor)(struct dht *dht);
     int (*get)(struct dht *dht, struct tinydht_msg *msg);
     int (*put)(struct dht *dht, struct tinydht_msg *msg);
+    int (*put_batch)(struct dht *dht, struct tinydht_msg **msg, int n_msg);
     int (*rpc_rx)(struct dht *dht, struct sockaddr_storage *from, 
                     size_t fromlen, u8 *data, int len, u64 timestamp);
     int (*task_schedule)(struct dht *dht);
+    int (*snapshot_load)(struct dht *dht);
     void (*exit)(struct dht *dht);
 };
 
@@ -22,6 +22,8 @@
 
 #include "kbucket.h"
 
+static struct node * kbucket_find_node(struct kbucket *k, struct key *key);
+
 int 
 kbucket_new(struct kbucket *k)
 {
@@ -37,19 +39,30 @@ kbucket_new(struct kbucket *k)
 int
 kbucket_insert_node(struct kbucket *k, struct node *n, int max_nodes)
 {
+    int ret;
+
     ASSERT(k && n);
 
     if (kbucket_contains_node(k, n)) {
         return SUCCESS;
     }
+
+    if (k->table) {
+        ret = node_table_add(k->table, n);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
    
     if (k->n_nodes < max_nodes) {
         LIST_INSERT_HEAD(&k->node_list, n, kb_next);
+        n->kb_ext = FALSE;
         k->n_nodes++;
         return SUCCESS;
     }
 
     LIST_INSERT_HEAD(&k->ext_node_list, n, kb_next);
+    n->kb_ext = TRUE;
     k->n_ext_nodes++;
 
     return SUCCESS;
@@ -58,74 +71,80 @@ kbucket_insert_node(struct kbucket *k, struct node *n, int max_nodes)
 struct node *
 kbucket_delete_node(struct kbucket *k, struct node *n)
 {
-    struct node *tn = NULL, *tnn = NULL;
+    struct node *tn = NULL;
     struct node *xtn = NULL;
 
     ASSERT(k && n);
 
-    /* search the kbucket's node list */
-    LIST_FOREACH_SAFE(tn, &k->node_list, kb_next, tnn) {
+    tn = kbucket_find_node(k, &n->id);
+    if (!tn) {
+        return NULL;
+    }
 
-        if (key_cmp(&tn->id, &n->id) == 0) {
-            
-            LIST_REMOVE(tn, kb_next);
-            k->n_nodes--;
-
-            if (k->n_ext_nodes == 0) {
-                return tn;
-            }
-
-            /* move a node from the extended routing table to 
-             * the main routing table */
-            xtn = LIST_FIRST(&k->ext_node_list);
-            LIST_REMOVE(xtn, kb_next);
-            k->n_ext_nodes--;
-            LIST_INSERT_HEAD(&k->node_list, xtn, kb_next);
-            k->n_nodes++;
-            return tn;
-        }
+    if (k->table) {
+        node_table_remove(k->table, tn);
     }
 
-    /* also search the extended node list */
-    LIST_FOREACH_SAFE(tn, &k->ext_node_list, kb_next, tnn) {
-        if (key_cmp(&tn->id, &n->id) == 0) {
-            LIST_REMOVE(tn, kb_next);
-            k->n_ext_nodes--;
-            return tn;
-        }
+    LIST_REMOVE(tn, kb_next);
+
+    if (tn->kb_ext) {
+        k->n_ext_nodes--;
+        return tn;
     }
 
-    return NULL;
+    k->n_nodes--;
+
+    if (k->n_ext_nodes == 0) {
+        return tn;
+    }
+
+    /* move a node from the extended routing table to 
+     * the main routing table */
+    xtn = LIST_FIRST(&k->ext_node_list);
+    LIST_REMOVE(xtn, kb_next);
+    k->n_ext_nodes--;
+    LIST_INSERT_HEAD(&k->node_list, xtn, kb_next);
+    xtn->kb_ext = FALSE;
+    k->n_nodes++;
+
+    return tn;
 }
 
 int
 kbucket_contains_node(struct kbucket *k, struct node *n)
 {
-    struct node *tn = NULL, *tnn = NULL;
-
-    /* search the kbucket's node list */
-    LIST_FOREACH_SAFE(tn, &k->node_list, kb_next, tnn) {
-        if (key_cmp(&tn->id, &n->id) == 0) {
-            return TRUE;
-        }
-    }
-
-    /* also search the extended node list */
-    LIST_FOREACH_SAFE(tn, &k->ext_node_list, kb_next, tnn) {
-        if (key_cmp(&tn->id, &n->id) == 0) {
-            return TRUE;
-        }
-    }
+    ASSERT(k && n);
 
-    return FALSE;
+    return kbucket_find_node(k, &n->id) ? TRUE : FALSE;
 }
 
 struct node *
 kbucket_get_node(struct kbucket *k, struct key *key)
+{
+    ASSERT(k && key);
+
+    return kbucket_find_node(k, key);
+}
+
+int
+kbucket_index(struct key *self, struct key *k)
+{
+    ASSERT(self && k && (k->len*8 == 160));
+    
+    /* the bucket is given by the highest bit in which the keys differ */
+    return key_xor_clz(self, k);
+}
+
+static struct node *
+kbucket_find_node(struct kbucket *k, struct key *key)
 {
     struct node *tn = NULL, *tnn = NULL;
 
-    ASSERT(k && key);
+    /* a node id always maps to the same kbucket, so the routing table 
+     * wide index answers for this kbucket too */
+    if (k->table) {
+        return node_table_find(k->table, key);
+    }
 
     /* search the kbucket's node list */
     LIST_FOREACH_SAFE(tn, &k->node_list, kb_next, tnn) {
@@ -143,27 +162,3 @@ kbucket_get_node(struct kbucket *k, struct key *key)
 
     return NULL;
 }
-
-int
-kbucket_index(struct key *self, struct key *k)
-{
-    struct key  xor;
-    int         index;
-    int         max_index;
-    int         ret;
-
-    ASSERT(self && k);
-    
-    ret = key_distance(self, k, &xor);
-
-    max_index = k->len*8*sizeof(k->data[0]);
-    ASSERT(max_index == 160);
-
-    for (index = (max_index - 1); index >= 0; index--) {
-        if (key_nth_bit(&xor, index) != 0) {
-            break;
-        }
-    }
-
-    return (max_index - 1) - index;
-}
@@ -32,6 +32,7 @@ struct kbucket {
     int         n_ext_nodes;
     LIST_HEAD(kbucket_ext_node_list_head, node) ext_node_list;
     u64         last_refresh;
+    struct node_table   *table; /* routing table wide id index, or NULL */
 };
 
 TAILQ_HEAD(kbucket_node_search_list_head, node);
@@ -24,6 +24,8 @@
 #include "crypto.h"
 #include "debug.h"
 
+static u64 key_get_word(struct key *k, int i);
+
 int
 key_new(struct key *k, enum key_type type, void *data, int data_len)
 {
@@ -77,8 +79,8 @@ key_xor(struct key *k1, struct key *k2, struct key *xor)
     xor->type = k1->type;
     xor->len = k1->len;
 
-    for (i = 0; i < k1->len; i++) {
-        xor->data[i] = k1->data[i] ^ k2->data[i];
+    for (i = 0; i < MAX_KEY_WORDS; i++) {
+        xor->word[i] = k1->word[i] ^ k2->word[i];
     }
 
     return SUCCESS;
@@ -95,14 +97,17 @@ key_distance(struct key *k1, struct key *k2, struct key *dist)
 int
 key_cmp(struct key *k1, struct key *k2)
 {
+    u64 w1, w2;
     int i;
     
     ASSERT(k1 && k2 && (k1->type == k2->type) && (k1->len == k2->len));
 
-    for (i = 0; i < k1->len; i++) {
-        if (k1->data[i] < k2->data[i]) {
+    for (i = 0; (8*i) < k1->len; i++) {
+        w1 = key_get_word(k1, i);
+        w2 = key_get_word(k2, i);
+        if (w1 < w2) {
             return -1;
-        } else if (k1->data[i] > k2->data[i]) {
+        } else if (w1 > w2) {
             return 1;
         }
     }
@@ -110,6 +115,44 @@ key_cmp(struct key *k1, struct key *k2)
     return 0;
 }
 
+/* no. of leading zero bits, or len*8 if the key is all zeros */
+int
+key_clz(struct key *k)
+{
+    u64 w;
+    int i;
+
+    ASSERT(k);
+
+    for (i = 0; (8*i) < k->len; i++) {
+        w = key_get_word(k, i);
+        if (w) {
+            return 64*i + __builtin_clzll(w);
+        }
+    }
+
+    return k->len*8;
+}
+
+/* same as key_clz() of the xor distance, without building it */
+int
+key_xor_clz(struct key *k1, struct key *k2)
+{
+    u64 w;
+    int i;
+
+    ASSERT(k1 && k2 && (k1->len == k2->len));
+
+    for (i = 0; (8*i) < k1->len; i++) {
+        w = key_get_word(k1, i) ^ key_get_word(k2, i);
+        if (w) {
+            return 64*i + __builtin_clzll(w);
+        }
+    }
+
+    return k1->len*8;
+}
+
 int
 key_nth_bit(struct key *k, unsigned n)
 {
@@ -150,13 +193,39 @@ key_get_size_from_type(enum key_type type)
 void
 key_dump(struct key *k)
 {
+    char buf[2*sizeof(k->data) + 1];
     int i;
 
     ASSERT(k);
 
-    printf("%p: ", k);
-    for (i = 0; i < k->len; i++) {
-        printf("%02x", k->data[i]);
+    if (!TD_LOG_ENABLED(TD_LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
+    for (i = 0; (i < k->len) && (i < (int)sizeof(k->data)); i++) {
+        sprintf(&buf[2*i], "%02x", k->data[i]);
     }
-    printf("\n");
+    buf[2*i] = 0;
+
+    td_log(TD_LOG_LEVEL_DEBUG, "%p: %s\n", k, buf);
+}
+
+/* i-th word in host order, with any bytes past the key length cleared */
+static u64
+key_get_word(struct key *k, int i)
+{
+    u64 w;
+    int n_bytes;
+
+    w = k->word[i];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+
+    n_bytes = k->len - 8*i;
+    if (n_bytes < 8) {
+        w &= ~(u64)0 << (64 - 8*n_bytes);
+    }
+
+    return w;
 }
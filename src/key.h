@@ -22,6 +22,7 @@
 #include "types.h"
 
 #define MAX_KEY_SIZE        20
+#define MAX_KEY_WORDS       ((MAX_KEY_SIZE + 7)/8)
 
 enum key_type {
     KEY_TYPE_UNKNOWN = 0,
@@ -30,9 +31,16 @@ enum key_type {
     KEY_TYPE_MAX
 };
 
+/* The key bytes are big endian (data[0] is the most significant), and are
+ * overlaid with 64-bit words so that xor, compare and leading-zero counts 
+ * work a word at a time. Bytes past "len" in the last word are undefined
+ * and masked off wherever they could matter. */
 struct key {
     enum key_type   type;
-    u8              data[MAX_KEY_SIZE];
+    union {
+        u8          data[MAX_KEY_SIZE];
+        u64         word[MAX_KEY_WORDS];
+    };
     int             len;
 };
 
@@ -43,6 +51,8 @@ int key_distance(struct key *k1, struct key *k2, struct key *dist);
 
 int key_cmp(struct key *k1, struct key *k2);
 int key_nth_bit(struct key *k, unsigned n);
+int key_clz(struct key *k);
+int key_xor_clz(struct key *k1, struct key *k2);
 int key_get_size_from_type(enum key_type type);
 
 void key_dump(struct key *k);
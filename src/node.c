@@ -16,10 +16,16 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
 #include "node.h"
 #include "debug.h"
 
+static u32 node_table_hash(struct node_table *nt, struct key *id);
+static int node_table_resize(struct node_table *nt, u32 size);
+
 int
 node_new(struct node *n, struct key *id)
 {
@@ -29,3 +35,150 @@ node_new(struct node *n, struct key *id)
     
     return SUCCESS;
 }
+
+int
+node_table_new(struct node_table *nt)
+{
+    ASSERT(nt);
+
+    bzero(nt, sizeof(struct node_table));
+
+    return node_table_resize(nt, NODE_TABLE_INIT_SIZE);
+}
+
+void
+node_table_delete(struct node_table *nt)
+{
+    ASSERT(nt);
+
+    if (nt->slot) {
+        free(nt->slot);
+    }
+
+    bzero(nt, sizeof(struct node_table));
+}
+
+int
+node_table_add(struct node_table *nt, struct node *n)
+{
+    u32 i;
+    int ret;
+
+    ASSERT(nt && n);
+
+    /* keep the load factor at or below 1/2 */
+    if (2*(nt->n_nodes + 1) > nt->size) {
+        ret = node_table_resize(nt, 2*nt->size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    for (i = node_table_hash(nt, &n->id); nt->slot[i]; 
+            i = (i + 1) & (nt->size - 1)) {
+        if (key_cmp(&nt->slot[i]->id, &n->id) == 0) {
+            return FAILURE;
+        }
+    }
+
+    nt->slot[i] = n;
+    nt->n_nodes++;
+
+    return SUCCESS;
+}
+
+int
+node_table_remove(struct node_table *nt, struct node *n)
+{
+    u32 i, j, home;
+
+    ASSERT(nt && n);
+
+    for (i = node_table_hash(nt, &n->id); nt->slot[i] != n; 
+            i = (i + 1) & (nt->size - 1)) {
+        if (!nt->slot[i]) {
+            return FAILURE;
+        }
+    }
+
+    nt->slot[i] = NULL;
+    nt->n_nodes--;
+
+    /* shift back the rest of the cluster, same as the task table */
+    for (j = (i + 1) & (nt->size - 1); nt->slot[j]; 
+            j = (j + 1) & (nt->size - 1)) {
+        home = node_table_hash(nt, &nt->slot[j]->id);
+        if (((j - home) & (nt->size - 1)) >= ((j - i) & (nt->size - 1))) {
+            nt->slot[i] = nt->slot[j];
+            nt->slot[j] = NULL;
+            i = j;
+        }
+    }
+
+    return SUCCESS;
+}
+
+struct node *
+node_table_find(struct node_table *nt, struct key *id)
+{
+    u32 i;
+
+    ASSERT(nt && id);
+
+    for (i = node_table_hash(nt, id); nt->slot[i]; 
+            i = (i + 1) & (nt->size - 1)) {
+        if (key_cmp(&nt->slot[i]->id, id) == 0) {
+            return nt->slot[i];
+        }
+    }
+
+    return NULL;
+}
+
+static u32
+node_table_hash(struct node_table *nt, struct key *id)
+{
+    u64 h;
+
+    /* node ids are hashes already, the first word is as good as any */
+    h = id->word[0] * 0x9e3779b97f4a7c15ULL;
+
+    return (u32)(h >> 32) & (nt->size - 1);
+}
+
+static int
+node_table_resize(struct node_table *nt, u32 size)
+{
+    struct node **old = NULL;
+    u32 old_size;
+    u32 i, j;
+
+    ASSERT(nt && size && !(size & (size - 1)));
+
+    old = nt->slot;
+    old_size = nt->size;
+
+    nt->slot = (struct node **) malloc(size*sizeof(struct node *));
+    if (!nt->slot) {
+        nt->slot = old;
+        return FAILURE;
+    }
+
+    bzero(nt->slot, size*sizeof(struct node *));
+    nt->size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i]) {
+            continue;
+        }
+        for (j = node_table_hash(nt, &old[i]->id); nt->slot[j]; 
+                j = (j + 1) & (nt->size - 1));
+        nt->slot[j] = old[i];
+    }
+
+    if (old) {
+        free(old);
+    }
+
+    return SUCCESS;
+}
@@ -34,11 +34,27 @@ struct node {
     struct key                  id;
     enum node_state             state;
     LIST_ENTRY(node)            kb_next;
+    bool                        kb_ext;     /* on a kbucket's ext list? */
     TAILQ_ENTRY(node)           next;
 };
 
 TAILQ_HEAD(node_list, node);
 
+#define NODE_TABLE_INIT_SIZE    1024    /* must be a power of 2 */
+
+/* nodes of a routing table by id */
+struct node_table {
+    struct node                 **slot;
+    u32                         size;
+    u32                         n_nodes;
+};
+
 int node_new(struct node *n, struct key *id);
 
+int node_table_new(struct node_table *nt);
+void node_table_delete(struct node_table *nt);
+int node_table_add(struct node_table *nt, struct node *n);
+int node_table_remove(struct node_table *nt, struct node *n);
+struct node * node_table_find(struct node_table *nt, struct key *id);
+
 #endif /* __NODE_H__ */
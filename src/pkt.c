@@ -16,6 +16,7 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
 
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,19 +35,42 @@ pkt_new(struct pkt *pkt, struct dht *dht,
 {
     ASSERT(pkt && dht && (len < MAX_PKT_LEN));
     
-    bzero(pkt, sizeof(struct pkt));
+    /* the payload beyond "len" is never read, so don't bother clearing it */
+    bzero(pkt, offsetof(struct pkt, buf));
     pkt->dht = dht;
     memcpy(&pkt->ss, ss, sslen);
+    pkt->data = pkt->buf;
     memcpy(pkt->data, data, len);
     pkt->len = len;
     
     return SUCCESS;
 }
 
+int
+pkt_borrow(struct pkt *pkt, u8 *data, unsigned int len)
+{
+    ASSERT(pkt && data);
+
+    if (len >= MAX_PKT_LEN) {
+        return FAILURE;
+    }
+
+    pkt->data = data;
+    pkt->borrowed = TRUE;
+    pkt->len = len;
+    pkt->cursor = 0;
+    pkt->mark_pos = 0;
+    pkt->mark_rdlim = 0;
+
+    return SUCCESS;
+}
+
 void
 pkt_reset_data(struct pkt *pkt)
 {
-    bzero(pkt->data, sizeof(pkt->data));
+    pkt->data = pkt->buf;
+    pkt->borrowed = FALSE;
+    bzero(pkt->data, sizeof(pkt->buf));
     pkt->len = 0;
     pkt->cursor = 0;
     pkt->mark_pos = 0;
@@ -107,6 +131,10 @@ pkt_write_check(struct pkt *pkt, size_t size)
 {
     pkt_sanity(pkt);
 
+    if (pkt->borrowed) {
+        return FAILURE;
+    }
+
     if ((size <= 0) ||
          (pkt->cursor > pkt->len) || ((pkt->cursor + size) > MAX_PKT_LEN)) {
         return FAILURE;
@@ -433,31 +461,40 @@ pkt_dump_data(u8 *data, size_t len)
     unsigned int width = 16;
     unsigned int row, col;
     unsigned int max_row, max_col;
+    char line[80];
+    char *p = NULL;
     char ch;
 
     ASSERT(data && len);
 
+    /* this is called for every pkt, so bail out before doing any work */
+    if (!TD_LOG_ENABLED(TD_LOG_LEVEL_DEBUG)) {
+        return SUCCESS;
+    }
+
     max_row = len/width + ((len % width) ? 1 : 0);
   
-    printf("data (%p) - len (%d)\n", data, len);
+    td_log(TD_LOG_LEVEL_DEBUG, "data (%p) - len (%d)\n", data, (int)len);
     for (row = 0; row < max_row; row++) {
         max_col = len / width ? width : len % width;
-        printf("%04x| ", row);
+        p = line;
+        p += sprintf(p, "%04x| ", row);
         for (col = 0; col < max_col; col++) {
-            printf("%02x ", data[row*width + col]);
+            p += sprintf(p, "%02x ", data[row*width + col]);
         }
         for (col = max_col; col < width; col++) {
-            printf("%2s ", "  ");
+            p += sprintf(p, "%2s ", "  ");
         }
-        printf("| ");
+        p += sprintf(p, "| ");
         for (col = 0; col < max_col; col++) {
             ch = data[row*width + col];
-            printf("%c", (isprint(ch) ? ch : '.'));
+            *p++ = (isprint(ch) ? ch : '.');
         }
-        printf("\n");
+        *p = 0;
+        td_log(TD_LOG_LEVEL_DEBUG, "%s\n", line);
         len -= max_col;
     }
-    printf("\n");
+    td_log(TD_LOG_LEVEL_DEBUG, "\n");
 
     return SUCCESS;
 }
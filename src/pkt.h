@@ -21,32 +21,41 @@
 
 #include <netinet/in.h>
 
+/* defined ahead of the includes, dht.h sizes its tx queue with it */
+#define MAX_PKT_LEN     1400    /* MTU size */
+
 #include "types.h"
 #include "dht.h"
 #include "queue.h"
 
-#define MAX_PKT_LEN     1400    /* MTU size */
-
 enum pkt_dir {
     PKT_DIR_UNKNOWN = 0,
     PKT_DIR_TX,
     PKT_DIR_RX
 };
 
+/* "data" normally points at the pkt's own "buf". A received pkt can
+ * instead borrow the receive buffer it arrived in (pkt_borrow()), which
+ * saves copying it; such a pkt is read-only and only valid until the
+ * receive buffer is reused, i.e. for the rest of the rx batch. Received 
+ * rpcs are handled and deleted before then. */
 struct pkt {
     enum pkt_dir                dir;    /* outgoing/incoming? */
     struct sockaddr_storage     ss;
-    u_int8_t                    data[MAX_PKT_LEN];
+    u_int8_t                    *data;
+    bool                        borrowed;
     unsigned int                len;    /* actual pkt len */
     unsigned int                cursor; /* to track write/read */
     unsigned int                mark_pos;
     unsigned int                mark_rdlim;
     struct dht                  *dht;
+    u_int8_t                    buf[MAX_PKT_LEN];       /* keep it last */
 };
 
 int pkt_new(struct pkt *pkt, struct dht *dht, 
             struct sockaddr_storage *ss, size_t sslen, 
             u8 *data, unsigned int len);
+int pkt_borrow(struct pkt *pkt, u8 *data, unsigned int len);
 void pkt_reset_data(struct pkt *pkt);
 int pkt_delete(struct pkt *pkt);
 int pkt_sanity(struct pkt *pkt);
@@ -0,0 +1,149 @@
+/***************************************************************************
+ *  Copyright (C) 2007 by Saritha Kalyanam                                 *
+ *  kalyanamsaritha@gmail.com                                              *
+ *                                                                         *
+ *  This program is free software: you can redistribute it and/or modify   *
+ *  it under the terms of the GNU Affero General Public License as         *
+ *  published by the Free Software Foundation, either version 3 of the     *
+ *  License, or (at your option) any later version.                        *
+ *                                                                         *
+ *  This program is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *  GNU Affero General Public License for more details.                    *
+ *                                                                         *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "tinydht.h"
+
+#define POOL_ROUNDUP(x)         (((x) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+static int pool_grow(struct pool *p);
+
+int
+pool_new(struct pool *p, const char *name, size_t obj_size, 
+            u32 objs_per_slab, u32 max_objs)
+{
+    ASSERT(p && name && obj_size && objs_per_slab);
+
+    bzero(p, sizeof(struct pool));
+
+    p->name = name;
+    /* the free list is threaded through the objects themselves */
+    p->obj_size = POOL_ROUNDUP(obj_size < sizeof(void *) 
+                                    ? sizeof(void *) : obj_size);
+    p->objs_per_slab = objs_per_slab;
+    /* the pool only ever grows by whole slabs */
+    p->max_objs = ((max_objs + objs_per_slab - 1)/objs_per_slab)*objs_per_slab;
+
+    return SUCCESS;
+}
+
+void
+pool_delete(struct pool *p)
+{
+    struct pool_slab *slab = NULL, *slabn = NULL;
+
+    ASSERT(p);
+
+    for (slab = p->slab_list; slab; slab = slabn) {
+        slabn = slab->next;
+        free(slab);
+    }
+
+    bzero(p, sizeof(struct pool));
+}
+
+void *
+pool_alloc(struct pool *p)
+{
+    void *obj = NULL;
+    int ret;
+
+    ASSERT(p);
+
+    if (!p->free_list) {
+        if (p->max_objs && (pool_capacity(p) >= p->max_objs)) {
+            p->stats.n_fail++;
+            return NULL;
+        }
+
+        ret = pool_grow(p);
+        if (ret != SUCCESS) {
+            p->stats.n_fail++;
+            return NULL;
+        }
+    }
+
+    obj = p->free_list;
+    p->free_list = *(void **)obj;
+
+    p->stats.n_used++;
+    if (p->stats.n_used > p->stats.high_water) {
+        p->stats.high_water = p->stats.n_used;
+    }
+
+    return obj;
+}
+
+void
+pool_free(struct pool *p, void *obj)
+{
+    ASSERT(p && obj && p->stats.n_used);
+
+    *(void **)obj = p->free_list;
+    p->free_list = obj;
+
+    p->stats.n_used--;
+}
+
+u32
+pool_capacity(struct pool *p)
+{
+    ASSERT(p);
+
+    return p->stats.n_slabs * p->objs_per_slab;
+}
+
+void
+pool_dump_stats(struct pool *p)
+{
+    ASSERT(p);
+
+    INFO("\t%-12s%u used, %u max, %u allocated (%u KB), %u failed\n", 
+            p->name, p->stats.n_used, p->stats.high_water, pool_capacity(p),
+            (u32)(pool_capacity(p)*p->obj_size/1024), p->stats.n_fail);
+}
+
+static int
+pool_grow(struct pool *p)
+{
+    struct pool_slab *slab = NULL;
+    u8 *obj = NULL;
+    u32 i;
+
+    slab = (struct pool_slab *) malloc(POOL_ROUNDUP(sizeof(struct pool_slab)) 
+                                        + p->objs_per_slab*p->obj_size);
+    if (!slab) {
+        return FAILURE;
+    }
+
+    slab->next = p->slab_list;
+    p->slab_list = slab;
+    p->stats.n_slabs++;
+
+    /* push the objects in reverse, so they get handed out in order */
+    obj = (u8 *)slab + POOL_ROUNDUP(sizeof(struct pool_slab));
+    for (i = p->objs_per_slab; i > 0; i--) {
+        *(void **)(obj + (i - 1)*p->obj_size) = p->free_list;
+        p->free_list = obj + (i - 1)*p->obj_size;
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,66 @@
+/***************************************************************************
+ *  Copyright (C) 2007 by Saritha Kalyanam                                 *
+ *  kalyanamsaritha@gmail.com                                              *
+ *                                                                         *
+ *  This program is free software: you can redistribute it and/or modify   *
+ *  it under the terms of the GNU Affero General Public License as         *
+ *  published by the Free Software Foundation, either version 3 of the     *
+ *  License, or (at your option) any later version.                        *
+ *                                                                         *
+ *  This program is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *  GNU Affero General Public License for more details.                    *
+ *                                                                         *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Fixed-size object pool. Objects are carved out of slabs of 
+ * objs_per_slab objects each and recycled through a free list, so the
+ * per-packet alloc/free never reaches malloc(). Slabs are only released
+ * when the pool itself is deleted. max_objs (rounded up to whole slabs, 
+ * 0 means unbounded) bounds the pool; pool_alloc() returns NULL once it
+ * is reached. */
+
+#define POOL_ALIGN              16
+
+struct pool_slab {
+    struct pool_slab    *next;
+};
+
+struct pool_stats {
+    u32                 n_used;         /* objects handed out */
+    u32                 high_water;     /* most objects ever handed out */
+    u32                 n_slabs;
+    u32                 n_fail;         /* allocs refused or failed */
+};
+
+struct pool {
+    const char          *name;
+    size_t              obj_size;
+    u32                 objs_per_slab;
+    u32                 max_objs;
+    void                *free_list;
+    struct pool_slab    *slab_list;
+    struct pool_stats   stats;
+};
+
+int pool_new(struct pool *p, const char *name, size_t obj_size, 
+                u32 objs_per_slab, u32 max_objs);
+void pool_delete(struct pool *p);
+
+void * pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+
+u32 pool_capacity(struct pool *p);
+void pool_dump_stats(struct pool *p);
+
+#endif /* __POOL_H__ */
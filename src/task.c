@@ -31,6 +31,7 @@ task_new(struct task *task, struct dht *dht, struct node *node, struct pkt *pkt)
     task->node = node;
     task->creation_time = dht_get_current_time();
     task->type = TASK_TYPE_CHILD;
+    timer_init(&task->timer);
     if (pkt) {
         task->pkt = pkt;
     }
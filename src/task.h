@@ -25,6 +25,7 @@ struct dht;
 #include "pkt.h"
 #include "queue.h"
 #include "node.h"
+#include "timer.h"
 
 enum task_type {
     TASK_TYPE_UNKNOWN = 0,
@@ -43,6 +44,7 @@ struct task {
     enum task_state                     state;
     u64                                 creation_time;
     u64                                 access_time;
+    struct timer                        timer;  /* rpc timeout */
     struct node                         *node;
     struct pkt                          *pkt;
     struct task                         *parent;
@@ -0,0 +1,227 @@
+/***************************************************************************
+ *  Copyright (C) 2007 by Saritha Kalyanam                                 *
+ *  kalyanamsaritha@gmail.com                                              *
+ *                                                                         *
+ *  This program is free software: you can redistribute it and/or modify   *
+ *  it under the terms of the GNU Affero General Public License as         *
+ *  published by the Free Software Foundation, either version 3 of the     *
+ *  License, or (at your option) any later version.                        *
+ *                                                                         *
+ *  This program is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *  GNU Affero General Public License for more details.                    *
+ *                                                                         *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+#include "tinydht.h"
+
+static void timer_heap_swap(struct timer_heap *th, int i, int j);
+static void timer_heap_up(struct timer_heap *th, int i);
+static void timer_heap_down(struct timer_heap *th, int i);
+
+int
+timer_heap_new(struct timer_heap *th)
+{
+    ASSERT(th);
+
+    bzero(th, sizeof(struct timer_heap));
+
+    th->heap = (struct timer **) malloc(TIMER_HEAP_INIT_SIZE 
+                                            * sizeof(struct timer *));
+    if (!th->heap) {
+        return FAILURE;
+    }
+
+    th->max_timers = TIMER_HEAP_INIT_SIZE;
+
+    return SUCCESS;
+}
+
+void
+timer_heap_delete(struct timer_heap *th)
+{
+    int i;
+
+    ASSERT(th);
+
+    for (i = 0; i < th->n_timers; i++) {
+        th->heap[i]->index = -1;
+    }
+
+    if (th->heap) {
+        free(th->heap);
+    }
+
+    bzero(th, sizeof(struct timer_heap));
+
+    return;
+}
+
+void
+timer_init(struct timer *t)
+{
+    ASSERT(t);
+
+    t->expires = 0;
+    t->index = -1;
+
+    return;
+}
+
+bool
+timer_is_armed(struct timer *t)
+{
+    ASSERT(t);
+
+    return (t->index >= 0) ? TRUE : FALSE;
+}
+
+int
+timer_add(struct timer_heap *th, struct timer *t, u64 expires)
+{
+    struct timer **heap = NULL;
+    int max_timers;
+
+    ASSERT(th && t);
+
+    /* re-arming an armed timer just moves it */
+    if (timer_is_armed(t)) {
+        timer_del(th, t);
+    }
+
+    if (th->n_timers == th->max_timers) {
+        max_timers = th->max_timers ? 2*th->max_timers : TIMER_HEAP_INIT_SIZE;
+        heap = (struct timer **) realloc(th->heap, 
+                                        max_timers * sizeof(struct timer *));
+        if (!heap) {
+            return FAILURE;
+        }
+        th->heap = heap;
+        th->max_timers = max_timers;
+    }
+
+    t->expires = expires;
+    t->index = th->n_timers;
+    th->heap[th->n_timers++] = t;
+
+    timer_heap_up(th, t->index);
+
+    return SUCCESS;
+}
+
+int
+timer_del(struct timer_heap *th, struct timer *t)
+{
+    int i;
+
+    ASSERT(th && t);
+
+    if (!timer_is_armed(t)) {
+        return SUCCESS;
+    }
+
+    i = t->index;
+    ASSERT(i < th->n_timers && th->heap[i] == t);
+
+    th->n_timers--;
+    if (i != th->n_timers) {
+        th->heap[i] = th->heap[th->n_timers];
+        th->heap[i]->index = i;
+        timer_heap_up(th, i);
+        timer_heap_down(th, th->heap[i]->index);
+    }
+
+    t->index = -1;
+
+    return SUCCESS;
+}
+
+struct timer *
+timer_peek(struct timer_heap *th)
+{
+    ASSERT(th);
+
+    if (th->n_timers == 0) {
+        return NULL;
+    }
+
+    return th->heap[0];
+}
+
+/* pops the earliest timer if it has expired by "now", so the caller can
+ * loop on this until it returns NULL */
+struct timer *
+timer_expire(struct timer_heap *th, u64 now)
+{
+    struct timer *t = NULL;
+
+    ASSERT(th);
+
+    t = timer_peek(th);
+    if (!t || (t->expires > now)) {
+        return NULL;
+    }
+
+    timer_del(th, t);
+
+    return t;
+}
+
+static void
+timer_heap_swap(struct timer_heap *th, int i, int j)
+{
+    struct timer *t = NULL;
+
+    t = th->heap[i];
+    th->heap[i] = th->heap[j];
+    th->heap[j] = t;
+
+    th->heap[i]->index = i;
+    th->heap[j]->index = j;
+
+    return;
+}
+
+static void
+timer_heap_up(struct timer_heap *th, int i)
+{
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1)/2;
+        if (th->heap[parent]->expires <= th->heap[i]->expires) {
+            break;
+        }
+        timer_heap_swap(th, i, parent);
+        i = parent;
+    }
+
+    return;
+}
+
+static void
+timer_heap_down(struct timer_heap *th, int i)
+{
+    int child;
+
+    while ((child = 2*i + 1) < th->n_timers) {
+        if (((child + 1) < th->n_timers) 
+                && (th->heap[child + 1]->expires < th->heap[child]->expires)) {
+            child++;
+        }
+        if (th->heap[i]->expires <= th->heap[child]->expires) {
+            break;
+        }
+        timer_heap_swap(th, i, child);
+        i = child;
+    }
+
+    return;
+}
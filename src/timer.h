@@ -0,0 +1,54 @@
+/***************************************************************************
+ *  Copyright (C) 2007 by Saritha Kalyanam                                 *
+ *  kalyanamsaritha@gmail.com                                              *
+ *                                                                         *
+ *  This program is free software: you can redistribute it and/or modify   *
+ *  it under the terms of the GNU Affero General Public License as         *
+ *  published by the Free Software Foundation, either version 3 of the     *
+ *  License, or (at your option) any later version.                        *
+ *                                                                         *
+ *  This program is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *  GNU Affero General Public License for more details.                    *
+ *                                                                         *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "types.h"
+
+/* A binary min-heap of timers keyed on their expiry time (in usecs, same
+ * clock as dht_get_current_time()). Timers are embedded in the objects
+ * that own them, so arming and disarming never allocates apart from the
+ * occasional growth of the heap array. */
+
+#define TIMER_HEAP_INIT_SIZE    64
+
+struct timer {
+    u64                 expires;
+    int                 index;          /* position in heap, -1 if idle */
+};
+
+struct timer_heap {
+    struct timer        **heap;
+    int                 n_timers;
+    int                 max_timers;
+};
+
+int timer_heap_new(struct timer_heap *th);
+void timer_heap_delete(struct timer_heap *th);
+
+void timer_init(struct timer *t);
+bool timer_is_armed(struct timer *t);
+
+int timer_add(struct timer_heap *th, struct timer *t, u64 expires);
+int timer_del(struct timer_heap *th, struct timer *t);
+
+struct timer * timer_peek(struct timer_heap *th);
+struct timer * timer_expire(struct timer_heap *th, u64 now);
+
+#endif /* __TIMER_H__ */
@@ -20,12 +20,17 @@
 #include <config.h>
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
-#define _GNU_SOURCE
 #include <getopt.h>
+#include <fcntl.h>
 
 #include <errno.h>
 extern int errno;
@@ -41,6 +46,7 @@ extern int errno;
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "tinydht.h"
 #include "dht_types.h"
@@ -53,11 +59,19 @@ extern int errno;
 #include "queue.h"
 #include "float.h"
 
+#ifdef TINYDHT_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 extern int h_errno;
 
 /*--------------- Global Variables -----------------*/
 
 char rpc_ifname[IFNAMSIZ];
+
+char *log_path = NULL;
+int log_level = TD_LOG_DEFAULT_LEVEL;
+char *snapshot_path = NULL;
 int n_rpc_if = 0;
 struct dht_net_if rpc_if[MAX_DHT_NET_IF];
 
@@ -72,7 +86,78 @@ TAILQ_HEAD(task_list_head, task) task_list;
 int n_poll_fd = 0;
 int poll_fd[MAX_POLL_FD];
 
+/* a client connection to the service, it lives on until the client closes
+ * it and every request that came in on it has been answered */
+struct tinydht_conn {
+    int                         fd;         /* -1 once closed */
+    struct sockaddr_storage     from;
+    socklen_t                   fromlen;
+    u8                          rbuf[MAX_SERVICE_BUF_LEN];
+    size_t                      rlen;
+    u8                          *wbuf;      /* not sent yet */
+    size_t                      wlen;
+    size_t                      wsize;
+    int                         n_pending;  /* requests not answered yet */
+    LIST_ENTRY(tinydht_conn)    next;
+};
+
+int n_conn = 0;
+LIST_HEAD(tinydht_conn_list_head, tinydht_conn) conn_list = 
+                                        LIST_HEAD_INITIALIZER(conn_list);
+
+#ifdef TINYDHT_USE_EPOLL
+int epoll_fd = -1;
+#endif
+
+#ifdef TINYDHT_USE_MMSG
+/* datagram receive ring, filled by a single recvmmsg() */
+struct tinydht_rx_ring {
+    struct mmsghdr              msg[MAX_RX_BATCH];
+    struct iovec                iov[MAX_RX_BATCH];
+    struct sockaddr_storage     from[MAX_RX_BATCH];
+    u8                          buf[MAX_RX_BATCH][MAX_RX_BUF_LEN];
+};
+#endif
+
+/* msgs passed between two threads, one putting them in and the other 
+ * taking them out, without a lock: each of them only ever moves its own 
+ * end of the ring */
+struct tinydht_ring {
+    u32                         head;       /* next slot to fill */
+    u32                         tail;       /* next slot to take */
+    struct tinydht_msg          *msg[TINYDHT_RING_SIZE];
+};
+
+/* Each dht instance runs its event loop in a thread of its own, and its 
+ * socket, tasks and tables are only ever touched from there. The service 
+ * thread hands it copies of the client requests through req_ring, and it 
+ * hands them back through rsp_ring once they are done. */
+struct tinydht_worker {
+    struct dht                  *dht;
+    pthread_t                   thread;
+    bool                        stop;
+    int                         wake_fd[2];     /* poked by the service */
+    struct tinydht_ring         req_ring;
+    struct tinydht_ring         rsp_ring;
+#ifdef TINYDHT_USE_MMSG
+    struct tinydht_rx_ring      rx_ring;
+#endif
+};
+
+int n_worker = 0;
+struct tinydht_worker worker[MAX_DHT_INSTANCE];
+
+/* poked by the dht instance threads when they have something for us */
+int svc_wake_fd[2] = { -1, -1 };
+
+/* the signal we were told to exit by, for the service loop to act on */
+static volatile sig_atomic_t tinydht_exit_signum = 0;
+
+/* the worker whose thread this is, NULL in the service thread */
+static __thread struct tinydht_worker *tinydht_self = NULL;
+
 u64 n_rx_tx = 0;
+u64 n_rx_tx_start = 0;
 
 u64 tinydht_oid = 0;
 
@@ -82,6 +167,7 @@ int tinydht_init(void);
 void tinydht_exit(struct dht **pdht, int *p_n_dht);
 int tinydht_init_sighandlers(void);
 static void tinydht_signal_handler(int signum);
+void tinydht_check_exit(void);
 int tinydht_usage(const char *cmd);
 
 int tinydht_get_intf_ip_addrs(const char *ifname, 
@@ -92,15 +178,57 @@ int tinydht_init_service(void);
 
 int tinydht_add_dht(unsigned int type, struct dht_net_if *nif);
 
+int tinydht_start_workers(void);
+void tinydht_stop_workers(void);
+void * tinydht_worker_loop(void *arg);
+void tinydht_worker_requests(struct tinydht_worker *w);
+void tinydht_worker_put(struct tinydht_worker *w, 
+                            struct tinydht_msg **msg, int n_msg);
+int tinydht_ring_push(struct tinydht_ring *ring, 
+                            struct tinydht_msg **msg, int n_msg);
+struct tinydht_msg * tinydht_ring_pop(struct tinydht_ring *ring);
+void tinydht_wake(int fd);
+void tinydht_wake_drain(int fd);
+
 int tinydht_poll_loop(void);
-int tinydht_task_schedule(void);
+#ifdef TINYDHT_USE_EPOLL
+int tinydht_epoll_loop(void);
+#endif
+int tinydht_poll_fallback_loop(void);
+int tinydht_read_fd(int fd);
+int tinydht_write_fd(int fd);
+int tinydht_set_poll_fd_write(int fd, bool on);
+int tinydht_service_accept(int fd);
+struct tinydht_conn * tinydht_conn_new(int sock, 
+                            struct sockaddr_storage *from, socklen_t fromlen);
+void tinydht_conn_delete(struct tinydht_conn *conn);
+void tinydht_conn_close(struct tinydht_conn *conn);
+struct tinydht_conn * tinydht_find_conn_from_fd(int fd);
+int tinydht_conn_read(struct tinydht_conn *conn);
+int tinydht_conn_write(struct tinydht_conn *conn, u8 *data, size_t len);
+int tinydht_conn_flush(struct tinydht_conn *conn);
+int tinydht_rpc_read(struct tinydht_worker *w);
+int tinydht_task_schedule(struct dht *dht);
 
 bool tinydht_is_service_fd(int fd);
-struct dht * tinydht_find_dht_from_fd(int fd);
 
-int tinydht_decode_request(int sock, struct sockaddr_storage *from, 
-                            size_t fromlen, u8 *data, int len);
+int tinydht_decode_request(struct tinydht_conn *conn, u32 id, 
+                            u8 *data, size_t len);
+int tinydht_decode_batch(struct tinydht_conn *conn, u32 id, 
+                            u8 *data, size_t len);
+struct tinydht_msg * tinydht_msg_new(struct tinydht_conn *conn, u32 id);
+void tinydht_msg_delete(struct tinydht_msg *msg);
+struct tinydht_msg * tinydht_msg_copy(struct tinydht_msg *msg);
+void tinydht_dispatch(struct tinydht_msg *msg);
+int tinydht_fanout(struct tinydht_msg **msg, int n_msg);
+void tinydht_collect(void);
+void tinydht_merge(struct tinydht_msg *copy);
+void tinydht_merge_val(struct tinydht_msg *msg, struct tinydht_msg *copy);
+void tinydht_merge_val_flush(struct tinydht_msg *msg);
+int tinydht_send_response(struct tinydht_msg *msg);
+bool tinydht_put_is_valid(struct tinydht_msg *msg);
 int tinydht_put(struct tinydht_msg *msg);
+int tinydht_put_batch(struct tinydht_msg **msg, int n_msg);
 int tinydht_get(struct tinydht_msg *msg);
 
 /*--------------- Implementation -----------------*/
@@ -119,12 +247,21 @@ main(int argc, char *argv[])
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "i:")) != -1) {
+    while ((c = getopt(argc, argv, "i:l:v:s:")) != -1) {
         switch (c) {
             case 'i':
                 bzero(rpc_ifname, sizeof(rpc_ifname));
                 memcpy(rpc_ifname, optarg, sizeof(rpc_ifname)-1);
                 break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'v':
+                log_level = atoi(optarg);
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
             default:
                 tinydht_usage(argv[0]);
                 return EXIT_FAILURE;
@@ -137,6 +274,13 @@ main(int argc, char *argv[])
         }
     }
 
+    /* from here on, logging goes through the async sink */
+    ret = td_log_init(log_path, log_level);
+    if (ret != SUCCESS) {
+        ERROR("cannot start logging!\n");
+        return EXIT_FAILURE;
+    }
+
     ret = tinydht_init();
     if (ret != SUCCESS) {
         ERROR("TinyDHT initialization failed!\n");
@@ -169,6 +313,9 @@ tinydht_init(void)
     /* initialize the prng */
     srandom(dht_get_current_time());
 
+    /* the rate limit counts from here on */
+    n_rx_tx_start = dht_get_current_time();
+
     /* initialize the crypto engine */
     ret = crypto_init();
     if (ret != SUCCESS) {
@@ -221,6 +368,12 @@ tinydht_init(void)
         return FAILURE;
     }
 
+    /* and let each dht instance loose in a thread of its own */
+    ret = tinydht_start_workers();
+    if (ret != SUCCESS) {
+        return FAILURE;
+    }
+
     return SUCCESS;
 }
 
@@ -238,11 +391,16 @@ tinydht_exit(struct dht **p_dht, int *p_n_dht)
         close(svc_fds[i]);
     }
 
+    /* the dht instances are ours again once their threads are gone */
+    tinydht_stop_workers();
+
     /* FIXME: shutdown the dht instances */
     for (i = 0; i < *p_n_dht; i++) {
         p_dht[i]->exit(p_dht[i]);
     }
 
+    td_log_exit();
+
     _Exit(0);
 }
 
@@ -261,15 +419,18 @@ tinydht_init_sighandlers(void)
 //    sigaction (SIGSEGV, &sigact, NULL);
     sigaction (SIGABRT, &sigact, NULL);
     sigaction (SIGTRAP, &sigact, NULL);
+    sigaction (SIGUSR1, &sigact, NULL);
 
     return SUCCESS;
 }
 
+/* Runs on top of whatever the service thread was doing, so anything that
+ * takes a lock or does I/O is left to tinydht_check_exit(). */
 static void
 tinydht_signal_handler(int signum)
 {
-    INFO("signal %d received\n", signum);
-        
+    int saved_errno = errno;
+
     switch (signum) {/* exited?      */
 
         case SIGSEGV:   /* crash?       */
@@ -278,7 +439,7 @@ tinydht_signal_handler(int signum)
             exit(0);    /* we cannot trust our memory */
 
         case SIGALRM:   /* timer?       */
-            tinydht_exit(dht, &n_dht);
+            tinydht_exit_signum = signum;
             break;
 
         case SIGHUP:    /* restart      */
@@ -289,7 +450,11 @@ tinydht_signal_handler(int signum)
 
         case SIGINT:    /* exited?      */
         case SIGTERM:   /* exited?      */
-            tinydht_exit(dht, &n_dht);
+            tinydht_exit_signum = signum;
+            break;
+
+        case SIGUSR1:   /* cycle the log level */
+            td_log_set_level((td_log_level % TD_LOG_LEVEL_DEBUG) + 1);
             break;
 
         default:
@@ -297,8 +462,28 @@ tinydht_signal_handler(int signum)
             break;
     }
 
+    /* the service loop may be asleep in poll() on another fd */
+    if (tinydht_exit_signum && (svc_wake_fd[1] >= 0)) {
+        tinydht_wake(svc_wake_fd[1]);
+    }
+
+    errno = saved_errno;
+
     return;
 }
+
+/* exits from the service loop, once a signal has asked for it */
+void
+tinydht_check_exit(void)
+{
+    if (!tinydht_exit_signum) {
+        return;
+    }
+
+    INFO("signal %d received\n", (int)tinydht_exit_signum);
+
+    tinydht_exit(dht, &n_dht);
+}
 int
 tinydht_get_intf_ip_addrs(const char *ifname, 
                             struct dht_net_if *nif, int *n_if, int max_if)
@@ -425,15 +610,32 @@ tinydht_add_dht(unsigned int type, struct dht_net_if *nif)
 {
     struct dht *d = NULL;
     unsigned short port;
+    char path[DHT_SNAPSHOT_PATH_LEN];
+    u16 saved_port;
+    bool use_saved_port = FALSE;
     int ret = FAILURE;
     int i;
     bool unique_port;
 
+    if (snapshot_path) {
+        /* one snapshot per dht instance; coming back on the same port 
+         * keeps our node id, so the saved routing table stays valid */
+        snprintf(path, sizeof(path), "%s.%d", snapshot_path, n_dht);
+        if (dht_snapshot_get_port(path, type, &saved_port) == SUCCESS) {
+            use_saved_port = TRUE;
+        }
+    }
+
     do {
         unique_port = TRUE;
-        ret = dht_get_rnd_port((u16 *)&port);
-        if (ret != SUCCESS) {
-            return ret;
+        if (use_saved_port) {
+            port = ntohs(saved_port);
+            use_saved_port = FALSE;
+        } else {
+            ret = dht_get_rnd_port((u16 *)&port);
+            if (ret != SUCCESS) {
+                return ret;
+            }
         }
 
         for (i = 0; i < n_dht; i++) {
@@ -460,6 +662,12 @@ tinydht_add_dht(unsigned int type, struct dht_net_if *nif)
                 ret = SUCCESS;
                 break;
             }
+            if (snapshot_path) {
+                memcpy(d->snapshot_path, path, sizeof(d->snapshot_path));
+                if (d->snapshot_load) {
+                    d->snapshot_load(d);
+                }
+            }
             dht[n_dht] = d;
             n_dht++;
             ret = SUCCESS;
@@ -470,6 +678,273 @@ tinydht_add_dht(unsigned int type, struct dht_net_if *nif)
     return ret;
 }
 
+/* Starts an event loop thread for each dht instance, with the socket of
+ * the instance taken out of the service's poll set and handed over to it.
+ * Signals are left to the service thread. */
+int
+tinydht_start_workers(void)
+{
+    struct tinydht_worker *w = NULL;
+    sigset_t all, old;
+    int flags;
+    int i;
+    int ret;
+
+    if ((pipe(svc_wake_fd) < 0) 
+            || (tinydht_add_poll_fd(svc_wake_fd[0]) != SUCCESS)) {
+        ERROR("cannot set up the service wake up - %s\n", strerror(errno));
+        return FAILURE;
+    }
+
+    flags = fcntl(svc_wake_fd[1], F_GETFL, 0);
+    fcntl(svc_wake_fd[1], F_SETFL, flags | O_NONBLOCK);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 0; i < n_dht; i++) {
+        w = &worker[i];
+
+        bzero(w, sizeof(struct tinydht_worker));
+        w->dht = dht[i];
+
+        if (pipe(w->wake_fd) < 0) {
+            ERROR("pipe() - %s\n", strerror(errno));
+            break;
+        }
+        flags = fcntl(w->wake_fd[0], F_GETFL, 0);
+        fcntl(w->wake_fd[0], F_SETFL, flags | O_NONBLOCK);
+        flags = fcntl(w->wake_fd[1], F_GETFL, 0);
+        fcntl(w->wake_fd[1], F_SETFL, flags | O_NONBLOCK);
+
+        tinydht_del_poll_fd(w->dht->net_if.sock);
+
+        ret = pthread_create(&w->thread, NULL, tinydht_worker_loop, w);
+        if (ret != 0) {
+            ERROR("pthread_create() - %s\n", strerror(ret));
+            close(w->wake_fd[0]);
+            close(w->wake_fd[1]);
+            break;
+        }
+
+        n_worker++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    INFO("TinyDHT started %d dht threads\n", n_worker);
+
+    return (n_worker == n_dht) ? SUCCESS : FAILURE;
+}
+
+void
+tinydht_stop_workers(void)
+{
+    int i;
+
+    for (i = 0; i < n_worker; i++) {
+        __atomic_store_n(&worker[i].stop, TRUE, __ATOMIC_RELEASE);
+        tinydht_wake(worker[i].wake_fd[1]);
+    }
+
+    for (i = 0; i < n_worker; i++) {
+        pthread_join(worker[i].thread, NULL);
+    }
+
+    n_worker = 0;
+}
+
+/* the event loop of a dht instance: its socket, the requests the service 
+ * hands it, and its task scheduler */
+void *
+tinydht_worker_loop(void *arg)
+{
+    struct tinydht_worker *w = (struct tinydht_worker *) arg;
+    struct pollfd fds[2];
+    int timeout;
+    int ret;
+
+    tinydht_self = w;
+
+    fds[0].fd = w->dht->net_if.sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = w->wake_fd[0];
+    fds[1].events = POLLIN;
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+
+        tinydht_worker_requests(w);
+
+        /* call the task_scheduler, it tells us how long we can sleep */
+        timeout = tinydht_task_schedule(w->dht);
+
+        /* push out whatever got queued since the last wait */
+        dht_txq_flush(w->dht);
+
+        fds[0].revents = fds[1].revents = 0;
+
+        ret = poll(fds, 2, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("poll() - %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) {
+            tinydht_rpc_read(w);
+        }
+
+        if (fds[1].revents) {
+            tinydht_wake_drain(w->wake_fd[0]);
+        }
+    }
+
+    return NULL;
+}
+
+/* does the requests the service has handed w, the PUTs of a batch all 
+ * together */
+void
+tinydht_worker_requests(struct tinydht_worker *w)
+{
+    struct tinydht_msg *batch[MAX_BATCH_ITEMS];
+    struct tinydht_msg *msg = NULL;
+    struct dht *d = NULL;
+    int n_batch = 0;
+
+    ASSERT(w);
+
+    d = w->dht;
+
+    while ((msg = tinydht_ring_pop(&w->req_ring))) {
+
+        if (msg->req.action == TINYDHT_ACTION_PUT) {
+            batch[n_batch++] = msg;
+            if (msg->more && (n_batch < MAX_BATCH_ITEMS)) {
+                continue;
+            }
+            tinydht_worker_put(w, batch, n_batch);
+            n_batch = 0;
+            continue;
+        }
+
+        if (d->get(d, msg) != SUCCESS) {
+            msg->rsp.status = TINYDHT_RESPONSE_FAILURE;
+            msg->rsp.val_len = 0;
+            tinydht_respond(msg);
+        }
+
+        /* otherwise msg comes back once the lookup is done */
+    }
+
+    /* a batch is pushed all at once, so it never comes in halves */
+    ASSERT(n_batch == 0);
+}
+
+void
+tinydht_worker_put(struct tinydht_worker *w, 
+                    struct tinydht_msg **msg, int n_msg)
+{
+    struct dht *d = NULL;
+    int i;
+
+    ASSERT(w && msg);
+
+    d = w->dht;
+
+    for (i = 0; i < n_msg; i++) {
+        msg[i]->rsp.status = TINYDHT_RESPONSE_FAILURE;
+        msg[i]->rsp.val_len = 0;
+    }
+
+    if ((n_msg > 1) && d->put_batch) {
+        d->put_batch(d, msg, n_msg);
+    } else {
+        for (i = 0; i < n_msg; i++) {
+            if (d->put(d, msg[i]) == SUCCESS) {
+                msg[i]->rsp.status = TINYDHT_RESPONSE_SUCCESS;
+            }
+        }
+    }
+
+    for (i = 0; i < n_msg; i++) {
+        tinydht_respond(msg[i]);
+    }
+}
+
+/* puts all n_msg of msg into ring, or none of them if they do not fit */
+int
+tinydht_ring_push(struct tinydht_ring *ring, 
+                    struct tinydht_msg **msg, int n_msg)
+{
+    u32 head, tail;
+    int i;
+
+    ASSERT(ring && msg);
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if ((TINYDHT_RING_SIZE - (head - tail)) < (u32)n_msg) {
+        return FAILURE;
+    }
+
+    for (i = 0; i < n_msg; i++) {
+        ring->msg[(head + i) & (TINYDHT_RING_SIZE - 1)] = msg[i];
+    }
+
+    /* the msgs have to be there before the consumer can see them */
+    __atomic_store_n(&ring->head, head + n_msg, __ATOMIC_RELEASE);
+
+    return SUCCESS;
+}
+
+struct tinydht_msg *
+tinydht_ring_pop(struct tinydht_ring *ring)
+{
+    struct tinydht_msg *msg = NULL;
+    u32 tail;
+
+    ASSERT(ring);
+
+    tail = ring->tail;
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    msg = ring->msg[tail & (TINYDHT_RING_SIZE - 1)];
+
+    /* and the slot is free again only after we have read it */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return msg;
+}
+
+/* makes the other end of a wake up pipe return from poll(), if it is not 
+ * going to already */
+void
+tinydht_wake(int fd)
+{
+    u8 c = 0;
+
+    if (write(fd, &c, 1) < 0) {
+        /* full, so there is a wake up pending anyway */
+    }
+}
+
+void
+tinydht_wake_drain(int fd)
+{
+    u8 buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+        ;
+    }
+}
+
 int
 tinydht_init_service(void)
 {
@@ -562,10 +1037,37 @@ err:
 int
 tinydht_add_poll_fd(int fd)
 {
+    int flags;
+#ifdef TINYDHT_USE_EPOLL
+    struct epoll_event ev;
+    int ret;
+#endif
+
     if (n_poll_fd >= MAX_POLL_FD) {
         return FAILURE;
     }
 
+    /* every polled fd is drained until EAGAIN, so it must not block */
+    flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        ERROR("fcntl() - %s\n", strerror(errno));
+        return FAILURE;
+    }
+
+#ifdef TINYDHT_USE_EPOLL
+    /* the event loop is already running, so register it right away */
+    if (epoll_fd >= 0) {
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        if (ret < 0) {
+            ERROR("epoll_ctl() - %s\n", strerror(errno));
+            return FAILURE;
+        }
+    }
+#endif
+
     DEBUG("TinyDHT added fd %d to poll\n", fd);
 
     poll_fd[n_poll_fd] = fd;
@@ -574,18 +1076,59 @@ tinydht_add_poll_fd(int fd)
     return SUCCESS;
 }
 
-struct dht *
-tinydht_find_dht_from_fd(int fd)
+int
+tinydht_del_poll_fd(int fd)
 {
     int i;
 
-    for (i = 0; i < n_dht; i++) {
-        if ((dht[i]->net_if.sock == fd)) {
-            return dht[i];
+    for (i = 0; i < n_poll_fd; i++) {
+        if (poll_fd[i] == fd) {
+            break;
         }
     }
 
-    return NULL;
+    if (i == n_poll_fd) {
+        return FAILURE;
+    }
+
+#ifdef TINYDHT_USE_EPOLL
+    if (epoll_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+#endif
+
+    DEBUG("TinyDHT removed fd %d from poll\n", fd);
+
+    poll_fd[i] = poll_fd[n_poll_fd - 1];
+    n_poll_fd--;
+
+    return SUCCESS;
+}
+
+/* asks the event loop to tell us when fd can take more data (on) or to 
+ * stop doing so (!on) */
+int
+tinydht_set_poll_fd_write(int fd, bool on)
+{
+#ifdef TINYDHT_USE_EPOLL
+    struct epoll_event ev;
+    int ret;
+
+    if (epoll_fd >= 0) {
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (ret < 0) {
+            ERROR("epoll_ctl() - %s\n", strerror(errno));
+            return FAILURE;
+        }
+    }
+#endif
+
+    /* the poll() loop looks at the conn's write buffer instead */
+
+    return SUCCESS;
 }
 
 bool
@@ -605,304 +1148,1308 @@ tinydht_is_service_fd(int fd)
 int
 tinydht_poll_loop(void)
 {
-    struct pollfd fds[MAX_POLL_FD];
-    int i;
+#ifdef TINYDHT_USE_EPOLL
     int ret;
-    bool data_avail;
-    bool fd_found;
-    struct dht *dht = NULL;
-    u8 buf[2048];
-    struct sockaddr_storage from;
-    size_t fromlen;
-    int len = 0;
-    int sock;
 
-    INFO("TinyDHT polling %d fds\n", n_poll_fd);
+    ret = tinydht_epoll_loop();
+    if (ret == SUCCESS) {
+        return SUCCESS;
+    }
+
+    /* epoll could not be set up, so carry on with plain poll() */
+    ERROR("epoll unavailable, falling back to poll()\n");
+#endif
+
+    return tinydht_poll_fallback_loop();
+}
 
-    bzero(fds, sizeof(fds));
+#ifdef TINYDHT_USE_EPOLL
+int
+tinydht_epoll_loop(void)
+{
+    struct epoll_event ev;
+    struct epoll_event events[MAX_POLL_FD];
+    int n_events;
+    int timeout;
+    int i;
+    int ret;
+
+    epoll_fd = epoll_create(MAX_POLL_FD);
+    if (epoll_fd < 0) {
+        ERROR("epoll_create() - %s\n", strerror(errno));
+        return FAILURE;
+    }
 
     for (i = 0; i < n_poll_fd; i++) {
-        fds[i].fd = poll_fd[i];
-        fds[i].events = POLLIN | POLLERR | POLLHUP | POLLNVAL;
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = poll_fd[i];
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, poll_fd[i], &ev);
+        if (ret < 0) {
+            ERROR("epoll_ctl() - %s\n", strerror(errno));
+            close(epoll_fd);
+            epoll_fd = -1;
+            return FAILURE;
+        }
     }
 
+    INFO("TinyDHT epolling %d fds\n", n_poll_fd);
+
     while (TRUE) {
 
-        /* call the task_scheduler */
-        tinydht_task_schedule();
-        
-        data_avail = FALSE;
-        errno = 0;
+        tinydht_check_exit();
 
-        ret = poll(fds, n_poll_fd, MAX_POLL_TIMEOUT);
+        /* the dht instances run on their own, and wake us up when they 
+         * have answers for us */
+        timeout = MAX_POLL_TIMEOUT;
 
-        switch (ret) {
-            case -1:        /* error */
-                if (errno == EINTR) {
-                    continue;
+        errno = 0;
+
+        n_events = epoll_wait(epoll_fd, events, MAX_POLL_FD, timeout);
+        if (n_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("epoll_wait() - %s\n", strerror(errno));
+            break;
+        }
+
+        /* edge-triggered, so every ready fd has to be drained now */
+        for (i = 0; i < n_events; i++) {
+            if (events[i].events & ~EPOLLOUT) {
+                tinydht_read_fd(events[i].data.fd);
+            }
+            if (events[i].events & EPOLLOUT) {
+                tinydht_write_fd(events[i].data.fd);
+            }
+        }
+    }
+
+    /* the fds are still intact, so poll() can take over */
+    close(epoll_fd);
+    epoll_fd = -1;
+
+    return FAILURE;
+}
+#endif
+
+int
+tinydht_poll_fallback_loop(void)
+{
+    struct pollfd fds[MAX_POLL_FD];
+    struct tinydht_conn *conn = NULL;
+    int n_fds;
+    int timeout;
+    int i;
+    int ret;
+
+    INFO("TinyDHT polling %d fds\n", n_poll_fd);
+
+    while (TRUE) {
+
+        tinydht_check_exit();
+
+        /* client connections come and go, so set up the fds every time */
+        bzero(fds, sizeof(fds));
+
+        n_fds = n_poll_fd;
+        for (i = 0; i < n_fds; i++) {
+            fds[i].fd = poll_fd[i];
+            fds[i].events = POLLIN | POLLERR | POLLHUP | POLLNVAL;
+            conn = tinydht_find_conn_from_fd(poll_fd[i]);
+            if (conn && conn->wlen) {
+                fds[i].events |= POLLOUT;
+            }
+        }
+
+        /* the dht instances run on their own, and wake us up when they 
+         * have answers for us */
+        timeout = MAX_POLL_TIMEOUT;
+
+        errno = 0;
+
+        ret = poll(fds, n_fds, timeout);
+
+        switch (ret) {
+            case -1:        /* error */
+                if (errno == EINTR) {
+                    continue;
                 }
                 ERROR("poll() - %s\n", strerror(errno));
                 return FAILURE;
             case 0:         /* timeout */
                 continue;
             default:        /* some data is ready */
-                data_avail = TRUE;
                 break;
         }
 
-        if (!data_avail) {
-            continue;
+        /* service every ready fd, not just the first one */
+        for (i = 0; i < n_fds; i++) {
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                tinydht_read_fd(fds[i].fd);
+            }
+            if (fds[i].revents & POLLOUT) {
+                tinydht_write_fd(fds[i].fd);
+            }
         }
+    }
+
+    return FAILURE;
+}
+
+int
+tinydht_read_fd(int fd)
+{
+    struct tinydht_conn *conn = NULL;
+
+    DEBUG("TinyDHT reading fd %d\n", fd);
+
+    if (tinydht_is_service_fd(fd)) {
+        return tinydht_service_accept(fd);
+    }
+
+    /* more requests on a client connection? */
+    conn = tinydht_find_conn_from_fd(fd);
+    if (conn) {
+        return tinydht_conn_read(conn);
+    }
+
+    /* have the dht instances got answers for us? */
+    if (fd == svc_wake_fd[0]) {
+        tinydht_wake_drain(fd);
+        tinydht_collect();
+        return SUCCESS;
+    }
+
+    ERROR("unknown fd %d\n", fd);
+
+    return FAILURE;
+}
+
+int
+tinydht_write_fd(int fd)
+{
+    struct tinydht_conn *conn = NULL;
+
+    DEBUG("TinyDHT writing fd %d\n", fd);
+
+    /* only client connections ever wait to write */
+    conn = tinydht_find_conn_from_fd(fd);
+    if (!conn) {
+        return FAILURE;
+    }
+
+    return tinydht_conn_flush(conn);
+}
+
+int
+tinydht_service_accept(int fd)
+{
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    struct tinydht_conn *conn = NULL;
+    int sock;
 
-        fd_found = FALSE;
-        for (i = 0; i < n_poll_fd; i++) {
-            if (fds[i].revents & POLLIN) {
-                fd_found = TRUE;
+    /* the listening socket is non-blocking, so accept until EAGAIN */
+    while (TRUE) {
+
+        bzero(&from, sizeof(from));
+        fromlen = sizeof(from);
+
+        sock = accept(fd, (struct sockaddr *)&from, &fromlen);
+        if (sock < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                 break;
             }
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("accept() - %s\n", strerror(errno));
+            return FAILURE;
         }
 
-        if (data_avail && !fd_found) {
-            return FAILURE;
+        if (n_conn >= MAX_SERVICE_CONN) {
+            ERROR("too many client connections, dropping fd %d\n", sock);
+            close(sock);
+            continue;
         }
 
-        DEBUG("TinyDHT reading fd %d\n", poll_fd[i]);
+        conn = tinydht_conn_new(sock, &from, fromlen);
+        if (!conn) {
+            close(sock);
+            continue;
+        }
 
-        if (tinydht_is_service_fd(poll_fd[i])) {
+        if (tinydht_add_poll_fd(sock) != SUCCESS) {
+            tinydht_conn_close(conn);
+            continue;
+        }
 
-            bzero(&from, sizeof(from));
-            fromlen = sizeof(from);
+        /* edge-triggered, so whatever the client sent already is ours 
+         * to read now */
+        tinydht_conn_read(conn);
+    }
 
-            sock = accept(poll_fd[i], (struct sockaddr *)&from, &fromlen);
-            if (sock < 0) {
-                ERROR("accept() - %s\n", strerror(errno));
-                continue;
-            }
+    return SUCCESS;
+}
 
-            len = recv(sock, buf, sizeof(buf), 0);
-            if (len <= 0) {
-                ERROR("recv() - %s\n", strerror(errno));
-                continue;
-            }
+struct tinydht_conn *
+tinydht_conn_new(int sock, struct sockaddr_storage *from, socklen_t fromlen)
+{
+    struct tinydht_conn *conn = NULL;
 
-            ret = tinydht_decode_request(sock, &from, fromlen, buf, len);
-            if (ret < 0) {
-                continue;
-            }
+    conn = (struct tinydht_conn *) malloc(sizeof(struct tinydht_conn));
+    if (!conn) {
+        ERROR("%s\n", strerror(errno));
+        return NULL;
+    }
 
-        } else {
+    bzero(conn, sizeof(struct tinydht_conn));
+    conn->fd = sock;
+    memcpy(&conn->from, from, fromlen);
+    conn->fromlen = fromlen;
 
-            /* read the data */
-            fromlen = sizeof(struct sockaddr_storage);
-            len = recvfrom(poll_fd[i], buf, sizeof(buf), 0, 
-                    (struct sockaddr *)&from, &fromlen);
-            if (len <= 0) {
-                ERROR("recvfrom() - %s\n", strerror(errno));
-                continue;
-            }
+    LIST_INSERT_HEAD(&conn_list, conn, next);
+    n_conn++;
 
-            INFO("received %d bytes from %s:%hu\n", len,
-                    inet_ntoa((((struct sockaddr_in *)&from)->sin_addr)), 
-                    ntohs(((struct sockaddr_in *)&from)->sin_port));
+    DEBUG("TinyDHT client connection on fd %d\n", sock);
 
-            /* has it arrived on a dht instance? */
-            dht = tinydht_find_dht_from_fd(poll_fd[i]);
-            if (!dht) {
-                ERROR("No DHT found for fd %d\n", poll_fd[i]);
-                return FAILURE;
-            }
+    return conn;
+}
 
-            ret = dht->rpc_rx(dht, &from, fromlen, 
-                                buf, len, dht_get_current_time());
-            if (ret != SUCCESS) {
-                continue;
-            }
-        }
+void
+tinydht_conn_delete(struct tinydht_conn *conn)
+{
+    ASSERT(conn && (conn->fd < 0) && (conn->n_pending == 0));
+
+    if (conn->wbuf) {
+        free(conn->wbuf);
     }
+    free(conn);
+}
 
-    return FAILURE;
+/* requests still in progress hold on to the conn, the last of them frees 
+ * it in tinydht_respond() */
+void
+tinydht_conn_close(struct tinydht_conn *conn)
+{
+    ASSERT(conn && (conn->fd >= 0));
+
+    DEBUG("TinyDHT closing client connection on fd %d\n", conn->fd);
+
+    tinydht_del_poll_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+
+    LIST_REMOVE(conn, next);
+    n_conn--;
+
+    if (conn->n_pending == 0) {
+        tinydht_conn_delete(conn);
+    }
 }
 
-int
-tinydht_task_schedule(void)
+struct tinydht_conn *
+tinydht_find_conn_from_fd(int fd)
 {
-    static int index = 0;
+    struct tinydht_conn *conn = NULL;
 
-    /* give every dht instance a time slice */
-    dht[index]->task_schedule(dht[index]);
-    index = (index + 1) % n_dht;
+    LIST_FOREACH(conn, &conn_list, next) {
+        if (conn->fd == fd) {
+            return conn;
+        }
+    }
 
-    return SUCCESS;
+    return NULL;
 }
 
 int
-tinydht_decode_request(int sock, struct sockaddr_storage *from, 
-                        size_t fromlen, u8 *data, int len)
+tinydht_conn_read(struct tinydht_conn *conn)
 {
-    struct tinydht_msg_req req;
-    struct tinydht_msg *msg = NULL;
+    struct tinydht_msg_hdr hdr;
+    size_t off;
+    u32 len;
     int ret;
 
-    bzero(&req, sizeof(req));
-    memcpy(&req, data, len);
-    req.key_len = htonl(req.key_len);
-    req.val_len = htonl(req.val_len);
-
-    msg = (struct tinydht_msg *) malloc(sizeof(struct tinydht_msg));
-    if (!msg) {
-        ERROR("%s\n", strerror(errno));
-        goto err;
-    }
+    ASSERT(conn && (conn->fd >= 0));
 
-    bzero(msg, sizeof(struct tinydht_msg));
-    memcpy(&msg->req, &req, sizeof(req));
-    msg->sock = sock;
-    memcpy(&msg->from, from, fromlen);
-    msg->fromlen = fromlen;
+    while (TRUE) {
 
-    switch (req.action) {
-        case TINYDHT_ACTION_PUT:
-            DEBUG("PUT received\n");
-            ret = tinydht_put(msg);
-            if (ret != SUCCESS) {
+        ret = recv(conn->fd, conn->rbuf + conn->rlen, 
+                    sizeof(conn->rbuf) - conn->rlen, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                 break;
             }
+            ERROR("recv() - %s\n", strerror(errno));
+            goto err;
+        }
 
-            break;
+        if (ret == 0) {
+            /* the client is done with us */
+            goto err;
+        }
 
-        case TINYDHT_ACTION_GET:
-            DEBUG("GET received\n");
-            ret = tinydht_get(msg);
+        conn->rlen += ret;
+
+        /* hand over every complete request in the buffer; a request may 
+         * be answered, and the conn closed on a failed write, before 
+         * tinydht_decode_request() returns, so hold on to the conn */
+        off = 0;
+        conn->n_pending++;
+
+        while ((conn->rlen - off) >= sizeof(struct tinydht_msg_hdr)) {
+            memcpy(&hdr, conn->rbuf + off, sizeof(hdr));
+            len = ntohl(hdr.len);
+
+            if ((len == 0) || (len > MAX_SERVICE_REQ_LEN)) {
+                ERROR("bad request length %u on fd %d\n", len, conn->fd);
+                conn->n_pending--;
+                goto err;
+            }
+
+            if ((conn->rlen - off) < (sizeof(hdr) + len)) {
+                break;
+            }
+
+            off += sizeof(hdr);
+            ret = tinydht_decode_request(conn, ntohl(hdr.id), 
+                                    conn->rbuf + off, len);
             if (ret != SUCCESS) {
+                /* we cannot make sense of what follows either */
+                ERROR("bad request on fd %d\n", conn->fd);
+                conn->n_pending--;
+                goto err;
+            }
+            off += len;
+
+            if (conn->fd < 0) {
                 break;
             }
+        }
 
-            break;
+        conn->n_pending--;
 
-        default:
-            ERROR("unknown action %d\n", req.action);
-            free(msg);
-            goto err;
+        if (conn->fd < 0) {
+            if (conn->n_pending == 0) {
+                tinydht_conn_delete(conn);
+            }
+            return FAILURE;
+        }
+
+        memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+        conn->rlen -= off;
     }
 
-    if (ret != SUCCESS) {
-        msg->rsp.status = TINYDHT_RESPONSE_FAILURE;
+    return SUCCESS;
+
+err:
+    tinydht_conn_close(conn);
+    return FAILURE;
+}
 
-        ret = send(sock, &msg->rsp, sizeof(msg->rsp), 0);
+/* sends as much of data as the socket takes right now, and queues up the 
+ * rest to go out once the client has read some more */
+int
+tinydht_conn_write(struct tinydht_conn *conn, u8 *data, size_t len)
+{
+    size_t off = 0;
+    size_t wsize;
+    u8 *wbuf = NULL;
+    int ret;
+
+    ASSERT(conn && (conn->fd >= 0) && data);
+
+    /* keep the responses in order behind whatever is queued already */
+    while ((conn->wlen == 0) && (off < len)) {
+        ret = send(conn->fd, data + off, len - off, MSG_NOSIGNAL);
         if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
             ERROR("send() - %s\n", strerror(errno));
+            goto err;
         }
+        off += ret;
+    }
 
-        close(sock);
-        free(msg);
+    if (off == len) {
+        return SUCCESS;
+    }
 
-    } else if (req.action == TINYDHT_ACTION_PUT) {
-        msg->rsp.status = TINYDHT_RESPONSE_SUCCESS;
+    /* a client that does not read its responses is not worth waiting 
+     * for forever */
+    if ((conn->wlen + len - off) > MAX_SERVICE_WBUF_LEN) {
+        ERROR("client on fd %d is not reading, dropping it\n", conn->fd);
+        goto err;
+    }
 
-        ret = send(sock, &msg->rsp, sizeof(msg->rsp), 0);
-        if (ret < 0) {
-            ERROR("send() - %s\n", strerror(errno));
+    if ((conn->wlen + len - off) > conn->wsize) {
+        wsize = conn->wsize ? conn->wsize : MAX_SERVICE_BUF_LEN;
+        while (wsize < (conn->wlen + len - off)) {
+            wsize *= 2;
+        }
+        wbuf = (u8 *) realloc(conn->wbuf, wsize);
+        if (!wbuf) {
+            ERROR("%s\n", strerror(errno));
+            goto err;
         }
+        conn->wbuf = wbuf;
+        conn->wsize = wsize;
+    }
 
-        close(sock);
-        free(msg);
+    if (conn->wlen == 0) {
+        tinydht_set_poll_fd_write(conn->fd, TRUE);
     }
 
+    memcpy(conn->wbuf + conn->wlen, data + off, len - off);
+    conn->wlen += len - off;
+
     return SUCCESS;
 
 err:
+    tinydht_conn_close(conn);
     return FAILURE;
 }
 
+/* sends out the queued responses, called when the socket is writable */
 int
-tinydht_put(struct tinydht_msg *msg)
+tinydht_conn_flush(struct tinydht_conn *conn)
 {
-    int i;
-    bool found = FALSE;
+    size_t off = 0;
     int ret;
 
-    if ((msg->req.key_len <= 0) || (msg->req.key_len > MAX_KEY_LEN) ||
-            (msg->req.val_len <= 0) || (msg->req.val_len > MAX_VAL_LEN)) {
-        return FAILURE;
-    }
+    ASSERT(conn && (conn->fd >= 0));
 
-    for (i = 0; i < n_dht; i++) {
-        ret = dht[i]->put(dht[i], msg);
-        if (ret != SUCCESS) {
-            continue;
+    while (off < conn->wlen) {
+        ret = send(conn->fd, conn->wbuf + off, conn->wlen - off, 
+                    MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            ERROR("send() - %s\n", strerror(errno));
+            tinydht_conn_close(conn);
+            return FAILURE;
         }
-        found = TRUE;
+        off += ret;
     }
 
-    if (found) {
-        DEBUG("at least one PUT was successful\n");
-        return SUCCESS;
-    } 
+    memmove(conn->wbuf, conn->wbuf + off, conn->wlen - off);
+    conn->wlen -= off;
 
-    return FAILURE;
+    if (conn->wlen == 0) {
+        tinydht_set_poll_fd_write(conn->fd, FALSE);
+    }
+
+    return SUCCESS;
 }
 
+#ifdef TINYDHT_USE_MMSG
 int
-tinydht_get(struct tinydht_msg *msg)
+tinydht_rpc_read(struct tinydht_worker *w)
 {
+    struct tinydht_rx_ring *ring = &w->rx_ring;
+    struct dht *dht = w->dht;
+    int fd = dht->net_if.sock;
+    struct mmsghdr *m = NULL;
+    u64 timestamp;
+    int n_msg;
     int i;
-    bool found = FALSE;
-    int ret;
 
-    if ((msg->req.key_len <= 0) || (msg->req.key_len > MAX_KEY_LEN)) {
-        return FAILURE;
-    }
+    /* drain the socket a batch at a time until the kernel runs dry */
+    while (TRUE) {
+        for (i = 0; i < MAX_RX_BATCH; i++) {
+            ring->iov[i].iov_base = ring->buf[i];
+            ring->iov[i].iov_len = MAX_RX_BUF_LEN;
+
+            m = &ring->msg[i];
+            bzero(m, sizeof(struct mmsghdr));
+            m->msg_hdr.msg_name = &ring->from[i];
+            m->msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            m->msg_hdr.msg_iov = &ring->iov[i];
+            m->msg_hdr.msg_iovlen = 1;
+        }
 
-    for (i = 0; i < n_dht; i++) {
-        ret = dht[i]->get(dht[i], msg);
-        if (ret != SUCCESS) {
-            continue;
+        n_msg = recvmmsg(fd, ring->msg, MAX_RX_BATCH, MSG_DONTWAIT, NULL);
+        if (n_msg < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                ERROR("recvmmsg() - %s\n", strerror(errno));
+                return FAILURE;
+            }
+            break;
+        }
+
+        timestamp = dht_get_current_time();
+
+        for (i = 0; i < n_msg; i++) {
+            m = &ring->msg[i];
+
+            if ((m->msg_len == 0) || (m->msg_hdr.msg_flags & MSG_TRUNC)) {
+                continue;
+            }
+
+            INFO("received %d bytes from %s:%hu\n", m->msg_len,
+                    inet_ntoa(((struct sockaddr_in *)
+                                    &ring->from[i])->sin_addr), 
+                    ntohs(((struct sockaddr_in *)
+                                    &ring->from[i])->sin_port));
+
+            dht->rpc_rx(dht, &ring->from[i], m->msg_hdr.msg_namelen, 
+                        ring->buf[i], m->msg_len, timestamp);
+        }
+
+        /* send out the replies to this batch together */
+        dht_txq_flush(dht);
+
+        if (n_msg < MAX_RX_BATCH) {
+            break;
         }
-        found = TRUE;
     }
 
-    if (found) {
-        DEBUG("at least one GET was successful\n");
-        return SUCCESS;
-    } 
+    return SUCCESS;
+}
+#else
+int
+tinydht_rpc_read(struct tinydht_worker *w)
+{
+    struct dht *dht = w->dht;
+    int fd = dht->net_if.sock;
+    u8 buf[MAX_RX_BUF_LEN];
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    int len = 0;
+
+    while (TRUE) {
+
+        /* read the data */
+        fromlen = sizeof(struct sockaddr_storage);
+        len = recvfrom(fd, buf, sizeof(buf), 0, 
+                (struct sockaddr *)&from, &fromlen);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                ERROR("recvfrom() - %s\n", strerror(errno));
+                return FAILURE;
+            }
+            break;
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        INFO("received %d bytes from %s:%hu\n", len,
+                inet_ntoa((((struct sockaddr_in *)&from)->sin_addr)), 
+                ntohs(((struct sockaddr_in *)&from)->sin_port));
+
+        dht->rpc_rx(dht, &from, fromlen, buf, len, dht_get_current_time());
+    }
+
+    dht_txq_flush(dht);
+
+    return SUCCESS;
+}
+#endif
+
+/* runs the scheduler of a dht instance, and returns how long (in 
+ * millisecs) its event loop may sleep before it is due again */
+int
+tinydht_task_schedule(struct dht *dht)
+{
+    u64 curr_time = 0;
+    u64 deadline = 0;
+    u64 timeout = 0;
+
+    dht->task_schedule(dht);
+    deadline = dht->next_deadline;
+
+    curr_time = dht_get_current_time();
+
+    if (deadline <= curr_time) {
+        return 0;
+    }
+
+    /* round up, so we never wake up just before the deadline */
+    timeout = (deadline - curr_time + 999)/1000;
+    if (timeout > MAX_POLL_TIMEOUT) {
+        timeout = MAX_POLL_TIMEOUT;
+    }
+
+    return (int)timeout;
+}
+
+int
+tinydht_decode_request(struct tinydht_conn *conn, u32 id, 
+                        u8 *data, size_t len)
+{
+    struct tinydht_msg *msg = NULL;
+
+    ASSERT(conn && data && len);
+
+    if (data[0] == TINYDHT_ACTION_BATCH) {
+        return tinydht_decode_batch(conn, id, data, len);
+    }
+
+    if ((len < offsetof(struct tinydht_msg_req, val)) || 
+            (len > sizeof(struct tinydht_msg_req))) {
+        return FAILURE;
+    }
+
+    msg = tinydht_msg_new(conn, id);
+    if (!msg) {
+        return FAILURE;
+    }
+
+    memcpy(&msg->req, data, len);
+    msg->req.key_len = ntohl(msg->req.key_len);
+    msg->req.val_len = ntohl(msg->req.val_len);
+
+    /* the value must have come in full */
+    if (msg->req.val_len > (len - offsetof(struct tinydht_msg_req, val))) {
+        msg->req.val_len = 0;
+    }
+
+    tinydht_dispatch(msg);
+
+    return SUCCESS;
+}
+
+/* splits a batch up into one msg per item, and hands all the PUTs to the
+ * dht instances together, so they can publish them together */
+int
+tinydht_decode_batch(struct tinydht_conn *conn, u32 id, 
+                        u8 *data, size_t len)
+{
+    struct tinydht_msg_batch_req breq;
+    struct tinydht_msg *msg[MAX_BATCH_ITEMS];
+    size_t off;
+    u32 key_len, val_len;
+    u8 *key = NULL, *val = NULL;
+    int n_msg = 0;
+    int i;
+
+    ASSERT(conn && data);
+
+    off = offsetof(struct tinydht_msg_batch_req, items);
+    if (len < off) {
+        return FAILURE;
+    }
+
+    memcpy(&breq, data, off);
+    breq.n_items = ntohl(breq.n_items);
+
+    if ((breq.n_items == 0) || (breq.n_items > MAX_BATCH_ITEMS)) {
+        return FAILURE;
+    }
+
+    if ((breq.item_action != TINYDHT_ACTION_PUT) 
+            && (breq.item_action != TINYDHT_ACTION_GET)) {
+        return FAILURE;
+    }
+
+    for (n_msg = 0; (u32)n_msg < breq.n_items; n_msg++) {
+
+        if ((len - off) < sizeof(key_len)) {
+            goto err;
+        }
+        memcpy(&key_len, data + off, sizeof(key_len));
+        key_len = ntohl(key_len);
+        off += sizeof(key_len);
+
+        if ((key_len > MAX_KEY_LEN) || ((len - off) < key_len)) {
+            goto err;
+        }
+        key = data + off;
+        off += key_len;
+
+        if ((len - off) < sizeof(val_len)) {
+            goto err;
+        }
+        memcpy(&val_len, data + off, sizeof(val_len));
+        val_len = ntohl(val_len);
+        off += sizeof(val_len);
+
+        if ((val_len > MAX_VAL_LEN) || ((len - off) < val_len)) {
+            goto err;
+        }
+        val = data + off;
+        off += val_len;
+
+        msg[n_msg] = tinydht_msg_new(conn, id + n_msg);
+        if (!msg[n_msg]) {
+            goto err;
+        }
+
+        msg[n_msg]->req.action = breq.item_action;
+        msg[n_msg]->req.key_len = key_len;
+        memcpy(msg[n_msg]->req.key, key, key_len);
+        msg[n_msg]->req.val_len = val_len;
+        memcpy(msg[n_msg]->req.val, val, val_len);
+    }
+
+    if (off != len) {
+        goto err;
+    }
+
+    DEBUG("batch of %d received\n", n_msg);
+
+    /* the batch counts against the limit as a whole, and is taken or 
+     * turned down as one; not counting the hold tinydht_conn_read() has 
+     * on the conn */
+    if (conn->n_pending > (MAX_SERVICE_PENDING + 1)) {
+        ERROR("too many requests pending on fd %d\n", conn->fd);
+        for (i = 0; i < n_msg; i++) {
+            msg[i]->rsp.status = TINYDHT_RESPONSE_FAILURE;
+            msg[i]->rsp.val_len = 0;
+            tinydht_respond(msg[i]);
+        }
+        return SUCCESS;
+    }
+
+    if (breq.item_action == TINYDHT_ACTION_GET) {
+        for (i = 0; i < n_msg; i++) {
+            if (tinydht_get(msg[i]) != SUCCESS) {
+                msg[i]->rsp.status = TINYDHT_RESPONSE_FAILURE;
+                msg[i]->rsp.val_len = 0;
+                tinydht_respond(msg[i]);
+            }
+        }
+        return SUCCESS;
+    }
+
+    /* every one of them is answered, now or once the dht instances are 
+     * done with it */
+    tinydht_put_batch(msg, n_msg);
+
+    return SUCCESS;
+
+err:
+    for (i = 0; i < n_msg; i++) {
+        tinydht_msg_delete(msg[i]);
+    }
 
     return FAILURE;
 }
 
+struct tinydht_msg *
+tinydht_msg_new(struct tinydht_conn *conn, u32 id)
+{
+    struct tinydht_msg *msg = NULL;
+
+    ASSERT(conn);
+
+    msg = (struct tinydht_msg *) malloc(sizeof(struct tinydht_msg));
+    if (!msg) {
+        ERROR("%s\n", strerror(errno));
+        return NULL;
+    }
+
+    bzero(msg, sizeof(struct tinydht_msg));
+    msg->conn = conn;
+    msg->id = id;
+    memcpy(&msg->from, &conn->from, conn->fromlen);
+    msg->fromlen = conn->fromlen;
+
+    conn->n_pending++;
+
+    return msg;
+}
+
+/* frees msg, and with it the conn if that was all the conn waited for */
+void
+tinydht_msg_delete(struct tinydht_msg *msg)
+{
+    struct tinydht_conn *conn = NULL;
+
+    ASSERT(msg && msg->conn);
+
+    conn = msg->conn;
+
+    ASSERT(conn->n_pending > 0);
+    conn->n_pending--;
+
+    if ((conn->fd < 0) && (conn->n_pending == 0)) {
+        tinydht_conn_delete(conn);
+    }
+
+    tinydht_merge_val_flush(msg);
+
+    free(msg);
+}
+
+/* starts off a single PUT or GET, and answers it unless it is still in 
+ * progress */
+void
+tinydht_dispatch(struct tinydht_msg *msg)
+{
+    struct tinydht_conn *conn = NULL;
+    int ret;
+
+    ASSERT(msg && msg->conn);
+
+    conn = msg->conn;
+
+    /* not counting the hold tinydht_conn_read() has on the conn */
+    if (conn->n_pending > (MAX_SERVICE_PENDING + 1)) {
+        ERROR("too many requests pending on fd %d\n", conn->fd);
+        ret = FAILURE;
+        goto respond;
+    }
+
+    switch (msg->req.action) {
+        case TINYDHT_ACTION_PUT:
+            DEBUG("PUT received\n");
+            ret = tinydht_put(msg);
+            break;
+
+        case TINYDHT_ACTION_GET:
+            DEBUG("GET received\n");
+            ret = tinydht_get(msg);
+            break;
+
+        default:
+            ERROR("unknown action %d\n", msg->req.action);
+            ret = FAILURE;
+            break;
+    }
+
+    if (ret == SUCCESS) {
+        /* answered once the dht instances are done with it */
+        return;
+    }
+
+respond:
+    msg->rsp.status = TINYDHT_RESPONSE_FAILURE;
+    msg->rsp.val_len = 0;
+
+    tinydht_respond(msg);
+}
+
+/* a copy of msg for a dht instance to work on, it comes back to 
+ * tinydht_merge() */
+struct tinydht_msg *
+tinydht_msg_copy(struct tinydht_msg *msg)
+{
+    struct tinydht_msg *copy = NULL;
+
+    ASSERT(msg);
+
+    copy = (struct tinydht_msg *) malloc(sizeof(struct tinydht_msg));
+    if (!copy) {
+        ERROR("%s\n", strerror(errno));
+        return NULL;
+    }
+
+    bzero(copy, offsetof(struct tinydht_msg, req));
+    memcpy(&copy->req, &msg->req, sizeof(struct tinydht_msg_req));
+    copy->rsp.status = TINYDHT_RESPONSE_UNKNOWN;
+    copy->rsp.val_len = 0;
+    copy->parent = msg;
+    copy->more = FALSE;
+    copy->n_wait = 0;
+    copy->n_vals = 0;
+    copy->vals = NULL;
+
+    /* for when the service passes on what the copy comes back with */
+    copy->conn = msg->conn;
+    copy->id = msg->id;
+
+    return copy;
+}
+
+/* Hands a copy of each of the n_msg msgs to every dht instance that has 
+ * room for all of them, the PUTs among them as a batch. The msgs are 
+ * answered once all their copies are back, unless none of the instances 
+ * took them (FAILURE), in which case that is up to the caller. */
+int
+tinydht_fanout(struct tinydht_msg **msg, int n_msg)
+{
+    struct tinydht_msg *copy[MAX_BATCH_ITEMS];
+    struct tinydht_worker *w = NULL;
+    int i, j;
+
+    ASSERT(msg && (n_msg > 0) && (n_msg <= MAX_BATCH_ITEMS));
+
+    for (j = 0; j < n_msg; j++) {
+        msg[j]->rsp.status = TINYDHT_RESPONSE_FAILURE;
+        msg[j]->rsp.val_len = 0;
+        msg[j]->n_wait = 0;
+        tinydht_merge_val_flush(msg[j]);
+    }
+
+    for (i = 0; i < n_worker; i++) {
+        w = &worker[i];
+
+        for (j = 0; j < n_msg; j++) {
+            copy[j] = tinydht_msg_copy(msg[j]);
+            if (!copy[j]) {
+                break;
+            }
+            copy[j]->more = (j < (n_msg - 1));
+        }
+
+        if ((j < n_msg) || (tinydht_ring_push(&w->req_ring, copy, n_msg) 
+                                != SUCCESS)) {
+            ERROR("dht instance %d is too busy\n", i);
+            while (j--) {
+                free(copy[j]);
+            }
+            continue;
+        }
+
+        for (j = 0; j < n_msg; j++) {
+            msg[j]->n_wait++;
+        }
+
+        tinydht_wake(w->wake_fd[1]);
+    }
+
+    return (msg[0]->n_wait > 0) ? SUCCESS : FAILURE;
+}
+
+/* takes in the copies the dht instances are done with */
+void
+tinydht_collect(void)
+{
+    struct tinydht_msg *copy = NULL;
+    int i;
+
+    for (i = 0; i < n_worker; i++) {
+        while ((copy = tinydht_ring_pop(&worker[i].rsp_ring))) {
+            tinydht_merge(copy);
+        }
+    }
+}
+
+/* Merges what a copy came back with into the msg it was made from: a PUT 
+ * is successful if any of the dht instances took it, and a GET gets every
+ * value any of them found, each one once, ahead of its final response. */
+void
+tinydht_merge(struct tinydht_msg *copy)
+{
+    struct tinydht_msg *msg = NULL;
+
+    ASSERT(copy && copy->parent);
+
+    msg = copy->parent;
+
+    if ((msg->req.action == TINYDHT_ACTION_GET) 
+            && ((copy->rsp.status == TINYDHT_RESPONSE_PARTIAL)
+                || (copy->rsp.status == TINYDHT_RESPONSE_SUCCESS))) {
+        tinydht_merge_val(msg, copy);
+    }
+
+    if (copy->rsp.status == TINYDHT_RESPONSE_PARTIAL) {
+        free(copy);
+        return;
+    }
+
+    if ((copy->rsp.status == TINYDHT_RESPONSE_SUCCESS) 
+            && (msg->rsp.status != TINYDHT_RESPONSE_SUCCESS)) {
+        memcpy(&msg->rsp, &copy->rsp, sizeof(struct tinydht_msg_rsp));
+    }
+
+    free(copy);
+
+    ASSERT(msg->n_wait > 0);
+    msg->n_wait--;
+
+    if (msg->n_wait == 0) {
+        tinydht_respond(msg);
+    }
+}
+
+/* passes the value of copy on to the client as a PARTIAL, unless another
+ * dht instance has come up with it already; the first one is also the 
+ * value of the final response */
+void
+tinydht_merge_val(struct tinydht_msg *msg, struct tinydht_msg *copy)
+{
+    u8 status;
+    u32 val_len;
+    u32 hash = 2166136261U;
+    u32 i;
+    struct tinydht_merge_val *mv = NULL;
+
+    ASSERT(msg && copy);
+
+    val_len = ntohl(copy->rsp.val_len);
+    if (val_len > MAX_VAL_LEN) {
+        val_len = MAX_VAL_LEN;
+    }
+
+    /* FNV-1a */
+    for (i = 0; i < val_len; i++) {
+        hash = (hash ^ copy->rsp.val[i]) * 16777619U;
+    }
+
+    /* equal hashes only say the values may be the same */
+    for (mv = msg->vals; mv; mv = mv->next) {
+        if ((mv->hash == hash) && (mv->len == val_len) 
+                && !memcmp(mv->val, copy->rsp.val, val_len)) {
+            return;
+        }
+    }
+
+    mv = (struct tinydht_merge_val *) 
+                    malloc(sizeof(struct tinydht_merge_val) + val_len);
+    if (mv) {
+        mv->hash = hash;
+        mv->len = val_len;
+        memcpy(mv->val, copy->rsp.val, val_len);
+        mv->next = msg->vals;
+        msg->vals = mv;
+    } else {
+        /* better the client sees it twice than not at all */
+        ERROR("%s\n", strerror(errno));
+    }
+
+    if (msg->n_vals == 0) {
+        memcpy(&msg->rsp, &copy->rsp, sizeof(struct tinydht_msg_rsp));
+        msg->rsp.status = TINYDHT_RESPONSE_SUCCESS;
+    }
+
+    msg->n_vals++;
+
+    status = copy->rsp.status;
+    copy->rsp.status = TINYDHT_RESPONSE_PARTIAL;
+    tinydht_send_response(copy);
+    copy->rsp.status = status;
+}
+
+/* forgets the GET values sent for msg */
+void
+tinydht_merge_val_flush(struct tinydht_msg *msg)
+{
+    struct tinydht_merge_val *mv = NULL;
+
+    ASSERT(msg);
+
+    while ((mv = msg->vals)) {
+        msg->vals = mv->next;
+        free(mv);
+    }
+
+    msg->n_vals = 0;
+}
+
+/* frames msg->rsp and writes it to the conn msg came in on */
+int
+tinydht_send_response(struct tinydht_msg *msg)
+{
+    struct tinydht_conn *conn = NULL;
+    struct tinydht_msg_hdr hdr;
+    u8 buf[sizeof(struct tinydht_msg_hdr) + sizeof(struct tinydht_msg_rsp)];
+    size_t len;
+    u32 val_len;
+
+    ASSERT(msg && msg->conn);
+
+    conn = msg->conn;
+
+    /* the client may have gone away in the meantime */
+    if (conn->fd < 0) {
+        return FAILURE;
+    }
+
+    val_len = ntohl(msg->rsp.val_len);
+    if (val_len > MAX_VAL_LEN) {
+        val_len = MAX_VAL_LEN;
+    }
+    len = offsetof(struct tinydht_msg_rsp, val) + val_len;
+
+    hdr.len = htonl(len);
+    hdr.id = htonl(msg->id);
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &msg->rsp, len);
+
+    return tinydht_conn_write(conn, buf, sizeof(hdr) + len);
+}
+
+/* Sends out the final response to msg, and frees msg. In a dht instance 
+ * thread, msg is a copy, and goes back to the service instead. */
+int
+tinydht_respond(struct tinydht_msg *msg)
+{
+    struct tinydht_worker *w = tinydht_self;
+    struct timespec ts;
+    int ret;
+
+    ASSERT(msg && msg->conn);
+
+    if (w) {
+        /* the service never waits on us, so it is bound to make room */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000*1000;
+        while (tinydht_ring_push(&w->rsp_ring, &msg, 1) != SUCCESS) {
+            if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+                /* nobody is listening any more */
+                return FAILURE;
+            }
+            tinydht_wake(svc_wake_fd[1]);
+            nanosleep(&ts, NULL);
+        }
+        tinydht_wake(svc_wake_fd[1]);
+        return SUCCESS;
+    }
+
+    ret = tinydht_send_response(msg);
+
+    tinydht_msg_delete(msg);
+
+    return ret;
+}
+
+/* sends out a response to msg ahead of the final one, msg stays pending;
+ * from a dht instance thread, it is a copy of the response that goes back
+ * to the service, and it is dropped if the service is behind */
+int
+tinydht_respond_partial(struct tinydht_msg *msg)
+{
+    struct tinydht_worker *w = tinydht_self;
+    struct tinydht_msg *copy = NULL;
+
+    ASSERT(msg && (msg->rsp.status == TINYDHT_RESPONSE_PARTIAL));
+
+    if (w) {
+        copy = tinydht_msg_copy(msg);
+        if (!copy) {
+            return FAILURE;
+        }
+        copy->parent = msg->parent;
+        memcpy(&copy->rsp, &msg->rsp, sizeof(struct tinydht_msg_rsp));
+
+        if (tinydht_ring_push(&w->rsp_ring, &copy, 1) != SUCCESS) {
+            free(copy);
+            return FAILURE;
+        }
+        tinydht_wake(svc_wake_fd[1]);
+        return SUCCESS;
+    }
+
+    return tinydht_send_response(msg);
+}
+
+bool
+tinydht_put_is_valid(struct tinydht_msg *msg)
+{
+    if ((msg->req.key_len <= 0) || (msg->req.key_len > MAX_KEY_LEN) ||
+            (msg->req.val_len <= 0) || (msg->req.val_len > MAX_VAL_LEN)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int
+tinydht_put(struct tinydht_msg *msg)
+{
+    if (!tinydht_put_is_valid(msg)) {
+        return FAILURE;
+    }
+
+    return tinydht_fanout(&msg, 1);
+}
+
+/* does the PUTs of a batch, and answers every one of them, now or once 
+ * the dht instances are done with it: a PUT is successful if at least 
+ * one dht instance took it */
+int
+tinydht_put_batch(struct tinydht_msg **msg, int n_msg)
+{
+    struct tinydht_msg *valid[MAX_BATCH_ITEMS];
+    int n_valid = 0;
+    int j;
+
+    ASSERT(msg && (n_msg <= MAX_BATCH_ITEMS));
+
+    for (j = 0; j < n_msg; j++) {
+        if (tinydht_put_is_valid(msg[j])) {
+            valid[n_valid++] = msg[j];
+            continue;
+        }
+        msg[j]->rsp.status = TINYDHT_RESPONSE_FAILURE;
+        msg[j]->rsp.val_len = 0;
+        tinydht_respond(msg[j]);
+    }
+
+    if ((n_valid == 0) || (tinydht_fanout(valid, n_valid) == SUCCESS)) {
+        return SUCCESS;
+    }
+
+    for (j = 0; j < n_valid; j++) {
+        tinydht_respond(valid[j]);
+    }
+
+    return FAILURE;
+}
+
+int
+tinydht_get(struct tinydht_msg *msg)
+{
+    if ((msg->req.key_len <= 0) || (msg->req.key_len > MAX_KEY_LEN)) {
+        return FAILURE;
+    }
+
+    return tinydht_fanout(&msg, 1);
+}
+
 int
 tinydht_usage(const char *cmd)
 {
-    printf("usage: %s -i <interface>\n", cmd);
+    printf("usage: %s -i <interface> [-l <logfile>] [-v <level>] "
+            "[-s <snapshot>]\n", cmd);
+    printf("\tlevel: 0 none, 1 error, 2 info (default), 3 debug\n");
+    printf("\tsnapshot: routing table and local values are saved to, and "
+            "restored from, <snapshot>.<n>\n");
+    printf("\tsend SIGUSR1 to cycle the level at runtime\n");
     return SUCCESS;
 }
 
 /* Rate-limiting */
+/* shared by all the dht instance threads */
 void
 tinydht_net_usage_update(size_t size)
 {
-    n_rx_tx += size;
+    __atomic_fetch_add(&n_rx_tx, size, __ATOMIC_RELAXED);
 }
 
 bool
 tinydht_rate_limit_allow(void)
 {
-    static u64 prev_time = 0;
     u64 curr_time = 0;
     u64 elapsed = 0;
 
     curr_time = dht_get_current_time();
 
-    if (prev_time == 0) {
-        prev_time = curr_time;
+    if (n_rx_tx_start == 0) {
+        n_rx_tx_start = curr_time;
         return TRUE;
     }
 
-    elapsed = (curr_time - prev_time)/1000;
+    elapsed = (curr_time - n_rx_tx_start)/1000;
 
     // DEBUG("elapsed %lld size %lld\n", elapsed, n_rx_tx);
     // DEBUG("result %lld\n", (elapsed*(RATE_LIMIT_BITS_PER_SEC/1000)));
 
-    if ((elapsed*(RATE_LIMIT_BITS_PER_SEC/1000)) < (n_rx_tx*8)) {
+    if ((elapsed*(RATE_LIMIT_BITS_PER_SEC/1000)) 
+            < (__atomic_load_n(&n_rx_tx, __ATOMIC_RELAXED)*8)) {
         return FALSE;
     }
 
@@ -912,6 +2459,5 @@ tinydht_rate_limit_allow(void)
 u64
 tinydht_alloc_oid(void)
 {
-    tinydht_oid++;
-    return tinydht_oid;
+    return __atomic_add_fetch(&tinydht_oid, 1, __ATOMIC_RELAXED);
 }
@@ -24,16 +24,36 @@
 
 struct task;
 struct task_list_head;
+struct tinydht_conn;
 
 #define TINYDHT_SERVICE         ((u16)65521)
 
 #define MAX_SERVICE_FD          2
+#define MAX_SERVICE_CONN        32      /* open client connections */
+#define MAX_SERVICE_PENDING     64      /* outstanding requests per conn */
 
 #define MAX_DHT_INSTANCE        4
-#define MAX_POLL_FD             16
+/* the dht instances come and go through here while they are set up, and
+ * then move on to threads of their own, see struct tinydht_worker */
+#define MAX_POLL_FD             (MAX_DHT_INSTANCE + MAX_SERVICE_FD \
+                                    + MAX_SERVICE_CONN + 1)
 #define MAX_DHT_NET_IF          MAX_DHT_INSTANCE
 
-#define MAX_POLL_TIMEOUT        100     /* millisecs */
+/* requests on their way to a dht instance thread, and answers on their 
+ * way back, a power of 2 */
+#define TINYDHT_RING_SIZE       4096
+
+#define MAX_POLL_TIMEOUT        1000    /* millisecs, when idle */
+
+/* use the edge-triggered epoll backend and batched datagram i/o where
+ * available, otherwise fall back to poll() and recvfrom()/sendto() */
+#ifdef __linux__
+#define TINYDHT_USE_EPOLL
+#define TINYDHT_USE_MMSG
+#endif
+
+#define MAX_RX_BATCH            32      /* datagrams per recvmmsg() */
+#define MAX_RX_BUF_LEN          2048
 
 #define MAX_KEY_LEN             32
 #define MAX_VAL_LEN             1024
@@ -44,15 +64,32 @@ struct task_list_head;
 enum tinydht_action_type {
     TINYDHT_ACTION_UNKNOWN = 0,
     TINYDHT_ACTION_PUT,
-    TINYDHT_ACTION_GET
+    TINYDHT_ACTION_GET,
+    TINYDHT_ACTION_BATCH
 };
 
 enum tinydht_response_type {
     TINYDHT_RESPONSE_UNKNOWN = 0,
     TINYDHT_RESPONSE_SUCCESS,
-    TINYDHT_RESPONSE_FAILURE
+    TINYDHT_RESPONSE_FAILURE,
+    TINYDHT_RESPONSE_PARTIAL        /* one value, more responses follow */
 };
 
+/* Client connections are persistent. Every request and response on them 
+ * is preceded by this header: len is the size of the message that follows
+ * (a tinydht_msg_req, or a tinydht_msg_rsp, without the unused part of 
+ * val), and id is chosen by the client and echoed in the response. 
+ * Responses come back as requests complete, not in request order. Both 
+ * fields are in network byte order, like key_len and val_len. 
+ *
+ * A GET may be answered with any number of PARTIAL responses, one for 
+ * each value as soon as the lookup finds it, before the final SUCCESS 
+ * (which repeats the first value) or FAILURE. */
+struct tinydht_msg_hdr {
+    u32                         len;
+    u32                         id;
+} __attribute__ ((__packed__));
+
 struct tinydht_msg_req {
     u8                          action;
     u32                         key_len;
@@ -67,15 +104,59 @@ struct tinydht_msg_rsp {
     u8                          val[MAX_VAL_LEN];
 } __attribute__ ((__packed__));
 
+/* A batch carries n_items PUTs or GETs (item_action) in one request. The
+ * items follow it back to back, each one a key_len, the key, a val_len and
+ * the value, without the unused part of key and val (val_len is 0 for 
+ * GET). Item i is answered as if it had come in on its own with id + i. */
+struct tinydht_msg_batch_req {
+    u8                          action;
+    u8                          item_action;
+    u32                         n_items;
+    u8                          items[];
+} __attribute__ ((__packed__));
+
+#define MAX_BATCH_ITEMS         64
+#define MAX_SERVICE_REQ_LEN     (16*1024)   /* the largest batch */
+
+#define MAX_SERVICE_BUF_LEN     (2*(sizeof(struct tinydht_msg_hdr) \
+                                    + MAX_SERVICE_REQ_LEN))
+
+/* responses queued up for a client that is slow to read them */
+#define MAX_SERVICE_WBUF_LEN    (256*1024)
+
+/* a GET value that has gone out to the client already, kept so that 
+ * the same one from another dht instance is not sent again */
+struct tinydht_merge_val {
+    struct tinydht_merge_val    *next;
+    u32                         hash;
+    u32                         len;
+    u8                          val[];
+};
+
+/* Every dht instance gets a copy of a request to work on in its own 
+ * thread, and the service merges what the copies come back with into the
+ * response to the request they were made from. */
 struct tinydht_msg {
-    int                         sock;
+    TAILQ_ENTRY(tinydht_msg)    next;
+    struct tinydht_conn         *conn;      /* it came in on */
+    u32                         id;
     struct sockaddr_storage     from;
     size_t                      fromlen;
     struct tinydht_msg_req      req;
     struct tinydht_msg_rsp      rsp;
+    /* of a copy */
+    struct tinydht_msg          *parent;
+    bool                        more;       /* more PUTs of its batch follow */
+    /* of a request */
+    int                         n_wait;     /* copies not back yet */
+    int                         n_vals;     /* GET values sent so far */
+    struct tinydht_merge_val    *vals;      /* and what they were */
 };
 
 int tinydht_add_poll_fd(int fd);
+int tinydht_del_poll_fd(int fd);
+int tinydht_respond(struct tinydht_msg *msg);
+int tinydht_respond_partial(struct tinydht_msg *msg);
 int tinydht_add_task(struct task *task);
 void tinydht_net_usage_update(size_t size);
 bool tinydht_rate_limit_allow(void);
@@ -27,31 +27,51 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "tinydht.h"
 #include "crypto.h"
 
 #define MAX_KEYS        5
 
+/* read exactly len bytes off the stream */
+static int
+recv_all(int sock, void *buf, size_t len)
+{
+    size_t off = 0;
+    int ret;
+
+    while (off < len) {
+        ret = recv(sock, (char *)buf + off, len - off, 0);
+        if (ret <= 0) {
+            return -1;
+        }
+        off += ret;
+    }
+
+    return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
     int sock;
     struct sockaddr_in addr4;
     int ret;
+    struct tinydht_msg_hdr hdr;
     struct tinydht_msg_req req;
     struct tinydht_msg_rsp rsp;
-    char key[256];
+    size_t len;
+    u32 id;
+    int n;
+    int i;
 
-    if (argc != 2) {
-        printf("usage: %s <key>\n", argv[0]);
+    if (argc < 2) {
+        printf("usage: %s <key> [<key> ...]\n", argv[0]);
         exit(1);
     }
 
-    bzero(key, sizeof(key));
-    memcpy(key, argv[1], sizeof(key)-1);
-
-    /* do a GET on TinyDHT */
+    /* do the GETs on TinyDHT, all of them over one connection */
     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0) {
         perror("socket()");
@@ -74,24 +94,61 @@ main(int argc, char *argv[])
         return -1;
     }
 
-    bzero(&req, sizeof(req));
-    req.action = TINYDHT_ACTION_GET;
-    strncpy((char *)req.key, (char *)key, MAX_KEY_LEN);
-    req.key_len = htonl(strlen(key));
+    /* send all the requests first, the id is the request's index */
+    for (i = 1, n = 0; i < argc; i += 1, n++) {
+        bzero(&req, sizeof(req));
+        req.action = TINYDHT_ACTION_GET;
+        memcpy(req.key, argv[i], strnlen(argv[i], MAX_KEY_LEN));
+        req.key_len = htonl(strnlen(argv[i], MAX_KEY_LEN));
+        len = offsetof(struct tinydht_msg_req, val);
 
-    DEBUG("GET send\n");
-    ret = send(sock, &req, sizeof(req), 0);
-    if (ret < 0 || ret != sizeof(req)) {
-        perror("send()");
-        return -1;
+        DEBUG("GET send %d - key(%s)\n", n, argv[i]);
+
+        hdr.len = htonl(len);
+        hdr.id = htonl(n);
+
+        ret = send(sock, &hdr, sizeof(hdr), 0);
+        if (ret < 0 || ret != sizeof(hdr)) {
+            perror("send()");
+            return -1;
+        }
+
+        ret = send(sock, &req, len, 0);
+        if (ret < 0 || ret != (int)len) {
+            perror("send()");
+            return -1;
+        }
     }
 
-    ret = recv(sock, &rsp, sizeof(rsp), 0);
-    if (ret < 0 || ret != sizeof(rsp)) {
-        perror("recv()");
-        return -1;
+    /* responses come back in whatever order the requests complete, values 
+     * stream in as PARTIAL responses ahead of each GET's final one */
+    for (n = 0; n < argc - 1; ) {
+        if (recv_all(sock, &hdr, sizeof(hdr)) < 0) {
+            perror("recv()");
+            return -1;
+        }
+
+        len = ntohl(hdr.len);
+        id = ntohl(hdr.id);
+        if ((len > sizeof(rsp)) || (id >= (u32)(argc - 1))) {
+            printf("bad response\n");
+            return -1;
+        }
+
+        bzero(&rsp, sizeof(rsp));
+        if (recv_all(sock, &rsp, len) < 0) {
+            perror("recv()");
+            return -1;
+        }
+
+        rsp.val[MAX_VAL_LEN-1] = '\0';
+        DEBUG("GET recv %u - key(%s) status %d -> val(%s)\n", 
+                id, argv[1 + id], rsp.status, rsp.val);
+
+        if (rsp.status != TINYDHT_RESPONSE_PARTIAL) {
+            n++;
+        }
     }
-    DEBUG("GET recv %d - key(%s) -> val(%s)\n", rsp.status, req.key, rsp.val);
 
     close(sock);
 
@@ -27,29 +27,75 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "tinydht.h"
 #include "crypto.h"
 
 #define MAX_KEYS        5
 
-const char * key[] = {
-    "key1",
-    "key2",
-    "key3",
-    "key4",
-    "key5",
-    (char *)0
-};
-
-const char * value[] = {
-    "value1",
-    "value2",
-    "value3",
-    "value4",
-    "value5",
-    (char *)0
-};
+/* sends the n_items key/value pairs in argv as a single batch request */
+static int
+send_batch(int sock, char *argv[], int n_items)
+{
+    static u8 buf[sizeof(struct tinydht_msg_hdr) + MAX_SERVICE_REQ_LEN];
+    struct tinydht_msg_hdr hdr;
+    struct tinydht_msg_batch_req breq;
+    size_t off, len;
+    u32 l;
+    int i;
+
+    off = sizeof(hdr) + offsetof(struct tinydht_msg_batch_req, items);
+
+    for (i = 0; i < 2*n_items; i++) {
+        len = strnlen(argv[i], (i % 2) ? MAX_VAL_LEN : MAX_KEY_LEN);
+        if ((off + sizeof(l) + len) > sizeof(buf)) {
+            printf("batch too large\n");
+            return -1;
+        }
+        l = htonl(len);
+        memcpy(buf + off, &l, sizeof(l));
+        memcpy(buf + off + sizeof(l), argv[i], len);
+        off += sizeof(l) + len;
+    }
+
+    breq.action = TINYDHT_ACTION_BATCH;
+    breq.item_action = TINYDHT_ACTION_PUT;
+    breq.n_items = htonl(n_items);
+    memcpy(buf + sizeof(hdr), &breq, 
+            offsetof(struct tinydht_msg_batch_req, items));
+
+    hdr.len = htonl(off - sizeof(hdr));
+    hdr.id = htonl(0);
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    DEBUG("PUT send batch of %d\n", n_items);
+
+    if (send(sock, buf, off, 0) != (int)off) {
+        perror("send()");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* read exactly len bytes off the stream */
+static int
+recv_all(int sock, void *buf, size_t len)
+{
+    size_t off = 0;
+    int ret;
+
+    while (off < len) {
+        ret = recv(sock, (char *)buf + off, len - off, 0);
+        if (ret <= 0) {
+            return -1;
+        }
+        off += ret;
+    }
+
+    return 0;
+}
 
 int
 main(int argc, char *argv[])
@@ -57,23 +103,34 @@ main(int argc, char *argv[])
     int sock;
     struct sockaddr_in addr4;
     int ret;
+    struct tinydht_msg_hdr hdr;
     struct tinydht_msg_req req;
     struct tinydht_msg_rsp rsp;
-    char key[256];
-    char value[256];
+    size_t len;
+    u32 id;
+    char *cmd = argv[0];
+    int batch = 0;
+    int n_items;
+    int n;
+    int i;
+
+    /* -b sends all the pairs as one batch request */
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        batch = 1;
+        argv++;
+        argc--;
+    }
 
-    if (argc != 3) {
-        printf("usage: %s <key> <value>\n", argv[0]);
+    if ((argc < 3) || ((argc % 2) == 0) 
+            || (batch && (((argc - 1)/2) > MAX_BATCH_ITEMS))) {
+        printf("usage: %s [-b] <key> <value> [<key> <value> ...]\n", 
+                cmd);
         exit(1);
     }
 
-    bzero(key, sizeof(key));
-    memcpy(key, argv[1], sizeof(key)-1);
+    n_items = (argc - 1)/2;
 
-    bzero(value, sizeof(value));
-    memcpy(value, argv[2], sizeof(value)-1);
-
-    /* do a PUT on TinyDHT */
+    /* do the PUTs on TinyDHT, all of them over one connection */
     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0) {
         perror("socket()");
@@ -96,26 +153,62 @@ main(int argc, char *argv[])
         return -1;
     }
 
-    bzero(&req, sizeof(req));
-    req.action = TINYDHT_ACTION_PUT;
-    strncpy((char *)req.key, (char *)key, MAX_KEY_LEN);
-    req.key_len = htonl(strlen(key));
-    strncpy((char *)req.val, (char *)value, MAX_KEY_LEN);
-    req.val_len = htonl(strlen(value));
-
-    DEBUG("PUT send - key(%s) -> val(%s)\n", req.key, req.val);
-    ret = send(sock, &req, sizeof(req), 0);
-    if (ret < 0 || ret != sizeof(req)) {
-        perror("send()");
+    if (batch && (send_batch(sock, &argv[1], n_items) < 0)) {
         return -1;
     }
 
-    ret = recv(sock, &rsp, sizeof(rsp), 0);
-    if (ret < 0 || ret != sizeof(rsp)) {
-        perror("recv()");
-        return -1;
+    /* send all the requests first, the id is the request's index */
+    for (i = 1, n = 0; !batch && (i < argc); i += 2, n++) {
+        bzero(&req, sizeof(req));
+        req.action = TINYDHT_ACTION_PUT;
+        memcpy(req.key, argv[i], strnlen(argv[i], MAX_KEY_LEN));
+        req.key_len = htonl(strnlen(argv[i], MAX_KEY_LEN));
+        memcpy(req.val, argv[i+1], strnlen(argv[i+1], MAX_VAL_LEN));
+        req.val_len = htonl(strnlen(argv[i+1], MAX_VAL_LEN));
+        len = offsetof(struct tinydht_msg_req, val) 
+                + strnlen(argv[i+1], MAX_VAL_LEN);
+
+        DEBUG("PUT send %d - key(%s) -> val(%s)\n", n, argv[i], argv[i+1]);
+
+        hdr.len = htonl(len);
+        hdr.id = htonl(n);
+
+        ret = send(sock, &hdr, sizeof(hdr), 0);
+        if (ret < 0 || ret != sizeof(hdr)) {
+            perror("send()");
+            return -1;
+        }
+
+        ret = send(sock, &req, len, 0);
+        if (ret < 0 || ret != (int)len) {
+            perror("send()");
+            return -1;
+        }
+    }
+
+    /* responses come back in whatever order the requests complete */
+    for (n = 0; n < n_items; n++) {
+        if (recv_all(sock, &hdr, sizeof(hdr)) < 0) {
+            perror("recv()");
+            return -1;
+        }
+
+        len = ntohl(hdr.len);
+        id = ntohl(hdr.id);
+        if ((len > sizeof(rsp)) || (id >= (u32)n_items)) {
+            printf("bad response\n");
+            return -1;
+        }
+
+        bzero(&rsp, sizeof(rsp));
+        if (recv_all(sock, &rsp, len) < 0) {
+            perror("recv()");
+            return -1;
+        }
+
+        DEBUG("PUT recv %u - key(%s) status %d\n", 
+                id, argv[1 + 2*id], rsp.status);
     }
-    DEBUG("PUT recv %d\n", rsp.status);
 
     close(sock);
 